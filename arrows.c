@@ -2,11 +2,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#include "line_edit.h"
 
 #define HISTORY_SIZE 100
 
 static struct termios old, current;
-char history[HISTORY_SIZE][1000]; // Command history
+char* history[HISTORY_SIZE]; // Command history
 int history_count = 0; // Number of commands stored in history
 int history_index = 0; // Index for cycling through history
 
@@ -35,7 +38,8 @@ char getch_(int echo) //--------------------------------------------------------
 {
   char ch;
   initTermios(echo);
-  ch = getchar();
+  if (read(STDIN_FILENO, &ch, 1) != 1) /* not getchar, so stdio holds nothing back */
+    ch = EOF;
   resetTermios();
   return ch;
 }
@@ -49,103 +53,75 @@ char getch(void) //-------------------------------------------------------------
 /* Add a command to history */
 void add_to_history(const char *cmd) {
     if (history_count == HISTORY_SIZE) {
+        free(history[0]);
         for (int i = 1; i < HISTORY_SIZE; i++) {
-            strcpy(history[i - 1], history[i]);
+            history[i - 1] = history[i];
         }
         history_count--;
     }
-    strcpy(history[history_count], cmd);
+    history[history_count] = strdup(cmd);
     history_count++;
     history_index = history_count; // Reset history index
 }
 
 
-/* Read arrow key input */
-char read_arrow_key() 
+/* Read a key, escape sequences are decoded by le_read_key() in line_edit.c */
+int read_arrow_key() 
 {
-	// up is ^[[A and down is ^[[B
-    char escape = 27;	// ' ^[ '
-    char bracket = '[';
-    char key = getch();
-    if (key == escape) 
-	{
-        key = getch();
-        if (key == bracket) 
-		{
-			key = getch();
-			printf("\n-------->%c<-", key);
-			switch (key) 
-			{
-				case 'A': // Up arrow
-					if (history_index > 0) 
-					{
-						history_index--;
-						return 'U';
-					}
-					break;
-				case 'B': // Down arrow
-					if (history_index < history_count) 
-					{
-						history_index++;
-						return 'D';
-					}
-					break;
-			}
-        }
-    }
-    return key;
+	int key;
+	
+	initTermios(0);
+	key = le_read_key(STDIN_FILENO);
+	resetTermios();
+	return key;
 }
 
-/* Get command from user */
-void get_command(char* cmd) {
-    char ch;
-	char escape = 27;
-    int pos = 0;
-    do 
-	{
-        ch = read_arrow_key();
-		printf("\n-------->%c", ch);
-        if (ch == 'U' || ch == 'D') {
-            // Erase current line
-            for (int i = 0; i < pos; i++) {
-                printf("\b \b");
-            }
-            // Print new command from history
-            if (ch == 'U' && history_index > 0) {
+/* Get command from user, edited in a gap buffer (see line_edit.c) */
+char* get_command(int prompt_len) {
+    struct line_editor ed;
+    int ch;
+    char* cmd;
+
+    le_begin(&ed, prompt_len);
+    while ((ch = read_arrow_key()) != '\n') {
+        if (ch == EOF) {
+            resetTermios();
+            exit(0);
+        }
+        if (ch == KEY_UP || ch == KEY_DOWN) {
+            if (ch == KEY_UP && history_index > 0) {
                 history_index--;
-            } else if (ch == 'D' && history_index < history_count) {
+            } else if (ch == KEY_DOWN && history_index < history_count) {
                 history_index++;
+            } else {
+                continue;
             }
-            strcpy(cmd, history[history_index]);
-            printf("%s", cmd);
-            pos = strlen(cmd);
+            le_set(&ed, history_index < history_count ? history[history_index] : "");
+        } else if (ch >= 32 && ch <= 126) { // Printable characters
+            char c = ch;
+            le_insert(&ed, &c, 1);
         } else {
-            // Handle other characters
-            if (ch == '\n') {
-                cmd[pos] = '\0'; // Null-terminate string
-                add_to_history(cmd);
-                printf("\n");
-                return;
-            } else if (ch == 127 && pos > 0) { // Backspace
-                printf("\b \b");
-                pos--;
-            } else if (ch >= 32 && ch <= 126) { // Printable characters
-                printf("%c", ch);
-                cmd[pos++] = ch;
-            }
+            le_handle_key(&ed, ch);
         }
-    } while (ch != '\n' && ch != escape);
-    // } while (ch != '\n' && pos < 999);
-    cmd[pos] = '\0'; // Null-terminate string if buffer is full
+    }
+
+    le_move(&ed, gb_length(&ed.gb));
+    printf("\n");
+    cmd = gb_text(&ed.gb);
+    le_end(&ed);
+    add_to_history(cmd);
+    return cmd;
 }
 
 int main() {
-    char input[1000];
+    char* input;
     initTermios(0); // Disable echo mode
     while (1) {
-        printf("$ ");
-        get_command(input);
+        int prompt_len = printf("$ ");
+        fflush(stdout);
+        input = get_command(prompt_len);
         printf("You entered: %s\n", input);
+        free(input);
     }
     resetTermios(); // Restore terminal settings before exiting
     return 0;
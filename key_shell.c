@@ -21,22 +21,24 @@
 #include <fcntl.h>
 #include <termios.h>
 
+#include "line_edit.h"
+
 #define HISTORY_SIZE 100 			// max number of cmds
 
 static struct termios old, current;
 
-char history[HISTORY_SIZE][1000]; 	// stores cmd history
+char* history[HISTORY_SIZE]; 		// stores cmd history
 int history_count = 0;				// number of cmds
 int history_index = 0; 				// index for cycling through history
 
 // Greeting shell during startup 
 void init_shell();
 
-// Function to print Current Directory. 
-void print_dir();
+// Function to print Current Directory. Returns the length of the prompt.
+int print_dir();
 
-// Reads and copies command line input into a string, str. 
-int get_input(char* str);
+// Reads command line input into a new string, *str. Returns 1 for a blank line.
+int get_input(char** str, int prompt_len);
 
 // Handles the built-in commands exit and cd.
 int builtin_cmd_handler(char** tokens);
@@ -56,8 +58,8 @@ void print_history();
 // Function to add a command to history
 void add_to_history(const char *cmd);
 
-// Read arrow key input 
-char read_arrow_key();
+// Read a key, special keys come back as the KEY_ codes from line_edit.h
+int read_arrow_key();
 
 void initTermios(int echo);
 
@@ -70,6 +72,7 @@ char getch(void);
 int main(int argc, char *argv[]) 
 { 
 	char input[1000];
+	char* line = NULL;
 	char* token_args[100];
 	
 	
@@ -101,15 +104,15 @@ int main(int argc, char *argv[])
 		init_shell();
 		while (1)
 		{
-			print_dir();
+			int prompt_len = print_dir();
 			
 			// take the entire line of input
-			if (get_input(input) == 0) 
+			if (get_input(&line, prompt_len) == 0) 
 				//continue; 
 			
 			{
 				// Parse and execute the command
-				parse_string(input, token_args);
+				parse_string(line, token_args);
 			}
 		} 
 	}
@@ -130,103 +133,82 @@ void init_shell()
     printf("\n\n\n\n------------------------------------------\n"); 
 } 
 
-void print_dir() 
+int print_dir() 
 { 
     char cwd[1024]; 
     getcwd(cwd, sizeof(cwd)); 
-    printf("%s$ ", cwd); 
+    return printf("%s$ ", cwd); 
 } 
 
-int get_input(char* str) 
+/*
+	Edits the line with the gap buffer editor from line_edit.c, so the cursor
+	can move around and text can be typed or deleted anywhere in it. Up and
+	down bring back commands from the history for editing.
+*/
+int get_input(char** str, int prompt_len) 
 { 
-    char ch;
-    int pos = 0;	// position in 
-	int non_space = 0; // flag to track if non-space characters are encountered
-    do 
+	struct line_editor ed;
+    int ch;
+	
+	le_begin(&ed, prompt_len);
+    while ((ch = read_arrow_key()) != '\n') 
 	{
-        ch = read_arrow_key();
-        if (ch == 'U' || ch == 'D') 
+		if (ch == EOF)
 		{
-            for (int i = 0; i < pos; i++) {
-                printf("\b \b"); // Overwrite previous characters with spaces
-            }
+			le_end(&ed);
+			printf("\n");
+			exit(0);
+		}
+		
+        if (ch == KEY_UP || ch == KEY_DOWN) 
+		{
+			if (ch == KEY_UP && history_index > 0)
+				history_index--;
+			else if (ch == KEY_DOWN && history_index < history_count)
+				history_index++;
+			else
+				continue;
 			
-            printf("%s", history[history_index]);  // print command with prompt
-            fflush(stdout); // Flush output
-            pos = strlen(history[history_index]);
-            strcpy(str, history[history_index]);
+			le_set(&ed, history_index < history_count ? history[history_index] : "");
         } 
-		else 
+		else if (ch >= 32 && ch <= 126) // printable characters
+		{ 
+			char c = ch;
+			le_insert(&ed, &c, 1);
+		}
+		else
 		{
-            // Handle other characters
-			if (ch > 32 && ch <= 126)
-				non_space = 1;
-            if (ch == '\n') 
-			{
-                if (pos == 0 || str == NULL  || !non_space) 
-				{
-                    printf("\n");	// a new line for the directory
-					return 1;
-                } 
-				else 
-				{
-                    str[pos] = '\0'; // Null-terminate string
-                    printf("\n");
-                    add_to_history(str);
-                }
-                return 0;
-            } 
-			else if (ch == 127 && pos >= 0) // backspace
-			{ 
-                printf("\b \b");
-                pos--;
-            } 
-			else if (ch >= 32 && ch <= 126) // printable characters
-			{ 
-                printf("%c", ch);
-                str[pos++] = ch;
-            }
-        }
-    } while (ch != '\n' && pos < 999);
-    str[pos] = '\0'; // Null-terminate string if buffer is full
+			le_handle_key(&ed, ch);
+		}
+    }
+	
+	le_move(&ed, gb_length(&ed.gb));
+	printf("\n");
+	
+	free(*str);
+	*str = gb_text(&ed.gb);
+	le_end(&ed);
+	
+	// a blank line just gets a new prompt
+	if (strspn(*str, " \t") == strlen(*str))
+		return 1;
+	
+	add_to_history(*str);
 	return 0;
 }
 
-
-
-char read_arrow_key() 
+/*
+	Reads in a key with le_read_key() from line_edit.c, which decodes the 
+	escape sequences of the editing keys into KEY_ codes.
+*/
+int read_arrow_key() 
 {
-	// up is ^[[A and down is ^[[B
-    char escape = 27;	// ' ^[ '
-    char bracket = '[';
-    char key = getch();
-    if (key == escape) 
-	{
-        key = getch();
-        if (key == bracket) 
-		{
-			key = getch();
-			switch (key) 
-			{
-				case 'A': // Up arrow
-					if (history_index > 0) 
-					{
-						history_index--;
-						return 'U';
-					}
-					break;
-				case 'B': // Down arrow
-					if (history_index < history_count) 
-					{
-						history_index++;
-						return 'D';
-					}
-					break;
-			}
-        }
-    }
+	int key;
 	
-    //return key;
+	initTermios(0);
+	key = le_read_key(STDIN_FILENO);
+	resetTermios();
+	return key;
 }
 
 /* Initialize new terminal i/o settings */
@@ -254,7 +236,8 @@ char getch_(int echo) //--------------------------------------------------------
 {
   char ch;
   initTermios(echo);
-  ch = getchar();
+  if (read(STDIN_FILENO, &ch, 1) != 1) /* not getchar, so stdio holds nothing back */
+    ch = EOF;
   resetTermios();
   return ch;
 }
@@ -331,13 +314,14 @@ void add_to_history(const char *cmd)
     // Check if history is full, if so, remove the oldest command
     if (history_count == HISTORY_SIZE) 
 	{
+		free(history[0]);
         for (int i = 1; i < HISTORY_SIZE; i++) 
 		{
-            strcpy(history[i - 1], history[i]);
+            history[i - 1] = history[i];
         }
         history_count--;
     }
-    strcpy(history[history_count], cmd);
+    history[history_count] = strdup(cmd);
     history_count++;
 	history_index = history_count;
 }
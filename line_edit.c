@@ -0,0 +1,618 @@
+/*
+	Line editing shared by the shells.
+
+	The line is kept in a gap buffer. The text before the cursor sits at the
+	start of the array and the text after the cursor at the end, with the
+	free space (the gap) in between. Typing at the cursor just fills in the
+	gap and deleting widens it, so editing in the middle of a long command
+	costs the same as typing at the end. Moving the cursor only moves the
+	characters it passes over to the other side of the gap. When the gap
+	runs out the buffer doubles, so inserts are O(1) amortized and a line
+	can be as long as memory allows.
+
+	The le_* functions make a change to the buffer and then update the
+	terminal to match. They work out the row and column of every position
+	from the prompt length and the terminal width, so a line that wraps
+	over several rows can still be edited anywhere.
+
+	Keys are read with le_read_key(), which turns the escape sequences the
+	terminal sends for the arrow keys and friends into KEY_ codes. It reads
+	the descriptor directly instead of going through stdio, so poll() sees
+	exactly the bytes that haven't been decoded yet.
+
+	With bracketed paste on, the terminal wraps pasted text in ^[[200~ and
+	^[[201~. le_read_paste() takes everything in between with large reads 
+	instead of key by key, so a paste can be put in the line all at once.
+*/
+
+#define _GNU_SOURCE		// memmem
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/ioctl.h>	// TIOCGWINSZ
+
+#include "line_edit.h"
+
+#define GAP_MIN_SIZE 128
+#define ESC_TIMEOUT 100		// ms, used when $ESCDELAY isn't set
+#define MAX_ESC_PARAMS 4
+#define PASTE_TIMEOUT 1000	// ms without input before a paste missing its end marker is taken as over
+#define PASTE_END "\x1b[201~"
+
+int le_esc_timeout = -1;
+
+// Bytes read past the end of a paste, they are handed out before reading the descriptor again
+static char* pending;
+static size_t pending_len;
+static size_t pending_pos;
+
+/*
+	The last byte of a CSI (^[[) or SS3 (^[O) sequence picks the key, except
+	for ~ where the first number does (^[[3~ is delete). Both are looked up
+	straight from these tables, anything missing from them is 0.
+*/
+static const int esc_final_keys[128] =
+{
+	['A'] = KEY_UP,
+	['B'] = KEY_DOWN,
+	['C'] = KEY_RIGHT,
+	['D'] = KEY_LEFT,
+	['H'] = KEY_HOME,
+	['F'] = KEY_END,
+};
+
+static const int esc_tilde_keys[] =
+{
+	[1] = KEY_HOME,
+	[2] = KEY_INSERT,
+	[3] = KEY_DELETE,
+	[4] = KEY_END,
+	[5] = KEY_PAGE_UP,
+	[6] = KEY_PAGE_DOWN,
+	[7] = KEY_HOME,
+	[8] = KEY_END,
+	[200] = KEY_PASTE_START,
+	[201] = KEY_PASTE_END,
+};
+
+// Alt plus a letter comes as ^[ and the letter, these ones mean something
+static const int esc_meta_keys[128] =
+{
+	['b'] = KEY_LEFT | KEY_MOD_ALT,
+	['f'] = KEY_RIGHT | KEY_MOD_ALT,
+};
+
+void gb_init(struct gap_buffer* gb)
+{
+	gb->size = GAP_MIN_SIZE;
+	gb->buf = malloc(gb->size);
+	gb->gap_start = 0;
+	gb->gap_end = gb->size;
+}
+
+void gb_free(struct gap_buffer* gb)
+{
+	free(gb->buf);
+	gb->buf = NULL;
+	gb->size = 0;
+	gb->gap_start = 0;
+	gb->gap_end = 0;
+}
+
+size_t gb_length(const struct gap_buffer* gb)
+{
+	return gb->size - (gb->gap_end - gb->gap_start);
+}
+
+size_t gb_cursor(const struct gap_buffer* gb)
+{
+	return gb->gap_start;
+}
+
+char gb_char_at(const struct gap_buffer* gb, size_t pos)
+{
+	if (pos < gb->gap_start)
+		return gb->buf[pos];
+	return gb->buf[pos + (gb->gap_end - gb->gap_start)];
+}
+
+void gb_move(struct gap_buffer* gb, size_t pos)
+{
+	if (pos > gb_length(gb))
+		pos = gb_length(gb);
+
+	if (pos < gb->gap_start)
+	{
+		// the text between pos and the cursor moves to after the gap
+		size_t n = gb->gap_start - pos;
+		memmove(gb->buf + gb->gap_end - n, gb->buf + pos, n);
+		gb->gap_start -= n;
+		gb->gap_end -= n;
+	}
+	else if (pos > gb->gap_start)
+	{
+		size_t n = pos - gb->gap_start;
+		memmove(gb->buf + gb->gap_start, gb->buf + gb->gap_end, n);
+		gb->gap_start += n;
+		gb->gap_end += n;
+	}
+}
+
+// Makes sure the gap can take n more characters
+static void gb_reserve(struct gap_buffer* gb, size_t n)
+{
+	if (gb->gap_end - gb->gap_start >= n)
+		return;
+
+	size_t after = gb->size - gb->gap_end;
+	size_t size = gb->size ? gb->size : GAP_MIN_SIZE;
+	while (size - gb_length(gb) < n)
+		size *= 2;
+
+	gb->buf = realloc(gb->buf, size);
+	memmove(gb->buf + size - after, gb->buf + gb->gap_end, after);
+	gb->gap_end = size - after;
+	gb->size = size;
+}
+
+void gb_insert(struct gap_buffer* gb, const char* str, size_t n)
+{
+	gb_reserve(gb, n);
+	memcpy(gb->buf + gb->gap_start, str, n);
+	gb->gap_start += n;
+}
+
+int gb_delete_before(struct gap_buffer* gb)
+{
+	if (gb->gap_start == 0)
+		return 0;
+	gb->gap_start--;
+	return 1;
+}
+
+int gb_delete_after(struct gap_buffer* gb)
+{
+	if (gb->gap_end == gb->size)
+		return 0;
+	gb->gap_end++;
+	return 1;
+}
+
+void gb_set(struct gap_buffer* gb, const char* text)
+{
+	gb->gap_start = 0;
+	gb->gap_end = gb->size;
+	gb_insert(gb, text, strlen(text));
+}
+
+char* gb_text(const struct gap_buffer* gb)
+{
+	size_t after = gb->size - gb->gap_end;
+	char* text = malloc(gb_length(gb) + 1);
+
+	memcpy(text, gb->buf, gb->gap_start);
+	memcpy(text + gb->gap_start, gb->buf + gb->gap_end, after);
+	text[gb->gap_start + after] = '\0';
+	return text;
+}
+
+char* gb_text_before_cursor(const struct gap_buffer* gb)
+{
+	char* text = malloc(gb->gap_start + 1);
+
+	memcpy(text, gb->buf, gb->gap_start);
+	text[gb->gap_start] = '\0';
+	return text;
+}
+
+size_t gb_word_left(const struct gap_buffer* gb)
+{
+	size_t pos = gb_cursor(gb);
+
+	while (pos > 0 && gb_char_at(gb, pos - 1) == ' ')
+		pos--;
+	while (pos > 0 && gb_char_at(gb, pos - 1) != ' ')
+		pos--;
+	return pos;
+}
+
+size_t gb_word_right(const struct gap_buffer* gb)
+{
+	size_t pos = gb_cursor(gb);
+	size_t len = gb_length(gb);
+
+	while (pos < len && gb_char_at(gb, pos) == ' ')
+		pos++;
+	while (pos < len && gb_char_at(gb, pos) != ' ')
+		pos++;
+	return pos;
+}
+
+// Reads a byte, waiting at most timeout ms for it (-1 waits forever). Returns EOF if none came
+static int read_byte(int fd, int timeout)
+{
+	unsigned char c;
+
+	if (pending_pos < pending_len)
+	{
+		c = pending[pending_pos++];
+		if (pending_pos == pending_len)
+		{
+			free(pending);
+			pending = NULL;
+			pending_len = pending_pos = 0;
+		}
+		return c;
+	}
+	if (timeout >= 0)
+	{
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		if (poll(&pfd, 1, timeout) <= 0)
+			return EOF;
+	}
+	if (read(fd, &c, 1) != 1)
+		return EOF;
+	return c;
+}
+
+// Turns the 5 of ^[[1;5C into KEY_MOD_ bits, it is 1 + shift(1) + alt(2) + ctrl(4)
+static int esc_modifiers(int param)
+{
+	int mods = 0;
+
+	if (param < 2)
+		return 0;
+	param--;
+	if (param & 1)
+		mods |= KEY_MOD_SHIFT;
+	if (param & 2)
+		mods |= KEY_MOD_ALT;
+	if (param & 4)
+		mods |= KEY_MOD_CTRL;
+	return mods;
+}
+
+/*
+	A small state machine over the bytes after ^[. Only the first byte of a
+	key blocks. The rest of a sequence is already there when it came from a
+	key press, so waiting for it is normally free. If it doesn't come within
+	the timeout, a lone ^[ is the Escape key (27) and a cut off sequence is
+	dropped (0), so a slow link can never leave the decoder stuck halfway.
+	Sequences that aren't in the tables also come back as 0 after all of
+	their bytes have been read, so nothing from them leaks into the line.
+*/
+int le_read_key(int fd)
+{
+	enum { ESC_START, ESC_CSI, ESC_SS3 } state = ESC_START;
+	int params[MAX_ESC_PARAMS] = { 0 };
+	int nparams = 0;
+	int c;
+
+	c = read_byte(fd, -1);
+	if (c != 27)
+		return c;
+
+	if (le_esc_timeout < 0)
+	{
+		char* delay = getenv("ESCDELAY");
+		le_esc_timeout = delay && *delay ? atoi(delay) : ESC_TIMEOUT;
+	}
+
+	while ((c = read_byte(fd, le_esc_timeout)) != EOF)
+	{
+		if (state == ESC_START)
+		{
+			if (c == '[')
+				state = ESC_CSI;
+			else if (c == 'O')
+				state = ESC_SS3;
+			else if (c < 128 && esc_meta_keys[c])
+				return esc_meta_keys[c];
+			else
+				return c | KEY_MOD_ALT;
+			continue;
+		}
+
+		// the numbers, like the 3 in ^[[3~ or the 1;5 in ^[[1;5C
+		if (c >= '0' && c <= '9')
+		{
+			if (nparams == 0)
+				nparams = 1;
+			if (nparams <= MAX_ESC_PARAMS && params[nparams - 1] < 10000)
+				params[nparams - 1] = params[nparams - 1] * 10 + (c - '0');
+			continue;
+		}
+		if (c == ';')
+		{
+			if (nparams == 0)
+				nparams = 1;
+			nparams++;
+			continue;
+		}
+		if (c < 0x40 || c > 0x7e)
+			continue;	// other parameter and intermediate bytes
+
+		// the final byte ends the sequence
+		int mods = esc_modifiers(params[1]);
+		if (state == ESC_SS3)
+			mods = esc_modifiers(params[0]);	// ^[O5C from some terminals
+
+		if (c == '~')
+		{
+			int count = sizeof(esc_tilde_keys) / sizeof(esc_tilde_keys[0]);
+			if (state == ESC_CSI && params[0] > 0 && params[0] < count && esc_tilde_keys[params[0]])
+				return esc_tilde_keys[params[0]] | mods;
+			return 0;
+		}
+		if (esc_final_keys[c])
+			return esc_final_keys[c] | mods;
+		return 0;
+	}
+
+	// nothing more came in time
+	return state == ESC_START ? 27 : 0;
+}
+
+/*
+	The paste is read in blocks of whatever is there and searched for the 
+	end marker, which can be split across two reads, so the search starts 
+	a marker's length before the new block. Whatever came after the marker 
+	is typed input and is kept for read_byte(). Carriage returns (which is
+	what terminals send for a newline) become '\n', tabs become spaces so 
+	they take one column like everything else, and other control characters
+	are dropped, so nothing in a paste can act as an editing key.
+*/
+char* le_read_paste(int fd, size_t* len)
+{
+	size_t cap = 4096;
+	size_t n = 0;
+	char* buf = malloc(cap);
+	const size_t marker_len = strlen(PASTE_END);
+	char* end = NULL;
+
+	while (end == NULL)
+	{
+		if (cap - n < 4096)
+		{
+			cap *= 2;
+			buf = realloc(buf, cap);
+		}
+
+		ssize_t got;
+		if (pending_pos < pending_len)
+		{
+			got = pending_len - pending_pos;
+			if ((size_t)got > cap - n - 1)
+				got = cap - n - 1;
+			memcpy(buf + n, pending + pending_pos, got);
+			pending_pos += got;
+		}
+		else
+		{
+			struct pollfd pfd = { fd, POLLIN, 0 };
+			if (poll(&pfd, 1, PASTE_TIMEOUT) <= 0 || (got = read(fd, buf + n, cap - n - 1)) <= 0)
+				break;
+		}
+
+		size_t from = n > marker_len ? n - marker_len : 0;
+		n += got;
+		end = memmem(buf + from, n - from, PASTE_END, marker_len);
+	}
+
+	if (pending_pos == pending_len)
+	{
+		free(pending);
+		pending = NULL;
+		pending_len = pending_pos = 0;
+	}
+	if (end != NULL)
+	{
+		// what came after the marker goes in front of anything still pending
+		size_t rest = buf + n - (end + marker_len);
+		size_t left = pending_len - pending_pos;
+		char* more = malloc(rest + left + 1);
+		memcpy(more, end + marker_len, rest);
+		if (left > 0)
+			memcpy(more + rest, pending + pending_pos, left);
+		free(pending);
+		pending = more;
+		pending_len = rest + left;
+		pending_pos = 0;
+		n = end - buf;
+	}
+
+	size_t out = 0;
+	for (size_t i = 0; i < n; i++)
+	{
+		unsigned char c = buf[i];
+		if (c == '\r' && i + 1 < n && buf[i + 1] == '\n')
+			continue;
+		if (c == '\r')
+			c = '\n';
+		else if (c == '\t')
+			c = ' ';
+		else if ((c < 32 && c != '\n') || c == 127)
+			continue;
+		buf[out++] = c;
+	}
+	buf[out] = '\0';
+	*len = out;
+	return buf;
+}
+
+void le_bracketed_paste(int on)
+{
+	printf(on ? "\x1b[?2004h" : "\x1b[?2004l");
+	fflush(stdout);
+}
+
+// Writes the characters from..to of the line to the terminal
+static void le_write(struct line_editor* le, size_t from, size_t to)
+{
+	struct gap_buffer* gb = &le->gb;
+	size_t start = from;
+
+	if (from < gb->gap_start)
+	{
+		size_t end = to < gb->gap_start ? to : gb->gap_start;
+		fwrite(gb->buf + from, 1, end - from, stdout);
+		from = end;
+	}
+	if (from < to)
+	{
+		size_t gap = gb->gap_end - gb->gap_start;
+		fwrite(gb->buf + from + gap, 1, to - from, stdout);
+	}
+
+	/*
+		After writing into the last column the terminal holds the cursor
+		there until the next character arrives. Moving it to the next row
+		now keeps it where the row/column arithmetic expects it to be.
+	*/
+	if (to > start && (le->prompt_len + to) % le->cols == 0)
+		printf("\r\n");
+}
+
+// Moves the terminal cursor from the spot of line position from to that of to
+static void le_goto(struct line_editor* le, size_t from, size_t to)
+{
+	size_t from_row = (le->prompt_len + from) / le->cols;
+	size_t from_col = (le->prompt_len + from) % le->cols;
+	size_t to_row = (le->prompt_len + to) / le->cols;
+	size_t to_col = (le->prompt_len + to) % le->cols;
+
+	if (to_row < from_row)
+		printf("\x1b[%zuA", from_row - to_row);
+	else if (to_row > from_row)
+		printf("\x1b[%zuB", to_row - from_row);
+
+	if (to_col != from_col)
+	{
+		printf("\r");
+		if (to_col > 0)
+			printf("\x1b[%zuC", to_col);
+	}
+}
+
+void le_begin(struct line_editor* le, size_t prompt_len)
+{
+	struct winsize ws;
+
+	gb_init(&le->gb);
+	le->prompt_len = prompt_len;
+	le->cols = 80;
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+		le->cols = ws.ws_col;
+}
+
+void le_end(struct line_editor* le)
+{
+	gb_free(&le->gb);
+}
+
+void le_insert(struct line_editor* le, const char* str, size_t n)
+{
+	size_t start = gb_cursor(&le->gb);
+
+	gb_insert(&le->gb, str, n);
+
+	// the rest of the line shifts right, so it is written out again
+	size_t len = gb_length(&le->gb);
+	le_write(le, start, len);
+	le_goto(le, len, gb_cursor(&le->gb));
+	fflush(stdout);
+}
+
+void le_backspace(struct line_editor* le)
+{
+	if (!gb_delete_before(&le->gb))
+		return;
+
+	size_t pos = gb_cursor(&le->gb);
+	size_t len = gb_length(&le->gb);
+	le_goto(le, pos + 1, pos);
+	le_write(le, pos, len);
+	printf("\x1b[J");	// clear what was left over at the end
+	le_goto(le, len, pos);
+	fflush(stdout);
+}
+
+void le_delete(struct line_editor* le)
+{
+	if (!gb_delete_after(&le->gb))
+		return;
+
+	size_t pos = gb_cursor(&le->gb);
+	size_t len = gb_length(&le->gb);
+	le_write(le, pos, len);
+	printf("\x1b[J");
+	le_goto(le, len, pos);
+	fflush(stdout);
+}
+
+void le_move(struct line_editor* le, size_t pos)
+{
+	size_t from = gb_cursor(&le->gb);
+
+	gb_move(&le->gb, pos);
+	le_goto(le, from, gb_cursor(&le->gb));
+	fflush(stdout);
+}
+
+void le_set(struct line_editor* le, const char* text)
+{
+	le_goto(le, gb_cursor(&le->gb), 0);
+	gb_set(&le->gb, text);
+	le_write(le, 0, gb_length(&le->gb));
+	printf("\x1b[J");
+	fflush(stdout);
+}
+
+void le_refresh(struct line_editor* le)
+{
+	size_t len = gb_length(&le->gb);
+
+	le_write(le, 0, len);
+	le_goto(le, len, gb_cursor(&le->gb));
+	fflush(stdout);
+}
+
+int le_handle_key(struct line_editor* le, int key)
+{
+	// ctrl or alt with left and right moves by words
+	int word = key & (KEY_MOD_CTRL | KEY_MOD_ALT);
+
+	switch (key & ~KEY_MODS)
+	{
+		case KEY_LEFT:
+			if (word)
+				le_move(le, gb_word_left(&le->gb));
+			else if (gb_cursor(&le->gb) > 0)
+				le_move(le, gb_cursor(&le->gb) - 1);
+			return 1;
+		case KEY_RIGHT:
+			if (word)
+				le_move(le, gb_word_right(&le->gb));
+			else
+				le_move(le, gb_cursor(&le->gb) + 1);
+			return 1;
+		case KEY_HOME:
+		case 1:		// ctrl-a
+			le_move(le, 0);
+			return 1;
+		case KEY_END:
+		case 5:		// ctrl-e
+			le_move(le, gb_length(&le->gb));
+			return 1;
+		case KEY_DELETE:
+			le_delete(le);
+			return 1;
+		case 127:	// backspace
+		case 8:		// ctrl-h
+			le_backspace(le);
+			return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,134 @@
+/*
+	Line editing shared by the shells (shell.c and key_shell.c, plus the
+	arrows.c test program). See line_edit.c for how it works.
+*/
+
+#ifndef LINE_EDIT_H
+#define LINE_EDIT_H
+
+#include <stddef.h>
+
+// Keys that don't fit in a char, returned by le_read_key()
+enum
+{
+	KEY_UP = 256,
+	KEY_DOWN,
+	KEY_LEFT,
+	KEY_RIGHT,
+	KEY_HOME,
+	KEY_END,
+	KEY_INSERT,
+	KEY_DELETE,
+	KEY_PAGE_UP,
+	KEY_PAGE_DOWN,
+	KEY_PASTE_START,	// ^[[200~, the terminal is about to send pasted text
+	KEY_PASTE_END		// ^[[201~
+};
+
+// Modifiers held with a key are or'ed in, ctrl-left is KEY_LEFT | KEY_MOD_CTRL
+#define KEY_MOD_SHIFT	0x1000
+#define KEY_MOD_ALT		0x2000
+#define KEY_MOD_CTRL	0x4000
+#define KEY_MODS		(KEY_MOD_SHIFT | KEY_MOD_ALT | KEY_MOD_CTRL)
+
+// Milliseconds to wait for the rest of an escape sequence, -1 takes $ESCDELAY
+extern int le_esc_timeout;
+
+// The text of a line, with a gap at the cursor for cheap inserts and deletes
+struct gap_buffer
+{
+	char* buf;
+	size_t size;		// bytes allocated
+	size_t gap_start;	// the cursor, text before it is buf[0..gap_start)
+	size_t gap_end;		// text after the cursor is buf[gap_end..size)
+};
+
+// A line being edited on the terminal
+struct line_editor
+{
+	struct gap_buffer gb;
+	size_t prompt_len;	// columns used by the prompt in front of the line
+	size_t cols;		// width of the terminal
+};
+
+// Sets up an empty gap buffer
+void gb_init(struct gap_buffer* gb);
+
+// Frees the gap buffer's memory
+void gb_free(struct gap_buffer* gb);
+
+// Number of characters in the buffer
+size_t gb_length(const struct gap_buffer* gb);
+
+// Position of the cursor, from 0 to gb_length()
+size_t gb_cursor(const struct gap_buffer* gb);
+
+// Character at position pos (not counting the gap)
+char gb_char_at(const struct gap_buffer* gb, size_t pos);
+
+// Moves the cursor to pos
+void gb_move(struct gap_buffer* gb, size_t pos);
+
+// Inserts n characters at the cursor, leaving the cursor after them
+void gb_insert(struct gap_buffer* gb, const char* str, size_t n);
+
+// Deletes the character before the cursor, returns 0 if there was none
+int gb_delete_before(struct gap_buffer* gb);
+
+// Deletes the character after the cursor, returns 0 if there was none
+int gb_delete_after(struct gap_buffer* gb);
+
+// Replaces the whole text, the cursor ends up at the end
+void gb_set(struct gap_buffer* gb, const char* text);
+
+// Copies the text into a new null-terminated string
+char* gb_text(const struct gap_buffer* gb);
+
+// Copies the text from 0 up to the cursor into a new null-terminated string
+char* gb_text_before_cursor(const struct gap_buffer* gb);
+
+// Start of the word before the cursor
+size_t gb_word_left(const struct gap_buffer* gb);
+
+// End of the word after the cursor
+size_t gb_word_right(const struct gap_buffer* gb);
+
+// Reads one key from fd (already in non-canonical mode), EOF at end of input
+int le_read_key(int fd);
+
+// After KEY_PASTE_START, reads the pasted text up to the end marker as a new
+// string of *len bytes, with line endings made '\n' and other control characters
+// turned into spaces or dropped
+char* le_read_paste(int fd, size_t* len);
+
+// Sends the sequences that turn bracketed paste on or off
+void le_bracketed_paste(int on);
+
+// Starts editing an empty line after a prompt prompt_len columns wide
+void le_begin(struct line_editor* le, size_t prompt_len);
+
+// Frees the editor's buffer
+void le_end(struct line_editor* le);
+
+// Inserts text at the cursor and updates the screen
+void le_insert(struct line_editor* le, const char* str, size_t n);
+
+// Deletes the character before the cursor (backspace)
+void le_backspace(struct line_editor* le);
+
+// Deletes the character under the cursor (delete)
+void le_delete(struct line_editor* le);
+
+// Moves the cursor to pos, on screen as well
+void le_move(struct line_editor* le, size_t pos);
+
+// Replaces the line, as when recalling history
+void le_set(struct line_editor* le, const char* text);
+
+// Prints the whole line again after the prompt has been reprinted
+void le_refresh(struct line_editor* le);
+
+// Handles the editing keys (motions, backspace, delete), returns 0 for any other key
+int le_handle_key(struct line_editor* le, int key);
+
+#endif
@@ -5,7 +5,49 @@
 		2. All simple UNIX commands
 		3. Commands running in the background using &.
 		4. Input redirection with < and output redirection with either > or >>.
-		5. Commands with a single pipe
+		5. Pipelines of any length, with built-in stages run on threads
+		6. Command substitution with $(...) and backticks, plus '...' and "..." 
+		   quoting
+		7. Here-documents with <<WORD (or <<-WORD) and here-strings with <<<
+		8. Glob patterns (*, ? and [...]) in arguments
+		9. The built-in command pmap, which runs a command over many items in 
+		   parallel
+		10. Tab completion of command names and file names
+		11. Editing anywhere in the line with the arrow keys, Home/End, 
+		    ctrl-left/right for words and Delete
+		12. Command lists with ;, && and ||, the exit status in $? and 
+		    set -e to stop a batch file at the first failing command
+		13. A server mode (--serve SOCKET) that runs command lines sent over
+		    a UNIX domain socket
+		14. Reading commands from piped stdin, with --frame adding a status 
+		    record after each one
+		15. History shared between sessions through $SHELL_HISTORY_FILE
+		16. The built-in command tee, which copies pipe data without reading
+		    it into the shell
+		17. The built-in command grep for fixed strings and simple patterns
+		18. Built-in commands in pipelines run on threads inside the shell,
+		    joined to each other by in-memory rings instead of pipes
+		19. Functions (name() { ...; }) with positional parameters, shell 
+		    variables (NAME=value, $NAME) and local variables
+		20. Brace groups { ...; } and subshells ( ... ), with redirection 
+		    and a pipe after them applying to the whole group
+		21. -c 'commands' [name [args...]], which execs the last command in 
+		    place of the shell when it is a plain external one
+		22. The built-in command timeout, and --timeout to give every 
+		    command of a batch file a deadline
+		23. @cpu=, @nice= and @ioprio= prefixes that set the CPUs, nice 
+		    value and I/O priority of a command or pipeline
+		24. The memo prefix, which replays the saved output of a command 
+		    whose arguments, environment and input files haven't changed
+		25. A watch builtin that reruns a command when files change
+		26. Warming the page cache at startup with the programs (and their 
+		    libraries) used most in the history, when $SHELL_WARM is set
+		27. Bracketed paste, a paste goes into the line in one go and 
+		    several pasted lines only run after asking
+		28. Coprocesses, long-running commands the shell sends lines to and 
+		    reads replies from
+		29. Every command runs in a context of its own, with its words in an
+		    arena that is freed in one go when it's done
 		
 	Note: All of the example commands appear to work as expected, just as in 
 		  the previous project.
@@ -18,8 +60,8 @@
 		shell runs in ordinary interactive mode. It supports a command history, 
 		that can be displayed by executing the command 'history', and the user 
 		can cycle through previous commands using the up and down arrow keys. 
-		There is a small bug with it, if you try to modify a previous command 
-		and run the modified command, the command usually won't run properly.
+		A recalled command can be edited anywhere in the line before running 
+		it, see get_input().
 		The shell also supports a suggestion mode that can be accessed by 
 		pressing ctrl-c, but it has some problems. When the user presses ctrl-c,
 		they must press enter again before suggestion mode starts, I made it 
@@ -33,63 +75,981 @@
 	Author: Ethan Broskoskie
 */
 
+#define _GNU_SOURCE	// pipe2, open_memstream, memfd_create
+
 #include <stdio.h> 
 #include <string.h> 
 #include <stdlib.h> 
 #include <unistd.h> 	// getcwd
 #include <sys/types.h> 
 #include <sys/wait.h> 
+#include <sys/mman.h>	// memfd_create
+#include <sys/stat.h>
+#include <sys/syscall.h>	// SYS_getdents64
+#include <dirent.h>		// DT_DIR
+#include <time.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>	// so watch can poll for ctrl-c
 #include <fcntl.h>
 #include <termios.h>
 #include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <linux/futex.h>	// FUTEX_WAIT and FUTEX_WAKE for the pipe rings
+#include <sched.h>			// sched_setaffinity
+#include <sys/resource.h>	// setpriority
+#include <elf.h>			// to find the libraries a program needs
+#if defined(__x86_64__)
+#include <immintrin.h>	// SSE2 and AVX2 for the grep kernels
+#endif
+
+#include "line_edit.h"
 
 #define HISTORY_SIZE 100 			// max number of cmds
+#define MAX_TOKENS 4096			// max number of words in a cmd
+#define DIR_CACHE_BUCKETS 64
+#define DIR_CACHE_MAX 256			// directories kept before the cache is emptied
+#define GETDENTS_BUF_SIZE (256 * 1024)
+#define MAX_GLOB_OPS 256
+#define PMAP_MAX_SLOTS 1024
+#define PMAP_READ_SIZE (64 * 1024)
+#define PMAP_MAX_BATCH 65536		// most items one pmap job may be given
+#define MAX_PATH_DIRS 64			// one bit each in path_entry.dirs
+#define SERVE_MAX_EVENTS 64
+#define SCRIPT_BUF_SIZE (256 * 1024)
+#define TEE_PIPE_SIZE (1024 * 1024)	// staging pipe size tee asks for, and its largest chunk
+#define GREP_BLOCK_SIZE (1024 * 1024)	// read size when grep can't mmap its input
+#define MAX_PIPE_STAGES 64
+#define FUNC_BUCKETS 64
+#define VAR_BUCKETS 64
+#define MAX_CALL_DEPTH 64			// every call level keeps a few token arrays on the stack
+#define TIMEOUT_KILL_AFTER_MS 5000	// time between SIGTERM and SIGKILL, unless timeout -k says otherwise
+#define TIMEOUT_STATUS 124			// status of a command that timed out, as from coreutils timeout
+#define DEADLINE_POLL_MS 10			// how often a deadline looks at a child when there is no pidfd
+
+// What a struct exec_attrs sets
+#define ATTR_CPUS	0x1
+#define ATTR_NICE	0x2
+#define ATTR_IOPRIO	0x4
+
+#define WATCH_DEBOUNCE_MS 100	// quiet time after a change before watch reruns the command
 
-static struct termios old, current;
+#define MEMO_MAGIC 0x316f6d656dULL				// "memo1"
+#define MEMO_DEFAULT_MAX (64LL * 1024 * 1024)	// cache size without $SHELL_MEMO_MAX
+#define MEMO_DEFAULT_ENV "PATH HOME LANG LC_ALL"	// variables hashed without $SHELL_MEMO_ENV
 
-char history[HISTORY_SIZE][1000]; 	// stores cmd history
+// ioprio_set(2) has no glibc wrapper or header
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+enum { IOPRIO_CLASS_NONE, IOPRIO_CLASS_RT, IOPRIO_CLASS_BE, IOPRIO_CLASS_IDLE };
+#define PIPE_RING_SIZE (256 * 1024)		// bytes a ring between two built-in stages holds
+
+// Kinds of grep_node
+enum { GREP_CHAR, GREP_ANY, GREP_SET };
+#define SHARED_HISTORY_SIZE (16 * 1024 * 1024)	// bytes mapped for the shared history log
+#define SHARED_HISTORY_MAGIC 0x31747369685f6873ULL
+#define MAX_SHARED_ENTRY 65536
+#define SHARED_ENTRY_PENDING 0x80000000u	// length bit set while the text is being written
+#define SHARED_HISTORY_STALL_MS 1000	// how long a pending entry holds readers up before it's skipped
+#define MAX_WARM_FILES 256		// programs and libraries one warming pass reads ahead
+#define ARENA_BLOCK_SIZE (16 * 1024)	// bytes in an arena block, bigger requests get their own
+
+// How a command in a list is joined to the next one
+enum { LIST_SEQ, LIST_AND, LIST_OR };
+
+char* history[HISTORY_SIZE]; 		// stores cmd history
 int history_count = 0;				// number of cmds
 int history_index = 0; 				// index for cycling through history
 
-int sig_found = 0;
+struct shared_history* shared_history = NULL;	// mapped $SHELL_HISTORY_FILE, if set
+unsigned long long shared_history_pos = 0;		// first entry not copied into history yet
+size_t shared_history_cap = 0;					// bytes available for entries
+unsigned long long shared_history_stall_pos = 0;	// pending entry the last sync stopped at
+long shared_history_stall_since = 0;			// when that entry was first seen pending
+
+volatile sig_atomic_t sig_found = 0;	// set by sig_handler() for ctrl-c
+struct coproc* coprocs = NULL;		// running coprocesses, newest first
+
+FILE* script_file = NULL;	// batch file being run, here-documents read from it too
+int command_string = 0;		// running the string of -c, there's nothing more to read after it
+const char* heredoc_next = NULL;	// next body cut out of the list of the running command
+const char* heredoc_end = NULL;		// end of that command's bodies
+
+__thread int last_status = 0;	// exit status of the last command, for $?, && and ||
+int errexit = 0;			// set -e, stop at the first command that fails
+
+// A growable, null-terminated byte buffer
+struct strbuf
+{
+	char* data;
+	size_t len;
+	size_t cap;
+};
+
+// A piece of an arena's memory, handed out from the front
+struct arena_block
+{
+	struct arena_block* prev;	// the block filled before this one
+	size_t used;
+	size_t size;
+	max_align_t data[];
+};
+
+// A bump allocator, everything taken from it is freed at once by arena_free()
+struct arena
+{
+	struct arena_block* block;	// the newest block
+};
+
+/*
+	What one command needs while it runs. It lives on the stack of the 
+	function that runs the command, so a command that starts while another 
+	is still running (a substitution, a function body, a pipeline stage, a 
+	command picked in suggestion mode) gets its own and can't overwrite the
+	other's words.
+*/
+struct exec_context
+{
+	char* tokens[MAX_TOKENS];	// the expanded words, operators included
+	struct arena arena;			// holds the words, freed when the command is done
+};
+
+// One field being built by expand_word(), with a glob pattern kept alongside it
+struct field_builder
+{
+	struct strbuf text;		// the field itself
+	struct strbuf pattern;	// the same text with quoted glob characters escaped
+	int exists;				// set once the field exists, even if it's empty ("")
+	int has_glob;			// an unquoted * ? or [ was added
+	struct arena* arena;	// where finished fields go, NULL to malloc them
+};
+
+// One step of a compiled glob pattern
+struct glob_op
+{
+	char type;				// 'c' a character, '?' any character, '*' any run, '[' a set
+	unsigned char c;
+	unsigned char set[32];	// bitmap of the characters in a [...] set
+};
+
+// The entries of one directory, as read by getdents64
+struct dir_listing
+{
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;	// mtime of the directory when it was read
+	int racy;				// it changed too recently for the mtime to be trusted
+	int generation;			// the last glob that checked it
+	int count;
+	char* names;			// all names back to back, each null-terminated
+	int* offsets;			// where each name starts in names
+	unsigned char* types;	// d_type of each entry
+	struct dir_listing* next;
+};
+
+// Record layout returned by the getdents64 system call
+struct linux_dirent64
+{
+	ino64_t d_ino;
+	off64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+// A pmap job: a run of consecutive items handled by one command
+struct pmap_job
+{
+	int first;				// index of the first item
+	int count;
+	struct strbuf output;	// everything the command wrote to stdout
+};
+
+// One of pmap's concurrent slots, with the range of items it still owns
+struct pmap_slot
+{
+	int lo;					// next item to take from the front
+	int hi;					// end of the range, thieves take from here
+	pid_t pid;				// running job, or -1 when idle
+	int fd;					// read end of the job's output pipe
+	struct pmap_job* job;
+};
+
+// A command name found on PATH
+struct path_entry
+{
+	char* name;
+	unsigned long long dirs;	// bit i is set if path_dirs[i] has it
+};
+
+// A PATH directory watched for changes
+struct path_dir
+{
+	char* path;
+	int wd;					// inotify watch descriptor
+};
+
+// What the warming thread is given, copied so the shell can go on changing its own
+struct warm_job
+{
+	char** lines;			// history entries
+	int count;
+	int top;				// how many of the most used commands to warm
+	char* path;				// $PATH
+};
+
+// A command started by coproc, with a pipe to its stdin and one from its stdout
+struct coproc
+{
+	char* name;
+	pid_t pid;
+	int in_fd;				// the shell writes requests here
+	int out_fd;				// and reads replies from here
+	struct strbuf buf;		// what has been read from out_fd but not yet returned
+	size_t pos;				// where the unread part of buf starts
+	struct coproc* next;
+};
+
+// A path given to watch, a file is watched through its directory
+struct watch_target
+{
+	int wd;					// inotify watch descriptor
+	char* name;				// name in the directory, NULL to take any change in it
+};
+
+/*
+	The start of the shared history file. The entries follow it, each one a 
+	32-bit length and then the text, padded to 8 bytes. The top bit of the 
+	length is set while the text is still being written. tail is where the 
+	next entry goes, and it only ever grows.
+*/
+struct shared_history
+{
+	unsigned long long magic;
+	unsigned long long tail;
+	char entries[];
+};
+
+// One place tee sends its input to
+struct tee_dest
+{
+	int fd;			// -1 for an in-memory stream, which gets the data through fwrite
+	int pipe[2];	// staging pipe for splice(2), -1 if tee(2) writes into fd itself
+	int copy;		// splice(2) doesn't work on fd, so the staging pipe is copied by hand
+	ssize_t got;	// bytes of the current chunk tee(2) gave it
+	int failed;		// a write to it failed, it gets nothing more
+};
+
+// One element of a grep pattern, a character, . or [...], maybe followed by *
+struct grep_node
+{
+	unsigned char type;
+	unsigned char star;
+	char ch;					// for GREP_CHAR
+	unsigned char set[32];		// for GREP_SET, bit c is set if c is in it
+};
+
+// A compiled grep pattern
+struct grep_pattern
+{
+	struct grep_node* nodes;
+	int count;
+	int bol;		// starts with ^
+	int eol;		// ends with $
+	int fixed;		// just the text in lit, nothing else to check
+	char* lit;		// text every matching line contains, searched for first
+	size_t lit_len;
+};
+
+// What grep is doing with the current file
+struct grep_state
+{
+	struct grep_pattern pat;
+	FILE* out;
+	const char* name;	// printed in front of lines when there are several files
+	int count;			// -c
+	int invert;			// -v
+	int number;			// -n
+	long line;			// number of the last line looked at
+	long selected;		// lines selected in this file
+	int write_error;	// errno of a failed write to out, nothing more is searched after one
+};
+
+/*
+	Carries bytes from one built-in pipeline stage to the next, both running
+	on threads in the shell. There is one writer and one reader, so head and
+	tail each only move forward on one side. A side that has to wait sleeps 
+	on the futex word wake, which the other side bumps when it moves.
+*/
+struct pipe_ring
+{
+	_Alignas(64) atomic_size_t head;	// bytes written so far
+	_Alignas(64) atomic_size_t tail;	// bytes read so far
+	_Alignas(64) atomic_int waiters;
+	atomic_int write_closed;
+	atomic_int read_closed;	// anything written after this is thrown away
+	atomic_uint wake;
+	atomic_int refs;		// ends still open, the ring is freed at 0
+	char buf[PIPE_RING_SIZE];
+};
+
+// Scheduling set by @cpu=, @nice= and @ioprio= on every process a command starts
+struct exec_attrs
+{
+	int set;		// ATTR_ bits
+	cpu_set_t cpus;
+	int nice;
+	int ioprio;		// class << IOPRIO_CLASS_SHIFT | level
+};
+
+// The start of a memo cache entry, followed by the command's stdout and stderr
+struct memo_header
+{
+	unsigned long long magic;
+	long long status;
+	unsigned long long out_len;
+	unsigned long long err_len;
+};
+
+// A cache file, when memo_evict() looks for the least recently used
+struct memo_file
+{
+	char* name;
+	long long size;
+	struct timespec used;
+};
+
+// One command in a pipeline
+struct pipe_stage
+{
+	char** args;
+	int threaded;		// a built-in run on a thread in the shell instead of a child
+	int in_fd;			// pipe ends for the stage, -1 for the shell's own or a ring
+	int out_fd;
+	int redir_in;		// files opened for the stage's own < and >, -1 if it has none
+	int redir_out;
+	FILE* in;			// streams a threaded stage uses
+	FILE* out;
+	pid_t pid;
+	pthread_t thread;
+	int status;
+};
+
+// A connection to the --serve socket and the request it is running, if any
+struct serve_client
+{
+	int sock;
+	struct strbuf in;		// bytes received that aren't a whole request yet
+	struct strbuf reply;	// replies not fully sent yet
+	size_t reply_sent;
+	int want_out;			// waiting for room on the socket
+	int closing;			// the client hung up
+	int busy;				// a request is running
+	pid_t pid;
+	int pidfd;				// readable once the request's process exits, -1 after
+	int out_fd;				// captured stdout and stderr pipes, -1 at end of file
+	int err_fd;
+	struct strbuf out;
+	struct strbuf err;
+	int status;
+	struct timespec start;
+	struct timespec end;
+};
+
+// One command of a list, cut out of the line by parse_list()
+struct list_cmd
+{
+	char* text;						// the command, expanded only when it runs
+	int op;							// how it is joined to the command before it
+	struct shell_function* def;		// a name() { ... } definition instead of a command
+	struct command_list* group;		// the body of { ... } or ( ... ), then text is 
+									// the redirection and pipe after it
+	int subshell;					// group is ( ... )
+	struct strbuf heredocs;			// bodies of its here-documents, each ending in a '\0', 
+									// cut out of the lines that followed it
+};
+
+// The commands of a line or of a function body, in order
+struct command_list
+{
+	struct list_cmd* cmds;
+	int count;
+	int cap;
+};
+
+// A function, its body already split into a list
+struct shell_function
+{
+	char* name;
+	char* source;				// the body text the list points into
+	struct command_list body;
+	int refs;					// the table, a definition not yet run, and running calls
+	struct shell_function* next;
+};
+
+// A shell variable, global or local to a function call
+struct shell_var
+{
+	char* name;
+	char* value;
+	struct shell_var* next;
+};
+
+// A running function, with its arguments and local variables
+struct call_frame
+{
+	char** argv;				// the function name and then $1, $2...
+	int argc;
+	struct shell_var* locals;
+	struct call_frame* prev;
+};
+
+// the built-in commands, in the order builtin_cmd_handler() checks them
+char* builtin_list[] = { "exit", "cd", "history", "pmap", "set", "tee", "grep", "local", "return", 
+						  "timeout", "memo", "watch", "coproc", "cowrite", "coread", "coclose" };
+
+#define BUILTIN_COUNT (int)(sizeof(builtin_list) / sizeof(builtin_list[0]))
 
-char* tokens[100];  
+struct path_entry* path_index = NULL;	// executables on PATH, sorted by name
+int path_index_count = 0;
+int path_index_cap = 0;
+struct path_dir path_dirs[MAX_PATH_DIRS];
+int path_dir_count = 0;
+char* path_index_env = NULL;			// the PATH the index was built from
+
+int serve_epoll = -1;
+int serve_listen = -1;
+struct serve_client** serve_owner = NULL;	// client of each descriptor the server watches
+int serve_owner_size = 0;
+int path_inotify_fd = -1;
+
+struct shell_function* func_table[FUNC_BUCKETS];	// functions, by name
+struct shell_var* var_table[VAR_BUCKETS];			// global variables, by name
+struct call_frame* call_stack = NULL;				// innermost running function
+int call_depth = 0;
+int func_returning = 0;		// return was run, stop the function's list
+const char* shell_name = "shell";	// $0 outside of functions
+char** shell_args = NULL;			// $1, $2... outside of functions, from -c
+int shell_argc = 0;
+long cmd_timeout_ms = 0;			// --timeout, the deadline for every command of a list
+long cmd_deadline = 0;				// when the running command's --timeout runs out (monotonic ms), 0 if none
+int cmd_timed_out = 0;				// the running command's deadline passed, stop what is left of it
+pid_t shell_pgid = 0;				// the shell's own process group, children under a deadline leave it
+struct exec_attrs cmd_attrs;		// prefixes of the command running now
+
+struct dir_listing* dir_cache[DIR_CACHE_BUCKETS];	// directory listings, by inode
+int dir_cache_count = 0;
+int glob_generation = 0;
 
 // Greeting shell during startup 
 void init_shell();
 
-// Function to print Current Directory. 
-void print_dir();
+// Function to print Current Directory. Returns the length of the prompt.
+int print_dir();
+
+// Reads and copies command line input into line, returns 1 for a blank line
+int get_input(struct strbuf* line, int prompt_len);
+
+// Handles the built-in commands exit and cd. Output goes to out.
+int builtin_cmd_handler(char** args, FILE* in, FILE* out);
+
+// Returns the position of name in the builtin list plus one, or 0 if it isn't a builtin
+int find_builtin(const char* name);
+
+// Returns 1 if the builtin changes the state of the shell itself (cd, exit, set, local, return)
+int builtin_changes_state(const char* name);
+
+// Parses and runs the command line, returns 1 if set -e stopped it at a failing command
+int parse_string(char* str);
+
+// parse_string(), with tail set when nothing runs after the line (see run_list())
+int run_line(char* str, int tail);
+
+// Cuts str into the commands of a list, returns 0 if a function body isn't closed yet
+int parse_list(char* str, struct command_list* list);
+
+// Adds a command or definition to a list
+void list_add(struct command_list* list, char* text, int op, struct shell_function* def);
+
+// Frees a list made by parse_list(), not the text it points into
+void free_list(struct command_list* list);
+
+// Runs a list of commands, returns 1 if set -e stopped it at a failing command. 
+// With tail set, the shell is a child that exits after the list, so a plain 
+// external command at the end replaces it instead of being forked
+int run_list(struct command_list* list, int tail);
+
+// Finds the ) or } that closes a group whose body starts at p, NULL if it isn't closed
+char* find_group_end(char* p);
+
+// Moves the here-document bodies at body into the commands of list from first on, 
+// returns where the text after them starts
+char* take_heredocs(struct command_list* list, int first, char* body);
+
+// Skips the bodies at body of the here-documents opened between start and end (NULL 
+// for the end of the string), adding each to out with a '\0' after it unless out is 
+// NULL. Returns where the text after them starts, NULL if one isn't closed and out is NULL
+char* skip_heredocs(char* start, char* end, char* body, struct strbuf* out);
 
-// Reads and copies command line input into a string, str. 
-int get_input(char* str);
+// Reads the delimiter of the << word at p into delim, returns where the word ends
+char* heredoc_delim(char* p, char* delim, int* strip_tabs);
 
-// Handles the built-in commands exit and cd.
-int builtin_cmd_handler();
+// Returns the start of the line after the one holding only delim, NULL if there isn't one,
+// adding the lines before it to out unless out is NULL
+char* cut_heredoc(char* body, const char* delim, int strip_tabs, struct strbuf* out);
 
-// Parses the string given to the command line
-void parse_string(char* str);
+// Runs a { ... } or ( ... ) group with the redirection and pipe after it
+void run_group(struct list_cmd* c);
+
+// Runs the body of a group, forking for a subshell only when the body changes the shell
+void run_group_body(struct list_cmd* c, int in_child);
+
+// Returns 1 if running the list could change the shell (cd, variables, functions...)
+int list_changes_state(struct command_list* list);
+
+// Applies one <, >, >> or <& redirection to the shell's own descriptors, returns 0 on failure
+int redirect_fd(const char* op, const char* target);
+
+// Reads a name() { ... } definition at p, returns 1 and the end in after, 0 if it isn't one, -1 if it isn't closed
+int parse_function(char* p, struct shell_function** def, char** after);
+
+// Reads one more line of a command that isn't finished into sb, returns 0 at end of input
+int read_continuation(struct strbuf* sb);
+
+// Finds the function with this name, NULL if there is none
+struct shell_function* find_function(const char* name);
+
+// Puts a function into the table, replacing one with the same name
+void define_function(struct shell_function* fn);
+
+// Drops a reference to a function, freeing it after the last one
+void release_function(struct shell_function* fn);
+
+// Runs a function in this process with args as its positional parameters
+void call_function(struct shell_function* fn, char** args);
+
+// Hash of a function or variable name
+unsigned int name_hash(const char* name);
+
+// Returns the value of a variable (local, global, then environment), NULL if unset
+const char* get_var(const char* name);
+
+// Sets a variable, in the innermost call that made it local or else globally
+void set_var(const char* name, const char* value);
+
+// Sets a variable in the list, adding it if needed
+void set_var_in(struct shell_var** list, const char* name, const char* value);
+
+// Finds a variable in a list of them
+struct shell_var* find_var_in(struct shell_var* list, const char* name);
+
+// Length of the NAME in a NAME=value word, 0 if word isn't an assignment
+int assignment_name_len(const char* word);
+
+// The local builtin, makes variables local to the running function
+void local_builtin(char** args);
+
+// Returns the end of the $NAME, ${NAME}, $1, $#, $@ or $* at p, NULL if there is none
+const char* param_end(const char* p);
+
+// Adds the value of the parameter from p to end to the field being built
+void expand_param(const char* p, const char* end, struct field_builder* fb, 
+				  char** fields, int* count, int max, int quoted);
+
+// Adds unquoted text to the fields, splitting it on blanks
+void field_add_split(struct field_builder* fb, char** fields, int* count, int max, 
+					 const char* str, size_t n);
+
+// Expands and runs a single command of a list. With tail set, a plain external 
+// command is exec'd in place of the shell (see run_list())
+void run_command(char* str, int tail);
+
+// Finds the first ;, newline, && or || outside of quotes and substitutions, NULL if there is none
+char* find_list_op(char* str, int* op);
+
+// Turns a status from waitpid() into an exit status like $? shows it
+int exit_status(int status);
+
+// Runs the command held in ctx->tokens, setting up any redirection and piping first
+void execute_tokens(struct exec_context* ctx);
 
 // Tokenizes the cmd line string, removes spaces, returns the number of tokens in the line
-void tokenize_str(char* str);
+int tokenize_str(char* str, char** words);
+
+// Tokenizes str and expands every word into args, kept in arena, returns the number 
+// of args. assigns gets how many leading words were NAME=value assignments
+int expand_tokens(struct arena* arena, char* str, char** args, int* assigns);
+
+// Frees strings that were malloc'd by expand_word() or expand_glob()
+void free_tokens(char** args, int count);
+
+// Expands quotes and substitutions in one word, returns the number of fields made,
+// which are kept in arena or malloc'd if it's NULL. With whole set it makes 
+// exactly one field, never split or globbed
+int expand_word(struct arena* arena, const char* word, char** fields, int max, int whole);
+
+// Takes n bytes from the arena, aligned for any type
+void* arena_alloc(struct arena* arena, size_t n);
+
+// Copies a string into the arena
+char* arena_strdup(struct arena* arena, const char* str);
+
+// Frees everything taken from the arena, keeping one block for the next command
+void arena_free(struct arena* arena);
+
+// Adds text to the field being built, quoted text never counts as a glob
+void field_add(struct field_builder* fb, const char* str, size_t n, int quoted);
+
+// Ends the field being built, replacing it with its glob matches if it has any
+void field_finish(struct field_builder* fb, char** fields, int* count, int max);
+
+// Replaces a glob pattern with the sorted paths it matches, returns how many
+int expand_glob(const char* pattern, char** fields, int max);
+
+// Compiles one path component of a glob pattern into ops, returns the number of ops
+int glob_compile(const char* pat, struct glob_op* ops, int max);
+
+// Returns 1 if name matches the compiled glob ops
+int glob_match(const struct glob_op* ops, int n, const char* name);
+
+// Returns 1 if the pattern has an unescaped * ? or [
+int has_glob_chars(const char* pat);
+
+// Matches the path components under base, collecting the matching paths
+void glob_walk(const char* base, char** comps, int ncomps, char*** matches, int* count, int* cap);
+
+// Appends a copy of path to the list of matches
+void add_glob_match(const char* path, char*** matches, int* count, int* cap);
+
+// qsort() comparison for an array of strings
+int compare_strings(const void* a, const void* b);
+
+// Returns the cached entries of a directory, reading them again if it changed
+struct dir_listing* get_dir_listing(const char* path);
+
+// Reads all entries of a directory into the listing
+int read_dir_listing(struct dir_listing* dir, const char* path);
+
+// Frees every cached directory listing
+void clear_dir_cache();
+
+// Returns a pointer just past the quoted text, substitution or character at p
+char* skip_word_part(char* p);
+
+// Returns a pointer to the ')' closing a $( substitution, p starts after the "$("
+char* find_subst_end(char* p);
+
+// Returns a pointer to the backtick closing the one at p, skipping escaped ones, or NULL
+char* find_backtick_end(char* p);
+
+// Reads the body of a here-document up to the line holding only delim
+void read_heredoc(const char* delim, int strip_tabs, struct strbuf* body);
+
+// Expands substitutions in a here-document body, leaving quotes alone
+void expand_heredoc(const char* text, struct strbuf* out);
+
+// Returns a readable descriptor holding the given bytes, for here-documents and here-strings
+int make_input_fd(const char* data, size_t len);
+
+// Turns a << or <<< word (plus its target) into the "<&" and fd args, returns words used
+int expand_heredoc_word(struct arena* arena, char** words, char** args, int* count);
+
+// Runs cmd and appends its standard output to out
+void capture_output(const char* cmd, struct strbuf* out);
+
+// Forks and executes args with stdin and stdout moved to in_fd and out_fd (-1 keeps them), 
+// in a process group of its own if new_group is set
+pid_t spawn_cmd(char** args, int in_fd, int out_fd, int new_group);
+
+// Waits for pid for up to timeout_ms, then stops its process group, returns its $? status
+int wait_deadline(pid_t pid, long timeout_ms, long kill_after_ms, int* timed_out);
+
+// Whether this shell enforces a --timeout deadline now, rather than a child in a group that is stopped
+int deadline_applies();
+
+// Waits for a child of the running command, stopping it at the --timeout deadline; returns its $? status
+int wait_child(pid_t pid, const char* name);
+
+// Waits until fd can be read or the --timeout deadline passes, returns 0 in the second case
+int wait_readable(int fd);
+
+// Parses a duration like 10, 2.5s, 500ms, 3m, 1h or 1d, returns milliseconds or -1
+long parse_duration(const char* str);
+
+// The timeout builtin, runs a command and stops it if it takes too long
+void timeout_builtin(char** args);
+
+// Runs a function, builtin or program in a forked child, never returns
+void run_in_child(char** cmd);
+
+// The memo builtin, replays a command's saved output or runs it and saves it
+void memo_builtin(char** args);
+
+// Writes all n bytes to fd, returns 0 on an error
+int write_all(int fd, const char* buf, size_t n);
+
+// Adds bytes to a memo key (FNV-1a, 128 bits)
+void memo_hash(unsigned __int128* h, const void* data, size_t n);
+
+// Adds what identifies the file at path to a memo key, returns 0 if it isn't a file
+int memo_hash_file(unsigned __int128* h, const char* path, int fd, int content);
+
+// Writes out a cache entry if there is one for path, returns 0 if there isn't
+int memo_replay(const char* path);
+
+// Saves a command's output and status as the cache entry at path
+void memo_store(const char* dir, const char* path, int status, struct strbuf* out, struct strbuf* err);
+
+// Removes the least recently used entries until the cache is under max bytes
+void memo_evict(const char* dir, long long max);
+
+// Orders memo_files from the least recently used
+int compare_memo_files(const void* a, const void* b);
+
+// The watch builtin, reruns a command whenever the paths it is given change
+void watch_builtin(char** args);
+
+// Adds an inotify watch for path, returns 0 if neither it nor its directory exists
+int watch_add(int ifd, const char* path, struct watch_target* target);
+
+// Starts one run of a watched command in its own process group, sets *pidfd
+pid_t watch_run(char** cmd, const sigset_t* mask, int* pidfd);
+
+// Milliseconds on the monotonic clock
+long monotonic_ms();
+
+// The coproc builtin, starts a command that keeps running with pipes to and from the shell
+void coproc_builtin(char** args);
+
+// The cowrite builtin, sends a line to a coprocess
+void cowrite_builtin(char** args, FILE* in);
+
+// The coread builtin, reads a line from a coprocess
+void coread_builtin(char** args, FILE* out);
+
+// The coclose builtin, closes a coprocess's input and waits for it
+void coclose_builtin(char** args);
+
+// Finds a running coprocess by name, printing an error for cmd if there is none
+struct coproc* find_coproc(const char* name, const char* cmd);
+
+// Reads an @cpu=, @nice= or @ioprio= prefix into attrs, returns 0 if it isn't valid
+int parse_exec_attr(const char* word, struct exec_attrs* attrs);
+
+// Applies attrs to the calling thread, which is the whole process in a fork's child
+void apply_exec_attrs(const struct exec_attrs* attrs);
+
+// Returns 1 if the builtin runs commands on the shell's real descriptors, so it 
+// can't be given in-memory streams (a ring or a capture buffer)
+int builtin_needs_fds(const char* name);
+
+// Runs the stages of a pipeline at the same time, sets last_status to the last one's status
+void run_pipeline(char** stages[], int count);
+
+// Returns 1 if a pipeline stage can run as a built-in on a thread in the shell
+int stage_runs_threaded(char** args);
+
+// Takes the redirection words out of a stage's args and opens their files, returns 0 on an error
+int stage_redirects(struct pipe_stage* st);
+
+// Thread body for a built-in pipeline stage
+void* run_stage_thread(void* arg);
+
+// Makes a ring and the two streams that write to and read from it
+int open_pipe_ring(FILE** wr, FILE** rd);
+
+// fopencookie() functions for the two ends of a pipe_ring
+ssize_t pipe_ring_write(void* cookie, const char* buf, size_t size);
+ssize_t pipe_ring_read(void* cookie, char* buf, size_t size);
+int pipe_ring_close_write(void* cookie);
+int pipe_ring_close_read(void* cookie);
+
+// Conditions pipe_ring_wait() sleeps on, the writer's and the reader's
+int pipe_ring_full(struct pipe_ring* ring);
+int pipe_ring_empty(struct pipe_ring* ring);
+
+// Sleeps until the other end of the ring moves, if check still holds
+void pipe_ring_wait(struct pipe_ring* ring, int (*check)(struct pipe_ring*));
+
+// Wakes the other end of the ring if it is waiting
+void pipe_ring_wake(struct pipe_ring* ring);
+
+// Drops one end's reference to the ring, freeing it after the second
+void pipe_ring_release(struct pipe_ring* ring);
+
+// Returns 1 if args contain a pipe, redirection or & 
+int has_operators(char** args);
+
+// Appends n bytes to a strbuf, growing it when needed
+void sb_append(struct strbuf* sb, const char* str, size_t n);
+
+// Reads fd until end of file, appending everything to sb
+void sb_read_fd(struct strbuf* sb, int fd);
+
+// Appends what one read() of fd returns to sb, returns that read's result
+ssize_t sb_read_once(struct strbuf* sb, int fd);
+
+// Reads a builtin's input until end of file, appending everything to sb
+void sb_read_stream(struct strbuf* sb, FILE* in);
+
+// Reads from fd, or from the stream in when it has no descriptor (fd is -1)
+ssize_t stream_read(int fd, FILE* in, char* buf, size_t n);
 
 // Function where the system command is executed 
-void process();
+void process(struct exec_context* ctx);
 
 // Function to print command history
-void print_history();
+void print_history(FILE* out);
+
+// The pmap builtin, runs a command over a list of items in parallel
+int pmap_builtin(char** args, FILE* in, FILE* out);
+
+// The tee builtin, copies stdin to stdout and files without copying through user space
+int tee_builtin(char** args, FILE* in, FILE* out);
+
+// Reads exactly n bytes from fd unless it ends first
+void tee_read(int fd, char* buf, size_t n);
+
+// Writes n bytes to one of tee's destinations, returns -1 with errno set if that fails
+int tee_write(struct tee_dest* dest, FILE* out, const char* buf, size_t n);
+
+// The grep builtin, returns 0 for options or patterns it leaves to the real grep
+int grep_builtin(char** args, FILE* in, FILE* out);
+
+// Reads grep's options into st, returns the index of the pattern or 0 if they're left to the real grep
+int grep_options(char** args, struct grep_state* st, int* fixed);
+
+// Returns 1 if grep_builtin() would hand these arguments to the real grep
+int grep_declines(char** args);
+
+// Compiles a grep pattern, returns 0 if it uses something grep_builtin() doesn't support
+int grep_compile(const char* pattern, int fixed, struct grep_pattern* gp);
+
+// Returns 1 if the line from s to e matches the pattern
+int grep_match_line(const struct grep_pattern* gp, const char* s, const char* e);
+
+// Adds position i of the pattern to the set, and the ones after it that a star lets it skip to
+void grep_add_state(const struct grep_node* nodes, int count, unsigned char* set, int i);
+
+// Returns 1 if a single node matches the character c
+int grep_node_matches(const struct grep_node* node, char c);
+
+// Greps a buffer of whole lines
+void grep_scan(struct grep_state* st, const char* buf, size_t len);
+
+// Handles the lines from s to e, none of which match
+void grep_skip(struct grep_state* st, const char* s, const char* e);
+
+// Prints (or just counts) a selected line
+void grep_emit(struct grep_state* st, const char* s, const char* e);
+
+// Finds the first place the m bytes of lit show up in s, NULL if none
+const char* grep_find(const char* s, size_t n, const char* lit, size_t m);
+
+// Counts the newlines in s
+long grep_count_newlines(const char* s, size_t n);
+
+#if defined(__x86_64__)
+// Vector versions of grep_find() and grep_count_newlines()
+const char* grep_find_avx2(const char* s, size_t n, const char* lit, size_t m);
+const char* grep_find_sse2(const char* s, size_t n, const char* lit, size_t m);
+long grep_count_avx2(const char* s, size_t n);
+long grep_count_sse2(const char* s, size_t n);
+#endif
 
 // Function to add a command to history
 void add_to_history(const char *cmd);
 
-// Read arrow key input 
-char read_arrow_key();
+// Adds a command to this shell's own history array only
+void add_local_history(const char *cmd);
+
+// Maps the shared history file at path, returns 0 on success
+int open_shared_history(const char* path);
+
+// Appends an entry to the shared history log, returns 0 if it didn't fit
+int append_shared_history(const char* cmd);
+
+// Copies entries other shells (and this one) added to the log into history
+void sync_shared_history();
+
+// Starts warming the most used commands in the background, if $SHELL_WARM asks for it
+void start_warming();
+
+// Thread body that reads ahead the programs and libraries in a warm_job
+void* warm_thread(void* arg);
+
+// Finds a file on path that access() allows for mode, returns a new string or NULL
+char* find_on_path(const char* name, const char* path, int mode);
+
+// Reads ahead a program or library and queues the libraries it needs
+void warm_file(const char* file, char** files, int* count);
+
+// Adds the file's name to files unless it's there already, returns 1 if added
+int warm_add(char** files, int* count, const char* file);
+
+// Shows several pasted lines and asks whether to run them, returns 1 for yes
+int confirm_paste(const char* text);
+
+// Read a key, arrow and other special keys come back as the KEY_ codes from line_edit.h
+int read_arrow_key();
+
+// Finds what Tab should add to the end of the line, returns 1 if it listed the choices instead
+int complete_line(const char* line, int len, struct strbuf* insert);
+
+// Brings the index of executables on PATH up to date
+void refresh_path_index();
+
+// Builds the index of executables on PATH from scratch and watches its directories
+void build_path_index(const char* path);
+
+// Adds or removes one PATH directory's copy of name in the index
+void update_path_entry(int dir, const char* name);
+
+// Whether name in PATH directory dir is an executable file
+int path_entry_runnable(int dir, const char* name);
+
+// Orders path_entry structs by name
+int compare_path_entries(const void* a, const void* b);
+
+// Runs every line of a batch file or piped input, returns the last exit status
+int run_script(FILE* in, int frame);
+
+// Runs the shell as a command server on a UNIX socket, see the comment above serve()
+int serve(const char* path);
 
-// Initialize new terminal i/o settings
-void initTermios(int echo);
+// Sends a client its finished reply and starts its next request
+void serve_step(struct serve_client* c);
+
+// Forks a copy of the shell to run one request line for the client
+void serve_start(struct serve_client* c, char* line);
+
+// Adds fd to the server's epoll set, owned by client c
+void serve_watch(struct serve_client* c, int fd, int events);
+
+// Takes fd out of the epoll set, and closes it if do_close is set
+void serve_unwatch(struct serve_client* c, int fd, int do_close);
+
+// Queues a one-line error reply for the client
+void serve_error(struct serve_client* c, const char* msg);
+
+// Writes as much of the client's pending reply as the socket takes
+void serve_flush(struct serve_client* c);
+
+// Reads what a non-blocking fd has into sb, returns 0 at end of file
+int serve_read(struct strbuf* sb, int fd);
+
+// Initialize new terminal i/o settings, saving the old ones in saved
+void initTermios(int echo, struct termios* saved);
 
 // Restore old terminal i/o settings
-void resetTermios(void);
+void resetTermios(const struct termios* saved);
 
 // Read 1 character - echo defines echo mode
 char getch_(int echo);
@@ -105,10 +1065,55 @@ void handle_signal();
 
 int main(int argc, char *argv[]) 
 { 
-	char input[1000];
-	//char* token_args[100];
+	struct strbuf line = { NULL, 0, 0 };
+	char* name = argv[0];
+	int frame = 0;
+	
+	shell_name = argv[0];
+	shell_pgid = getpgrp();
+	while (argc >= 2 && strncmp(argv[1], "--", 2) == 0)
+	{
+		if (strcmp(argv[1], "--frame") == 0)
+		{
+			frame = 1;
+		}
+		else if (strcmp(argv[1], "--timeout") == 0 && argc >= 3 && 
+				 (cmd_timeout_ms = parse_duration(argv[2])) >= 0)
+		{
+			argc--;
+			argv++;
+		}
+		else
+			break;
+		argc--;
+		argv++;
+	}
 	
-	if (argc == 2)
+	if (argc == 3 && strcmp(argv[1], "--serve") == 0)
+	{
+		return serve(argv[2]);
+	}
+	else if (argc >= 3 && strcmp(argv[1], "-c") == 0)
+	{
+		/*
+			Like sh -c, for system() style callers. The words after the 
+			command are $0, $1... The line runs with tail set, so when it 
+			ends in a plain external command the shell execs it instead of
+			forking, and the caller gets one process instead of two. 
+			Here-document bodies come from the string too, never from stdin.
+		*/
+		if (argc >= 4)
+		{
+			shell_name = argv[3];
+			shell_args = argv + 3;
+			shell_argc = argc - 3;
+		}
+		command_string = 1;
+		run_line(argv[2], 1);
+		fflush(stdout);
+		return last_status;
+	}
+	else if (argc == 2)
 	{
 		FILE *batch = fopen(argv[1], "r");
 		if (batch == NULL)
@@ -116,23 +1121,34 @@ int main(int argc, char *argv[])
 			perror("Error opening batch file");
 			return 1;
 		}
-		
-		// Read and execute commands from the batch file line by line
-        while (fgets(input, sizeof(input), batch) != NULL) 
+		return run_script(batch, frame);
+	}
+	else if (argc == 1 && !isatty(STDIN_FILENO))
+	{
+		/*
+			stdin is a pipe or a file, so another program is driving the 
+			shell. The commands are read from a private copy of the 
+			descriptor and the commands themselves get /dev/null as stdin,
+			otherwise a command that reads stdin would eat the lines after 
+			it (and the shell has already buffered some of them anyway).
+		*/
+		int fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 3);
+		int devnull = open("/dev/null", O_RDONLY);
+		if (fd < 0 || devnull < 0)
 		{
-			/*
-				Removes carriage return followed by a newline character.
-			    I was having a weird problem where this would show up when 
-				parsing my batch file, this line fixed it.
-			*/
-			input[strcspn(input, "\r\n")] = '\0';
-            parse_string(input);
-        }
-		fclose(batch);
+			perror("stdin");
+			return 1;
+		}
+		dup2(devnull, STDIN_FILENO);
+		close(devnull);
+		return run_script(fdopen(fd, "r"), frame);
 	}
 	else if (argc == 1)
 	{
 		init_shell();
+		if (getenv("SHELL_HISTORY_FILE") != NULL)
+			open_shared_history(getenv("SHELL_HISTORY_FILE"));
+		start_warming();
 		if (signal(SIGINT, sig_handler) == SIG_ERR) 
 		{
 			perror("signal");
@@ -146,119 +1162,608 @@ int main(int argc, char *argv[])
 				handle_signal();
 				sig_found = 0; // reset the flag
 			}
-			print_dir();
+			int prompt_len = print_dir();
 			
 			// take the entire line of input
-			if (get_input(input) == 0) 
+			if (get_input(&line, prompt_len) == 0) 
 			{
 				// Parse and execute the command
-				parse_string(input);
+				parse_string(line.data);
 			}
 		} 
 	}
 	else 
 	{
-        printf("Usage: %s [batch_file]\n", argv[0]);
+        printf("Usage: %s [--frame] [--timeout duration] [batch_file] | -c commands [name [args...]] | --serve socket\n", name);
         return 1;
     }
 	
 	return 0;
 }
 
-void init_shell() 
-{ 
-    printf("\n\n\n\n------------------------------------------"); 
+/*
+	Reads and executes commands from a batch file or piped stdin line by 
+	line. The reads go through a big stdio buffer, so a long stream of 
+	commands costs a read() per SCRIPT_BUF_SIZE bytes rather than per line.
+	
+	With frame set, every line is followed on stdout by a record, so the 
+	program feeding the shell can tell where each command's output ends 
+	without waiting for the shell to exit:
+	
+		\x1e<line number> status=<exit status> usec=<microseconds>\n
+	
+	The record starts with the ASCII record separator, which doesn't show up
+	in normal text output. There is one record for every command line, blank
+	ones included, so the feeder can match them up by counting. The body of 
+	a here-document is part of the line that started it.
+*/
+int run_script(FILE* in, int frame)
+{
+	char* input = NULL;
+	size_t input_size = 0;
+	long line_no = 0;
+	struct timespec start, end;
+	
+	setvbuf(in, NULL, _IOFBF, SCRIPT_BUF_SIZE);
+	script_file = in;
+	
+	while (getline(&input, &input_size, in) != -1) 
+	{
+		/*
+			Removes carriage return followed by a newline character.
+			I was having a weird problem where this would show up when 
+			parsing my batch file, this line fixed it.
+		*/
+		input[strcspn(input, "\r\n")] = '\0';
+		line_no++;
+		
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		int stop = parse_string(input);
+		
+		if (frame)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			long usec = (end.tv_sec - start.tv_sec) * 1000000L + 
+						(end.tv_nsec - start.tv_nsec) / 1000;
+			fflush(stdout);
+			printf("\x1e%ld status=%d usec=%ld\n", line_no, last_status, usec);
+			fflush(stdout);
+		}
+		if (stop)
+			break;	// set -e
+	}
+	fclose(in);
+	free(input);
+	script_file = NULL;
+	return last_status;
+}
+
+void init_shell() 
+{ 
+    printf("\n\n\n\n------------------------------------------"); 
     printf("\n\n\n\t    Welcome to my shell"); 
     printf("\n\n\t      - By: Ethan B -"); 
     printf("\n\n\n\n------------------------------------------\n"); 
 } 
 
-void print_dir() 
+int print_dir() 
 { 
     char cwd[1024]; 
     getcwd(cwd, sizeof(cwd)); 
-    printf("%s$ ", cwd); 
+    return printf("%s$ ", cwd); 
 } 
 
 /*
-	This function has been reworked. Now, when called, it reads in character by 
-	character by calling read_arrow_key(). If an arrow key is used, it responds
-	accordingly (up scrolls up the history, down scrolls down). Otherwise,
-	it types whatever the user types, onto the screen. When the user hits enter, 
-	it adds the command they typed to the history and stops. Backspaces also
-	work.
+	This function has been reworked again. It reads in key by key by calling
+	read_arrow_key() and edits the line with the gap buffer editor from 
+	line_edit.c, so the cursor can move with left/right, Home/End (or 
+	ctrl-a/ctrl-e) and ctrl-left/ctrl-right (or alt-b/alt-f) by words, and 
+	typing, backspace and delete work anywhere in the line. Up and down 
+	replace the line with the previous or next command in the history, which 
+	can then be edited like any other line, and page up/page down jump to the
+	oldest command and back to a new line. Tab completes the word before the
+	cursor. When the user hits enter, the whole line goes into the history
+	and into line. There is no limit on the length of a line. Returns 1 if 
+	the line is blank.
+	
+	Bracketed paste is on while the line is edited. Pasted text arrives as
+	one block between two markers instead of as keys, so it goes in with a
+	single insert and redraw and its newlines can't run anything. A paste 
+	of several lines is shown and only run if the user says so, and then 
+	it is returned as it is, one command per line.
 */
-int get_input(char* str) 
+int get_input(struct strbuf* line, int prompt_len) 
 { 
-    char ch;
-    int pos = 0;	// length of current command
-	int non_space = 0; // flag to track if non-space characters are encountered
-	int on_cmd_index = 0;
+	struct line_editor ed;
+    int ch;
 	
-    do 
+	le_begin(&ed, prompt_len);
+	le_bracketed_paste(1);
+    while ((ch = read_arrow_key()) != '\n') 
 	{
-        ch = read_arrow_key();
-        if (ch == 'U' || ch == 'D') 
+		if (ch == EOF)
+		{
+			// stdin is gone, nothing more can be typed
+			le_end(&ed);
+			le_bracketed_paste(0);
+			printf("\n");
+			exit(0);
+		}
+		
+		if (ch == KEY_PASTE_START)
 		{
-			if (ch == 'U')
-				on_cmd_index++;
-			else if (ch == 'D')
-				on_cmd_index--;
+			struct termios saved;
+			size_t len;
+			initTermios(0, &saved);
+			char* paste = le_read_paste(STDIN_FILENO, &len);
+			resetTermios(&saved);
 			
-            for (int i = 0; i < pos; i++) 
+			// a newline at the end is dropped, so pasting one whole line doesn't run it
+			if (len > 0 && paste[len - 1] == '\n')
+				paste[--len] = '\0';
+			if (memchr(paste, '\n', len) == NULL)
 			{
-                printf("\b \b"); // overwrite previous characters with spaces
-            }
+				le_insert(&ed, paste, len);
+				free(paste);
+				continue;
+			}
 			
-            printf("%s", history[history_index]);  
-            fflush(stdout); 
-            pos = strlen(history[history_index]);
-            strcpy(str, history[history_index]);
-        } 
-		else 
-		{
-            // handle other characters
-			if (ch > 32 && ch <= 126)
-				non_space = 1;
+			// the lines go in at the cursor, between what was typed before and after it
+			char* before = gb_text_before_cursor(&ed.gb);
+			char* all = gb_text(&ed.gb);
+			size_t split = strlen(before);
+			struct strbuf text = { NULL, 0, 0 };
+			sb_append(&text, before, split);
+			sb_append(&text, paste, len);
+			sb_append(&text, all + split, strlen(all) - split);
+			free(before);
+			free(all);
+			free(paste);
 			
-			if (ch == '\n' && on_cmd_index > 0)
+			le_move(&ed, gb_length(&ed.gb));
+			printf("\n");
+			if (confirm_paste(text.data))
 			{
-				add_to_history(str);
-				printf("\n");
+				// kept out of the history, its entries come back into a one line editor
+				le_end(&ed);
+				le_bracketed_paste(0);
+				line->len = 0;
+				sb_append(line, text.data, text.len);
+				free(text.data);
 				return 0;
 			}
+			free(text.data);
+			print_dir();
+			le_refresh(&ed);
+			continue;
+		}
+		
+        if (ch == KEY_UP || ch == KEY_DOWN) 
+		{
+			// pick up what other sessions added, unless in the middle of the list
+			if (history_index == history_count)
+				sync_shared_history();
+			
+			if (ch == KEY_UP && history_index > 0)
+				history_index--;
+			else if (ch == KEY_DOWN && history_index < history_count)
+				history_index++;
+			else
+				continue;
+			
+			// one past the newest entry is the empty line
+			le_set(&ed, history_index < history_count ? history[history_index] : "");
+        } 
+		else if (ch == KEY_PAGE_UP || ch == KEY_PAGE_DOWN)
+		{
+			sync_shared_history();
+			// jump to the oldest command, or back to a new line
+			history_index = (ch == KEY_PAGE_UP) ? 0 : history_count;
+			le_set(&ed, history_index < history_count ? history[history_index] : "");
+		}
+		else if (ch == '\t') // completion
+		{
+			struct strbuf insert = { NULL, 0, 0 };
+			sb_append(&insert, "", 0);
 			
-            if (ch == '\n') 
+			char* before = gb_text_before_cursor(&ed.gb);
+			if (complete_line(before, strlen(before), &insert))
 			{
-                if (pos == 0 || str == NULL  || !non_space) 
-				{
-                    printf("\n");	// a new line for the directory
-					return 1;
-                } 
-				else 
-				{
-                    str[pos] = '\0'; // null-terminate string
-                    printf("\n");
-                    add_to_history(str);
-                }
-                return 0;
-            } 
-			else if (ch == 127 && pos >= 0) // backspace
-			{ 
-                printf("\b \b");
-                pos--;
-            } 
-			else if (ch >= 32 && ch <= 126) // printable characters
-			{ 
-                printf("%c", ch);
-                str[pos++] = ch;
-            }
-        }
-    } while (ch != '\n' && pos < 999);
-    str[pos] = '\0'; // null-terminate string if buffer is full
+				print_dir();
+				le_refresh(&ed);
+			}
+			le_insert(&ed, insert.data, insert.len);
+			free(before);
+			free(insert.data);
+		}
+		else if (ch >= 32 && ch <= 126) // printable characters
+		{ 
+			char c = ch;
+			le_insert(&ed, &c, 1);
+		}
+		else
+		{
+			// motions, backspace and delete
+			le_handle_key(&ed, ch);
+		}
+    }
+	
+	le_move(&ed, gb_length(&ed.gb));
+	le_bracketed_paste(0);
+	printf("\n");
+	
+	char* text = gb_text(&ed.gb);
+	le_end(&ed);
+	
+	line->len = 0;
+	sb_append(line, text, strlen(text));
+	free(text);
+	
+	// a blank line just gets a new prompt
+	if (strspn(line->data, " \t") == line->len)
+		return 1;
+	
+	add_to_history(line->data);
 	return 0;
 }
 
+int confirm_paste(const char* text)
+{
+	int lines = 1;
+	for (const char* p = text; *p != '\0'; p++)
+		lines += *p == '\n';
+	
+	printf("%s\nRun these %d lines? [y/N] ", text, lines);
+	fflush(stdout);
+	
+	int key = read_arrow_key();
+	printf("\n");
+	return key == 'y' || key == 'Y';
+}
+
+/*
+	Works out what Tab should add at the end of the line. The word under the
+	cursor is completed as a command name when it's the first word of a 
+	command and has no '/', otherwise as a file name. A single match is 
+	finished off with a space (or a '/' for directories). Several matches are 
+	extended to their longest common prefix, and when that adds nothing they
+	are listed instead, in which case 1 is returned so the caller can redraw.
+*/
+int complete_line(const char* line, int len, struct strbuf* insert)
+{
+	int start = len;
+	while (start > 0 && line[start - 1] != ' ')
+		start--;
+	
+	// it's a command name if nothing but an operator comes before it
+	int prev_end = start;
+	while (prev_end > 0 && line[prev_end - 1] == ' ')
+		prev_end--;
+	int prev_start = prev_end;
+	while (prev_start > 0 && line[prev_start - 1] != ' ')
+		prev_start--;
+	char prev[4] = "";
+	if (prev_end - prev_start < (int)sizeof(prev))
+	{
+		memcpy(prev, line + prev_start, prev_end - prev_start);
+		prev[prev_end - prev_start] = '\0';
+	}
+	
+	char word[len - start + 1];
+	memcpy(word, line + start, len - start);
+	word[len - start] = '\0';
+	
+	int is_cmd = (prev_end == 0 || strcmp(prev, "|") == 0 || strcmp(prev, "&") == 0 ||
+				  strcmp(prev, ";") == 0 || strcmp(prev, "&&") == 0 || strcmp(prev, "||") == 0) &&
+				 strchr(word, '/') == NULL;
+	
+	char** matches = NULL;
+	int count = 0;
+	int cap = 0;
+	const char* prefix = word;
+	char dir_path[len - start + 2];
+	
+	if (is_cmd)
+	{
+		refresh_path_index();
+		
+		// everything from the first name with the prefix until one without it
+		size_t plen = strlen(word);
+		int lo = 0;
+		int hi = path_index_count;
+		while (lo < hi)
+		{
+			int mid = (lo + hi) / 2;
+			if (strcmp(path_index[mid].name, word) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		for (int i = lo; i < path_index_count && strncmp(path_index[i].name, word, plen) == 0; i++)
+			add_glob_match(path_index[i].name, &matches, &count, &cap);
+		
+		for (int i = 0; i < BUILTIN_COUNT; i++)
+		{
+			if (strncmp(builtin_list[i], word, plen) == 0)
+				add_glob_match(builtin_list[i], &matches, &count, &cap);
+		}
+		for (int b = 0; b < FUNC_BUCKETS; b++)
+		{
+			for (struct shell_function* fn = func_table[b]; fn != NULL; fn = fn->next)
+			{
+				if (strncmp(fn->name, word, plen) == 0)
+					add_glob_match(fn->name, &matches, &count, &cap);
+			}
+		}
+	}
+	else
+	{
+		// split the word into the directory to list and the name prefix
+		char* slash = strrchr(word, '/');
+		if (slash != NULL)
+		{
+			memcpy(dir_path, word, slash - word + 1);
+			dir_path[slash - word + 1] = '\0';
+			prefix = slash + 1;
+		}
+		else
+		{
+			strcpy(dir_path, "");
+		}
+		
+		glob_generation++;
+		struct dir_listing* dir = get_dir_listing(*dir_path ? dir_path : ".");
+		size_t plen = strlen(prefix);
+		for (int i = 0; dir != NULL && i < dir->count; i++)
+		{
+			const char* name = dir->names + dir->offsets[i];
+			if ((name[0] != '.' || prefix[0] == '.') && strncmp(name, prefix, plen) == 0)
+				add_glob_match(name, &matches, &count, &cap);
+		}
+	}
+	
+	int listed = 0;
+	if (count > 0)
+	{
+		qsort(matches, count, sizeof(char*), compare_strings);
+		
+		// longest prefix shared by every match (duplicates from PATH sort together)
+		size_t common = strlen(matches[0]);
+		int unique = 1;
+		for (int i = 1; i < count; i++)
+		{
+			size_t j = 0;
+			while (j < common && matches[i][j] == matches[0][j])
+				j++;
+			common = j;
+			if (strcmp(matches[i], matches[0]) != 0)
+				unique = 0;
+		}
+		
+		size_t plen = strlen(prefix);
+		if (common > plen)
+			sb_append(insert, matches[0] + plen, common - plen);
+		
+		if (unique)
+		{
+			// finish the word off
+			struct stat st;
+			char path[strlen(dir_path) + strlen(matches[0]) + 1];
+			sprintf(path, "%s%s", is_cmd ? "" : dir_path, matches[0]);
+			if (!is_cmd && stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+				sb_append(insert, "/", 1);
+			else
+				sb_append(insert, " ", 1);
+		}
+		else if (common == plen)
+		{
+			printf("\n");
+			int column = 0;
+			for (int i = 0; i < count; i++)
+			{
+				if (i > 0 && strcmp(matches[i], matches[i - 1]) == 0)
+					continue;
+				if (column + strlen(matches[i]) + 2 > 80 && column > 0)
+				{
+					printf("\n");
+					column = 0;
+				}
+				column += printf("%s  ", matches[i]);
+			}
+			printf("\n");
+			listed = 1;
+		}
+	}
+	
+	free_tokens(matches, count);
+	free(matches);
+	return listed;
+}
+
+/*
+	Keeps the index of executables on PATH up to date. It is built the first
+	time it's needed. After that, inotify reports files being created, 
+	removed, renamed or chmod'ed in the PATH directories, and only the names
+	involved are checked again, so nothing is rescanned on a keypress. If 
+	PATH itself changes, or the kernel drops events, it starts over.
+*/
+void refresh_path_index()
+{
+	const char* path = getenv("PATH");
+	if (path == NULL)
+		path = "/usr/bin:/bin";
+	
+	if (path_index_env == NULL || strcmp(path_index_env, path) != 0)
+	{
+		build_path_index(path);
+		return;
+	}
+	
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while (1)
+	{
+		ssize_t n = read(path_inotify_fd, buf, sizeof(buf));
+		if (n <= 0)
+			break;
+		
+		for (char* p = buf; p < buf + n; )
+		{
+			struct inotify_event* event = (struct inotify_event*)p;
+			p += sizeof(struct inotify_event) + event->len;
+			
+			if (event->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF))
+			{
+				build_path_index(path);
+				return;
+			}
+			
+			int dir = 0;
+			while (dir < path_dir_count && path_dirs[dir].wd != event->wd)
+				dir++;
+			if (dir == path_dir_count || event->len == 0)
+				continue;
+			
+			// whatever happened, the name is now either runnable from there or not
+			update_path_entry(dir, event->name);
+		}
+	}
+}
+
+void build_path_index(const char* path)
+{
+	for (int i = 0; i < path_index_count; i++)
+		free(path_index[i].name);
+	for (int i = 0; i < path_dir_count; i++)
+		free(path_dirs[i].path);
+	path_index_count = 0;
+	path_dir_count = 0;
+	free(path_index_env);
+	path_index_env = strdup(path);
+	
+	if (path_inotify_fd >= 0)
+		close(path_inotify_fd);
+	path_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	
+	char* copy = strdup(path);
+	char* rest = copy;
+	char* dir;
+	while ((dir = strsep(&rest, ":")) != NULL && path_dir_count < MAX_PATH_DIRS)
+	{
+		if (*dir == '\0')
+			dir = ".";
+		
+		struct path_dir* pd = &path_dirs[path_dir_count];
+		pd->path = strdup(dir);
+		pd->wd = -1;
+		if (path_inotify_fd >= 0)
+		{
+			pd->wd = inotify_add_watch(path_inotify_fd, dir, IN_CREATE | IN_DELETE | IN_ATTRIB | 
+									   IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+		}
+		path_dir_count++;
+		
+		// appended unsorted, a sorted insert for each would move the whole index every time
+		glob_generation++;
+		struct dir_listing* listing = get_dir_listing(dir);
+		for (int i = 0; listing != NULL && i < listing->count; i++)
+		{
+			const char* name = listing->names + listing->offsets[i];
+			if (!path_entry_runnable(path_dir_count - 1, name))
+				continue;
+			
+			if (path_index_count == path_index_cap)
+			{
+				path_index_cap = path_index_cap ? path_index_cap * 2 : 1024;
+				path_index = realloc(path_index, path_index_cap * sizeof(struct path_entry));
+			}
+			path_index[path_index_count].name = strdup(name);
+			path_index[path_index_count].dirs = 1ULL << (path_dir_count - 1);
+			path_index_count++;
+		}
+	}
+	free(copy);
+	
+	// one sort, then a name found in several directories becomes one entry with all their bits
+	qsort(path_index, path_index_count, sizeof(struct path_entry), compare_path_entries);
+	int n = 0;
+	for (int i = 0; i < path_index_count; i++)
+	{
+		if (n > 0 && strcmp(path_index[n - 1].name, path_index[i].name) == 0)
+		{
+			path_index[n - 1].dirs |= path_index[i].dirs;
+			free(path_index[i].name);
+		}
+		else
+			path_index[n++] = path_index[i];
+	}
+	path_index_count = n;
+}
+
+int compare_path_entries(const void* a, const void* b)
+{
+	return strcmp(((const struct path_entry*)a)->name, ((const struct path_entry*)b)->name);
+}
+
+int path_entry_runnable(int dir, const char* name)
+{
+	char full[strlen(path_dirs[dir].path) + strlen(name) + 2];
+	sprintf(full, "%s/%s", path_dirs[dir].path, name);
+	
+	struct stat st;
+	return stat(full, &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111);
+}
+
+/*
+	Checks whether name in PATH directory dir is an executable file, and 
+	adds or removes that directory from the name's entry. The index is kept 
+	sorted so prefixes can be found with a binary search. This is for the 
+	single names inotify reports, build_path_index() sorts once instead.
+*/
+void update_path_entry(int dir, const char* name)
+{
+	int runnable = path_entry_runnable(dir, name);
+	
+	int lo = 0;
+	int hi = path_index_count;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (strcmp(path_index[mid].name, name) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	int found = lo < path_index_count && strcmp(path_index[lo].name, name) == 0;
+	unsigned long long bit = 1ULL << dir;
+	
+	if (runnable && !found)
+	{
+		if (path_index_count == path_index_cap)
+		{
+			path_index_cap = path_index_cap ? path_index_cap * 2 : 1024;
+			path_index = realloc(path_index, path_index_cap * sizeof(struct path_entry));
+		}
+		memmove(path_index + lo + 1, path_index + lo, (path_index_count - lo) * sizeof(struct path_entry));
+		path_index[lo].name = strdup(name);
+		path_index[lo].dirs = bit;
+		path_index_count++;
+	}
+	else if (runnable)
+	{
+		path_index[lo].dirs |= bit;
+	}
+	else if (found)
+	{
+		path_index[lo].dirs &= ~bit;
+		if (path_index[lo].dirs == 0)
+		{
+			free(path_index[lo].name);
+			memmove(path_index + lo, path_index + lo + 1, (path_index_count - lo - 1) * sizeof(struct path_entry));
+			path_index_count--;
+		}
+	}
+}
+
 /*
 	This doesn't work 100%. The user has to hit ctrl-c then enter to leave the
 	signal handler and continue in the code (to the handle signal method). 
@@ -298,14 +1803,16 @@ void sig_handler(int signo)
 void handle_signal()
 {
 	char ch;
-	char cmd[100];	// final command
+	char* cmd = NULL;	// final command
 	char input[100];
 	int input_len = 0;
 	int matched = 0;
 		
-	char unique_commands[HISTORY_SIZE][1000];
+	char* unique_commands[HISTORY_SIZE];
     int unique_count = 0; // number of unique commands
 	
+	sync_shared_history();
+	
 	// copy only the first instance of each command to unique_commands
     for (int i = 0; i < history_count; i++) 
 	{
@@ -320,7 +1827,7 @@ void handle_signal()
         }
         if (!found) 
 		{
-            strcpy(unique_commands[unique_count], history[i]);
+            unique_commands[unique_count] = history[i];
             unique_count++;
         }
     }
@@ -339,19 +1846,19 @@ void handle_signal()
 			break;
 		}
 		
-		if (ch >= 32 && ch <= 126 && matched != 1) // printable characters
+		if (ch >= 32 && ch <= 126 && matched != 1 && input_len < (int)sizeof(input)) // printable characters
 		{ 
 			input[input_len] = ch;
 			input_len++;
 			// search for matching command prefixes in history
 			int match_count = 0;
-			char matched_command[1000] = {0};
+			char* matched_command = NULL;
 			for (int i = 0; i < unique_count; i++) 
 			{
 				if (strncmp(unique_commands[i], input, input_len) == 0) 
 				{
 					match_count++;
-					strcpy(matched_command, unique_commands[i]);		
+					matched_command = unique_commands[i];		
 				}
 			}
 			
@@ -366,58 +1873,43 @@ void handle_signal()
 					printf("\b \b"); // overwrite previous characters with spaces
 				}
 				printf("%s", matched_command);
-				stpcpy(cmd, matched_command);
+				
+				// a copy, since parsing changes the string and history may drop it
+				free(cmd);
+				cmd = strdup(matched_command);
 				matched = 1;
 				fflush(stdout);
 			} 
 		}
 		
 	}while (ch != '\n');
+	free(cmd);
 }
 
 /*
-	Reads in and detects whether or not there is an arrow key pressed. If up, 
-	it returns U, if down, it returns D. Otherwise, the character is read in 
-	normally through getchar, called in getch().
+	Reads in a key. The decoding of the escape sequences that the arrow keys
+	and the other editing keys send is done by le_read_key() in line_edit.c,
+	special keys come back as the KEY_ codes from line_edit.h. A lone Escape
+	comes back as 27 once the rest of a sequence has had $ESCDELAY ms (100 by
+	default) to arrive.
 */
-char read_arrow_key() 
+int read_arrow_key() 
 {
-	// up is ^[[A and down is ^[[B
-    char escape = 27;	// ' ^[ '
-    char bracket = '[';
-    char key = getch();
-    if (key == escape) 
-	{
-        key = getch();
-        if (key == bracket) 
-		{
-			key = getch();
-			switch (key) 
-			{
-				case 'A': // Up arrow
-					if (history_index > 0) 
-					{
-						history_index--;
-						return 'U';
-					}
-					break;
-				case 'B': // Down arrow
-					if (history_index < history_count) 
-					{
-						history_index++;
-						return 'D';
-					}
-					break;
-			}
-        }
-    }
+	struct termios saved;
+	int key;
+	
+	initTermios(0, &saved);
+	key = le_read_key(STDIN_FILENO);
+	resetTermios(&saved);
+	return key;
 }
 
 /* Initialize new terminal i/o settings */
-void initTermios(int echo) 
+void initTermios(int echo, struct termios* saved) 
 {
-  tcgetattr(0, &old); /* grab old terminal i/o settings */
-  current = old; /* make new settings same as old settings */
+  struct termios current;
+  tcgetattr(0, saved); /* grab old terminal i/o settings */
+  current = *saved; /* make new settings same as old settings */
   current.c_lflag &= ~ICANON; /* disable buffered i/o */
   if (echo) {
       current.c_lflag |= ECHO; /* set echo mode */
@@ -428,18 +1920,20 @@ void initTermios(int echo)
 }
 
 /* Restore old terminal i/o settings */
-void resetTermios(void) 
+void resetTermios(const struct termios* saved) 
 {
-  tcsetattr(0, TCSANOW, &old);
+  tcsetattr(0, TCSANOW, saved);
 }
 
 /* Read 1 character - echo defines echo mode */
 char getch_(int echo) 
 {
+  struct termios saved;
   char ch;
-  initTermios(echo);
-  ch = getchar();
-  resetTermios();
+  initTermios(echo, &saved);
+  if (read(STDIN_FILENO, &ch, 1) != 1) /* not getchar, so stdio holds nothing back */
+    ch = EOF;
+  resetTermios(&saved);
   return ch;
 }
 
@@ -449,343 +1943,6249 @@ char getch(void)
   return getch_(0);
 }
 
-int builtin_cmd_handler() 
-{ 
-    int cmd_count = 3;
-    int curr_arg = 0; 
-    char* cmd_list[cmd_count]; 
-  
-    cmd_list[0] = "exit"; 
-    cmd_list[1] = "cd";  
-    cmd_list[2] = "history";  
-  
-    for (int i = 0; i < cmd_count; i++) 
+int find_builtin(const char* name)
+{
+	if (name == NULL)
+		return 0;
+	
+	for (int i = 0; i < BUILTIN_COUNT; i++) 
     { 
     	// if our token matches one of the built-in commands
-        if (strcmp(tokens[0], cmd_list[i]) == 0) 
-        { 
-            curr_arg = i + 1; 
-            break; 
-        } 
+        if (strcmp(name, builtin_list[i]) == 0) 
+			return i + 1; 
     } 
+	return 0;
+}
+
+int builtin_needs_fds(const char* name)
+{
+	return strcmp(name, "timeout") == 0 || strcmp(name, "memo") == 0 || strcmp(name, "watch") == 0;
+}
+
+int builtin_changes_state(const char* name)
+{
+	return strcmp(name, "exit") == 0 || strcmp(name, "cd") == 0 || 
+		   strcmp(name, "set") == 0 || strcmp(name, "local") == 0 ||
+		   strcmp(name, "return") == 0 || strcmp(name, "coproc") == 0 || 
+		   strcmp(name, "coclose") == 0;
+}
+
+int builtin_cmd_handler(char** args, FILE* in, FILE* out) 
+{ 
+    int curr_arg = find_builtin(args[0]); 
+	int prev_status = last_status;	// what exit and return use by default
+	
+	if (curr_arg != 0)
+		last_status = 0;
   
   	// Determine which cmd is being called
     if (curr_arg == 1) 
     {
-		exit(0);
+		// exit() would also flush the batch file's buffer, which in a forked
+		// subshell moves the file offset the parent is still reading from
+		fflush(stdout);
+		_exit(args[1] != NULL ? atoi(args[1]) : prev_status);
 	} 
 	else if (curr_arg == 2) 
 	{
-		if (*tokens[1] == '~')
+		if (args[1] == NULL || *args[1] == '~')
 			chdir(getenv("HOME"));
 		else
 		{
-			if (chdir(tokens[1]) < 0)
+			if (chdir(args[1]) < 0)
+			{
 				perror("cd");
+				last_status = 1;
+			}
 		}
 		
 		return 1;
 	}
 	else if (curr_arg == 3) 
 	{
-		print_history();
+		print_history(out);
 		return 1;
 	}
-  
-    return 0; 
-} 
-
-void print_history() 
-{
-    printf("\n");
-    for (int i = 0; i < history_count; i++) 
+	else if (curr_arg == 4)
 	{
-		if (i < 9)
-			printf(" %d: %s\n", i + 1, history[i]);
-		else
-			printf("%d: %s\n", i + 1, history[i]);
-    }
-	printf("\n");
-}
-
-void add_to_history(const char *cmd) 
-{
-    // Check if history is full, if so, remove the oldest command
-    if (history_count == HISTORY_SIZE) 
+		return pmap_builtin(args, in, out);
+	}
+	else if (curr_arg == 5)
 	{
-        for (int i = 1; i < HISTORY_SIZE; i++) 
-		{
-            strcpy(history[i - 1], history[i]);
-        }
-        history_count--;
-    }
-    strcpy(history[history_count], cmd);
-    history_count++;
-	history_index = history_count;
-}
-
-void tokenize_str(char* str) 
-{ 	
-    for (int i = 0; i < 100; i++) // 100 is our maximum size
-    { 
-    	// put each string token into the list
-        tokens[i] = strsep(&str, " "); 
-  
-  		// if the current token is null
-        if (tokens[i] == NULL) 
-            break; 
-        
-        // if the token is an empty string, don't store it
-        if (strlen(tokens[i]) == 0) 
+		// only -e and +e for now
+		for (int i = 1; args[i] != NULL; i++)
 		{
-            i--; 
+			if (strcmp(args[i], "-e") == 0)
+				errexit = 1;
+			else if (strcmp(args[i], "+e") == 0)
+				errexit = 0;
+			else
+			{
+				fprintf(stderr, "set: unknown option %s\n", args[i]);
+				last_status = 1;
+			}
 		}
-    } 
+		return 1;
+	}
+	else if (curr_arg == 6)
+	{
+		return tee_builtin(args, in, out);
+	}
+	else if (curr_arg == 7)
+	{
+		return grep_builtin(args, in, out);
+	}
+	else if (curr_arg == 8)
+	{
+		local_builtin(args);
+		return 1;
+	}
+	else if (curr_arg == 9)
+	{
+		if (call_stack == NULL)
+		{
+			fprintf(stderr, "return: can only be used in a function\n");
+			last_status = 1;
+			return 1;
+		}
+		last_status = args[1] != NULL ? atoi(args[1]) : prev_status;
+		func_returning = 1;
+		return 1;
+	}
+	else if (curr_arg == 10)
+	{
+		fflush(out);
+		timeout_builtin(args);
+		return 1;
+	}
+	else if (curr_arg == 11)
+	{
+		fflush(out);
+		memo_builtin(args);
+		return 1;
+	}
+	else if (curr_arg == 12)
+	{
+		fflush(out);
+		watch_builtin(args);
+		return 1;
+	}
+	else if (curr_arg == 13)
+	{
+		fflush(out);
+		coproc_builtin(args);
+		return 1;
+	}
+	else if (curr_arg == 14)
+	{
+		cowrite_builtin(args, in);
+		return 1;
+	}
+	else if (curr_arg == 15)
+	{
+		coread_builtin(args, out);
+		return 1;
+	}
+	else if (curr_arg == 16)
+	{
+		coclose_builtin(args);
+		return 1;
+	}
+  
+    return 0; 
 } 
 
-/*
-	Sets up the redirection files if found, and replaces any input or output
-	files and redirection symbols with NULL. Then, it executes all the commands.
-	If there is piping and redirection in the same line, it opens the output 
-	file for writing, and then executes the rest of the command, including the
-	piping.
-*/
-void parse_string(char* str) 
-{ 
-	//add_to_history(str);
+void print_history(FILE* out) 
+{
+	sync_shared_history();
+    fprintf(out, "\n");
+    for (int i = 0; i < history_count; i++) 
+	{
+		if (i < 9)
+			fprintf(out, " %d: %s\n", i + 1, history[i]);
+		else
+			fprintf(out, "%d: %s\n", i + 1, history[i]);
+    }
+	fprintf(out, "\n");
+}
 
-	tokenize_str(str); 
-	
-	if (tokens[0] == NULL)
-		perror("no tokens");
+/*
+	pmap [-P N] [-n BATCH] [-k] cmd [args...] [::: items...]
 	
-	// copy the stdin, stdout, and stderr descriptors so they can 
-	// be restored later
-	int std_in = dup(0);
-	int std_out = dup(1);
-	int std_err = dup(2);
+	Runs cmd once for every item (or every BATCH items), with at most N 
+	running at the same time. The items come after ::: or, without it, one 
+	per line from stdin. They are added to the end of the command, or put in 
+	place of a {} argument. Each job's output is collected on its own pipe and 
+	written out whole when the job ends, so jobs never interleave. With -k the 
+	output comes out in the order of the items instead of finishing order.
 	
+	The items are shared out with work stealing. Every slot starts with its 
+	own contiguous range of items and takes jobs from the front of it. A slot 
+	that runs out steals the back half of whichever range has the most left, 
+	so slow items don't leave the other cores idle at the end, and because 
+	the ranges stay contiguous, ordered output can be written out steadily.
+*/
+int pmap_builtin(char** args, FILE* in, FILE* out)
+{
+	long slots = sysconf(_SC_NPROCESSORS_ONLN);
+	int batch = 1;
+	int keep_order = 0;
 	int i = 1;
-	char* curr_phrase[100];
-	char* first_phrase[100];
-	first_phrase[0] = tokens[0];
-	int is_piped = 0;
 	
-	// Search through the tokens to check if we have piping and then a redirection.
-	// If we do, open the appropriate file with the appropriate appending 
-	// strategy.
-	int k = 0;
-	int pp = 0;
-	while (tokens[k] != NULL)
+	for (; args[i] != NULL && args[i][0] == '-'; i++)
 	{
-		if (strcmp(tokens[k], "|") == 0)
+		if (strcmp(args[i], "-k") == 0)
 		{
-			pp = 1;
+			keep_order = 1;
 		}
-		
-		if (pp == 1)
+		else if ((strcmp(args[i], "-P") == 0 || strcmp(args[i], "-n") == 0) && args[i + 1] != NULL)
+		{
+			char* end;
+			long value = strtol(args[i + 1], &end, 10);
+			long max = args[i][1] == 'P' ? INT32_MAX : PMAP_MAX_BATCH;	// -P is capped below
+			if (*end != '\0' || value < 1 || value > max)
+			{
+				fprintf(stderr, "pmap: %s needs a number from 1 to %ld\n", args[i], max);
+				last_status = 1;
+				return 1;
+			}
+			if (args[i][1] == 'P')
+				slots = value;
+			else
+				batch = value;
+			i++;
+		}
+		else
+		{
+			fprintf(stderr, "usage: pmap [-P N] [-n BATCH] [-k] cmd [args...] [::: items...]\n");
+			last_status = 2;
+			return 1;
+		}
+	}
+	
+	// the command runs up to ::: and the items follow it
+	char** cmd = args + i;
+	int cmd_len = 0;
+	while (cmd[cmd_len] != NULL && strcmp(cmd[cmd_len], ":::") != 0)
+		cmd_len++;
+	if (cmd_len == 0)
+	{
+		fprintf(stderr, "pmap: no command given\n");
+		last_status = 2;
+		return 1;
+	}
+	
+	struct strbuf input = { NULL, 0, 0 };
+	char** items = NULL;
+	int item_count = 0;
+	if (cmd[cmd_len] != NULL)
+	{
+		items = cmd + cmd_len + 1;
+		while (items[item_count] != NULL)
+			item_count++;
+	}
+	else
+	{
+		// one item per non-empty line of stdin
+		sb_read_stream(&input, in);
+		int cap = 0;
+		char* rest = input.data;
+		char* line;
+		while (rest != NULL && (line = strsep(&rest, "\n")) != NULL)
+		{
+			if (*line == '\0')
+				continue;
+			if (item_count == cap)
+			{
+				cap = cap ? cap * 2 : 64;
+				items = realloc(items, cap * sizeof(char*));
+			}
+			items[item_count++] = line;
+		}
+	}
+	
+	if (item_count == 0)
+	{
+		if (cmd[cmd_len] == NULL)
+			free(items);
+		free(input.data);
+		return 1;
+	}
+	
+	if (slots > PMAP_MAX_SLOTS)
+		slots = PMAP_MAX_SLOTS;
+	if (batch > item_count)
+		batch = item_count;
+	if (slots > item_count)
+		slots = item_count;
+	
+	// split the items into one contiguous range per slot
+	struct pmap_slot slot[slots];
+	for (int s = 0; s < slots; s++)
+	{
+		slot[s].lo = (int)((long)item_count * s / slots);
+		slot[s].hi = (int)((long)item_count * (s + 1) / slots);
+		slot[s].pid = -1;
+		slot[s].fd = -1;
+		slot[s].job = NULL;
+	}
+	
+	// completed jobs waiting their turn, indexed by their first item
+	struct pmap_job** finished = keep_order ? calloc(item_count, sizeof(struct pmap_job*)) : NULL;
+	int next_item = 0;	// first item not written yet, for -k
+	int running = 0;
+	int failures = 0;
+	int broken = 0;	// a pipe, fork or poll failed, stop starting jobs
+	int devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	char** job_args = malloc((cmd_len + batch + 1) * sizeof(char*));
+	
+	while (1)
+	{
+		// give every idle slot a job, stealing one if its own range is empty
+		for (int s = 0; s < slots && !broken; s++)
 		{
-			if (strcmp(tokens[k], ">") == 0)
+			if (slot[s].pid > 0)
+				continue;
+			
+			if (slot[s].lo == slot[s].hi)
 			{
-				int out = open(tokens[k + 1], O_WRONLY | O_TRUNC | O_CREAT, 0666);
-				if (out < 0 || dup2(out, 1) < 0)
+				int victim = -1;
+				for (int v = 0; v < slots; v++)
 				{
-					perror("redirection '>' ");
+					if (slot[v].hi - slot[v].lo > 0 && 
+						(victim < 0 || slot[v].hi - slot[v].lo > slot[victim].hi - slot[victim].lo))
+						victim = v;
 				}
-
-				close(out);
-				tokens[k] = NULL;
-				tokens[k + 1] = NULL;
-				break;
+				if (victim < 0)
+					continue;
+				
+				int mid = slot[victim].lo + (slot[victim].hi - slot[victim].lo) / 2;
+				slot[s].lo = mid;
+				slot[s].hi = slot[victim].hi;
+				slot[victim].hi = mid;
 			}
-			else if(strcmp(tokens[k], ">>") == 0)
+			
+			struct pmap_job* job = calloc(1, sizeof(*job));
+			job->first = slot[s].lo;
+			job->count = slot[s].hi - slot[s].lo < batch ? slot[s].hi - slot[s].lo : batch;
+			slot[s].lo += job->count;
+			
+			// build the command line, putting the items in place of {} if it's there
+			int n = 0;
+			int placed = 0;
+			for (int a = 0; a < cmd_len; a++)
 			{
-				int out = open(tokens[k + 1], O_WRONLY | O_APPEND | O_CREAT, 0666);
-				if (out < 0 || dup2(out, 1) < 0)
+				if (strcmp(cmd[a], "{}") == 0 && !placed)
 				{
-					perror("redirection '>>' ");
+					for (int k = 0; k < job->count; k++)
+						job_args[n++] = items[job->first + k];
+					placed = 1;
 				}
-
-				close(out);
-				tokens[k] = NULL;
-				tokens[k + 1] = NULL;
+				else if (strcmp(cmd[a], "{}") != 0)
+				{
+					job_args[n++] = cmd[a];
+				}
+			}
+			for (int k = 0; k < job->count && !placed; k++)
+				job_args[n++] = items[job->first + k];
+			job_args[n] = NULL;
+			
+			int fd[2];
+			if (pipe2(fd, O_CLOEXEC) < 0)
+			{
+				perror("pmap: pipe");
+				free(job);
+				broken = 1;
 				break;
 			}
-			k++;
+			slot[s].pid = spawn_cmd(job_args, devnull, fd[1], 0);
+			close(fd[1]);
+			if (slot[s].pid < 0)
+			{
+				perror("pmap: fork");
+				slot[s].pid = -1;
+				close(fd[0]);
+				free(job);
+				broken = 1;
+				break;
+			}
+			slot[s].fd = fd[0];
+			slot[s].job = job;
+			running++;
 		}
-		else 
+		
+		if (running == 0)
+			break;
+		
+		// collect output from whichever jobs have some
+		struct pollfd fds[slots];
+		for (int s = 0; s < slots; s++)
 		{
-			k++;
+			fds[s].fd = slot[s].pid > 0 ? slot[s].fd : -1;
+			fds[s].events = POLLIN;
+			fds[s].revents = 0;
+		}
+		if (poll(fds, slots, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("pmap: poll");
+			broken = 1;
+			break;
 		}
-	}
-	
-	while (tokens[i] != NULL)
-	{
-		first_phrase[i] = tokens[i];
 		
-		if (strcmp(tokens[i], "<" ) == 0)
-		{	// Input redirection
-			int in = open(tokens[i + 1], O_RDONLY, 0666);
-			if (in < 0 || dup2(in, 0) < 0)
+		for (int s = 0; s < slots; s++)
+		{
+			if (fds[s].revents == 0)
+				continue;
+			
+			struct pmap_job* job = slot[s].job;
+			char buf[PMAP_READ_SIZE];
+			ssize_t n = read(slot[s].fd, buf, sizeof(buf));
+			if (n > 0)
 			{
-				perror("redirection '<' ");
+				sb_append(&job->output, buf, n);
+				continue;
 			}
-
-			close(in);
-			tokens[i] = NULL;
-			tokens[i + 1] = NULL;
-			i += 2;
-		}
-		else if(strcmp(tokens[i], ">") == 0)
-		{
-			int out = open(tokens[i + 1], O_WRONLY | O_TRUNC | O_CREAT, 0666);
-			if (out < 0 || dup2(out, 1) < 0)
+			if (n < 0 && errno == EINTR)
+				continue;
+			
+			// end of output, the job is finished
+			int status;
+			close(slot[s].fd);
+			waitpid(slot[s].pid, &status, 0);
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+				failures++;
+			slot[s].pid = -1;
+			slot[s].job = NULL;
+			running--;
+			
+			if (!keep_order)
 			{
-				perror("redirection '>' ");
+				fwrite(job->output.data, 1, job->output.len, out);
+				free(job->output.data);
+				free(job);
+				continue;
+			}
+			
+			finished[job->first] = job;
+			while (next_item < item_count && finished[next_item] != NULL)
+			{
+				struct pmap_job* ready = finished[next_item];
+				fwrite(ready->output.data, 1, ready->output.len, out);
+				next_item += ready->count;
+				free(ready->output.data);
+				free(ready);
 			}
+		}
+		fflush(out);
+	}
+	
+	// after a failed poll some jobs may still be running, reap them
+	for (int s = 0; s < slots; s++)
+	{
+		if (slot[s].pid <= 0)
+			continue;
+		close(slot[s].fd);
+		waitpid(slot[s].pid, NULL, 0);
+		free(slot[s].job->output.data);
+		free(slot[s].job);
+	}
+	
+	// with -k, jobs stuck behind one that never ran are dropped
+	for (int i = next_item; keep_order && i < item_count; i++)
+	{
+		if (finished[i] == NULL)
+			continue;
+		free(finished[i]->output.data);
+		free(finished[i]);
+	}
+	
+	if (failures > 0)
+	{
+		fprintf(stderr, "pmap: %d job(s) failed\n", failures);
+		last_status = 1;
+	}
+	if (broken)
+		last_status = 1;
+	
+	close(devnull);
+	free(job_args);
+	free(finished);
+	if (cmd[cmd_len] == NULL)
+		free(items);
+	free(input.data);
+	return 1;
+}
 
-			close(out);
-			tokens[i] = NULL;
-			tokens[i + 1] = NULL;
-			i += 2;
+/*
+	tee [-a] [files...]
+	
+	Copies stdin to stdout and to every file, appending with -a. When stdin 
+	is a pipe the data never comes up into the shell's memory. tee(2) 
+	duplicates what is waiting in the stdin pipe straight into the stdout 
+	pipe, and into a staging pipe for each file, which splice(2) then empties
+	into the file. At the end of a round the data is spliced out of stdin 
+	into /dev/null to consume it. All of this only moves page references 
+	around, so a big stream is fanned out at page cache speed. A destination 
+	that splice doesn't work on (a terminal, an in-memory stream, some file 
+	systems) has its staging pipe copied through a buffer instead, and stdin
+	that isn't a pipe is read and written the ordinary way.
+*/
+int tee_builtin(char** args, FILE* in, FILE* out)
+{
+	int append = 0;
+	int i = 1;
+	
+	for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++)
+	{
+		if (strcmp(args[i], "-a") == 0)
+			append = 1;
+		else
+		{
+			fprintf(stderr, "usage: tee [-a] [files...]\n");
+			last_status = 2;
+			return 1;
 		}
-		else if(strcmp(tokens[i], ">>") == 0)
+	}
+	
+	// stdout first, so the one tee(2) that can come up short is the first
+	struct tee_dest dest[MAX_TOKENS];
+	int count = 0;
+	
+	fflush(out);
+	dest[count++].fd = fileno(out);
+	for (; args[i] != NULL; i++)
+	{
+		int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC);
+		int fd = open(args[i], flags, 0666);
+		if (fd < 0)
 		{
-			int out = open(tokens[i + 1], O_WRONLY | O_APPEND | O_CREAT, 0666);
-			if (out < 0 || dup2(out, 1) < 0)
+			perror(args[i]);
+			last_status = 1;
+			continue;
+		}
+		dest[count++].fd = fd;
+	}
+	
+	struct stat st;
+	int in_fd = fileno(in);
+	int in_pipe = in_fd >= 0 && fstat(in_fd, &st) == 0 && S_ISFIFO(st.st_mode);
+	int devnull = in_pipe ? open("/dev/null", O_WRONLY | O_CLOEXEC) : -1;
+	size_t len = TEE_PIPE_SIZE;
+	
+	for (int d = 0; d < count; d++)
+	{
+		dest[d].pipe[0] = -1;
+		dest[d].pipe[1] = -1;
+		dest[d].copy = (dest[d].fd < 0);
+		if (!in_pipe)
+			continue;
+		
+		if (d == 0 && dest[d].fd >= 0 && fstat(dest[d].fd, &st) == 0 && S_ISFIFO(st.st_mode))
+			continue;	// tee(2) goes right into it
+		
+		if (pipe2(dest[d].pipe, O_CLOEXEC) < 0)
+		{
+			perror("tee: pipe");
+			in_pipe = 0;
+			continue;
+		}
+		fcntl(dest[d].pipe[1], F_SETPIPE_SZ, TEE_PIPE_SIZE);
+		int size = fcntl(dest[d].pipe[1], F_GETPIPE_SZ);
+		if (size > 0 && (size_t)size < len)
+			len = size;
+	}
+	
+	char* buf = malloc(len);
+	int stop = 0;	// stdout's reader is gone, like being killed by SIGPIPE
+	
+	while (in_pipe && !stop)
+	{
+		ssize_t n = -1;
+		int short_copy = 0;
+		
+		// duplicate the next chunk of stdin into every destination
+		for (int d = 0; d < count; d++)
+		{
+			if (dest[d].failed)
+				continue;
+			
+			int target = dest[d].pipe[1] >= 0 ? dest[d].pipe[1] : dest[d].fd;
+			ssize_t m;
+			do
+				m = tee(in_fd, target, n < 0 ? len : (size_t)n, 0);
+			while (m < 0 && errno == EINTR);
+			
+			if (m < 0 && errno == EPIPE)
 			{
-				perror("redirection '>>' ");
+				last_status = 1;
+				stop = 1;
+				break;
 			}
-
-			close(out);
-			tokens[i] = NULL;
-			tokens[i + 1] = NULL;
-			i += 2;
+			if (m < 0)
+			{
+				if (n < 0)
+					break;	// tee(2) can't be used here at all
+				m = 0;
+			}
+			if (n < 0)
+				n = m;
+			dest[d].got = m;
+			if (m < n)
+				short_copy = 1;
 		}
-		else if (strcmp(tokens[i], "|") == 0) 
+		if (stop)
+			break;
+		if (n < 0)
 		{
-			is_piped = 1;
-			int j = 0;
-			first_phrase[i] = NULL;
-			tokens[i] = NULL;
-			i++;
-			while (tokens[i] != NULL)
+			in_pipe = 0;	// finish with plain copying
+			break;
+		}
+		if (n == 0)
+			break;	// end of input
+		for (int d = 0; d < count; d++)
+		{
+			if (dest[d].failed)
+				dest[d].got = n;	// nothing more goes to it
+		}
+		
+		// a destination that got less is finished from a copy of the chunk
+		if (short_copy)
+		{
+			tee_read(in_fd, buf, n);
+			for (int d = 0; d < count; d++)
 			{
-				curr_phrase[j] = tokens[i];
-				tokens[i] = NULL;
-								
-				j++;
-				i++;
+				if (dest[d].got < n && tee_write(&dest[d], out, buf + dest[d].got, n - dest[d].got) < 0 && 
+					errno == EPIPE)
+					stop = 1;
 			}
-			curr_phrase[j] = NULL;
-			
-            // Pipe redirection
-			int fd[2];
-			pipe(fd);
+		}
+		
+		// empty the staging pipes into the files
+		for (int d = 0; d < count && !stop; d++)
+		{
+			if (dest[d].pipe[0] < 0 || dest[d].failed)
+				continue;
 			
-			// left side of pipe
-			if (fork() == 0) 
+			ssize_t left = dest[d].got;
+			while (left > 0 && !dest[d].copy)
 			{
-				// replace stdout with pipe output
-				dup2(fd[1], STDOUT_FILENO);
-				close(fd[0]);
-				close(fd[1]);
-				
-				// execute command and check for error
-				if (execvp(first_phrase[0], first_phrase) == -1)
+				ssize_t m = splice(dest[d].pipe[0], NULL, dest[d].fd, NULL, left, SPLICE_F_MOVE);
+				if (m < 0 && errno == EINTR)
+					continue;
+				if (m <= 0)
 				{
-					perror("execvp first command");
-					exit(EXIT_FAILURE);
+					if (errno != EINVAL && errno != ENOSYS)
+						perror("tee");
+					dest[d].copy = 1;
+					break;
 				}
+				left -= m;
 			}
-			
-			// right side of pipe
-			if (fork() == 0)
+			if (left > 0)
 			{
-				// replace stdin with pipe input
-				dup2(fd[0], STDIN_FILENO);
-				close(fd[0]);
-				close(fd[1]);
-				
-				if (execvp(curr_phrase[0], curr_phrase) == -1)
+				tee_read(dest[d].pipe[0], buf, left);
+				if (tee_write(&dest[d], out, buf, left) < 0 && errno == EPIPE)
+					stop = 1;
+			}
+		}
+		
+		// and consume the chunk from stdin
+		if (!short_copy && !stop)
+		{
+			ssize_t left = n;
+			while (left > 0)
+			{
+				ssize_t m = splice(in_fd, NULL, devnull, NULL, left, SPLICE_F_MOVE);
+				if (m < 0 && errno == EINTR)
+					continue;
+				if (m <= 0)
 				{
-					perror("execvp second command");
-					exit(EXIT_FAILURE);
+					tee_read(in_fd, buf, left);
+					break;
 				}
+				left -= m;
 			}
-			
-			// parent doesn't need the pipe anymore
-			close(fd[0]);
-			close(fd[1]);
-			
-			// wait for both children to finish
-			while (wait(NULL) > 0);
 		}
-		else
+	}
+	
+	// stdin isn't a pipe (or tee(2) refused it), so copy through the buffer
+	if (!in_pipe && !stop)
+	{
+		ssize_t n;
+		while (!stop && (n = stream_read(in_fd, in, buf, len)) != 0)
 		{
-			i++;
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0)
+			{
+				perror("tee");
+				last_status = 1;
+				break;
+			}
+			for (int d = 0; d < count; d++)
+			{
+				if (tee_write(&dest[d], out, buf, n) < 0 && errno == EPIPE)
+					stop = 1;
+			}
 		}
 	}
-  
-	// if the cmd is a built-in one, execute it. If it's a normal UNIX command
-	// without piping, execute it.
-    if (builtin_cmd_handler()) 
+	
+	for (int d = 0; d < count; d++)
 	{
-		dup2(std_in, 0);
-		dup2(std_out, 1);
-		dup2(std_err, 2);
+		if (dest[d].pipe[0] >= 0)
+		{
+			close(dest[d].pipe[0]);
+			close(dest[d].pipe[1]);
+		}
+		if (d > 0)
+			close(dest[d].fd);
 	}
-	else if (is_piped == 0)
+	if (devnull >= 0)
+		close(devnull);
+	free(buf);
+	fflush(out);
+	return 1;
+}
+
+// Reads exactly n bytes from fd, less only at end of file
+void tee_read(int fd, char* buf, size_t n)
+{
+	while (n > 0)
 	{
-		process();
+		ssize_t m = read(fd, buf, n);
+		if (m < 0 && errno == EINTR)
+			continue;
+		if (m <= 0)
+			break;
+		buf += m;
+		n -= m;
 	}
-	
-	dup2(std_in, 0);
-	dup2(std_out, 1);
-	dup2(std_err, 2);
-} 
+}
 
-void process() 
-{ 
-	int is_background = 0;
-	for (int i = 0; tokens[i] != NULL; i++) 
+/*
+	Writes n bytes to the destination, or to out when it has no descriptor.
+	A destination that fails is marked and skipped from then on. The error
+	is reported once, except EPIPE, which only means the reader is gone and
+	the caller stops.
+*/
+int tee_write(struct tee_dest* dest, FILE* out, const char* buf, size_t n)
+{
+	int ok = 1;
+	
+	if (dest->failed)
+		return 0;
+	if (dest->fd < 0)
+		ok = fwrite(buf, 1, n, out) == n && !ferror(out);
+	
+	while (dest->fd >= 0 && n > 0)
 	{
-		// if we're trying to run the process in the background
-		if (strcmp(tokens[i], "&") == 0) 
+		ssize_t m = write(dest->fd, buf, n);
+		if (m < 0 && errno == EINTR)
+			continue;
+		if (m < 0)
 		{
-			// update flag and remove the & from the command args
-			is_background = 1;
-			tokens[i] = NULL;
+			ok = 0;
 			break;
 		}
+		buf += m;
+		n -= m;
 	}
+	if (ok)
+		return 0;
+	
+	int err = errno ? errno : EIO;
+	if (err != EPIPE)
+		fprintf(stderr, "tee: %s\n", strerror(err));
+	dest->failed = 1;
+	last_status = 1;
+	errno = err;
+	return -1;
+}
 
-    // forking a child 
-    pid_t pid = fork();  
-  
-    if (pid == -1) 
-	{ 
-        printf("\nFailed forking child.."); 
-        return; 
-    } 
-	else if (pid == 0) 
-	{ 
-        if (execvp(tokens[0], tokens) < 0) 
-		{ 
-            printf("Could not execute command\n"); 
-			exit(1);
-        } 
-        exit(0); 
-    } 
-	else 
-	{ 
-        // if process shouldn't run in background, wait for the 
-		// child process to finish
-        if (is_background < 1) 
+/*
+	grep [-cvnF] pattern [files...]
+	
+	Prints the lines that match pattern, from the files or from stdin. -c 
+	prints only how many lines were selected, -v selects the lines that 
+	don't match, -n puts the line number in front, and -F takes the pattern
+	as a fixed string. Without -F the pattern is a basic regular expression,
+	but only the simple part of it: . * ^ $ [...] and backslash escapes. 
+	Anything else, and any other option, returns 0 without doing anything,
+	so the caller runs the real grep instead.
+	
+	A regular file is mmap'd and searched in place. A pipe is read in big 
+	blocks and searched one block of whole lines at a time. Lines aren't 
+	looked at one by one. The longest piece of plain text the pattern must 
+	contain is searched for over the whole buffer with the vector kernels 
+	below, and only the line around a hit is checked against the full 
+	pattern. Lines before a hit are skipped over without being examined, 
+	except for counting the newlines in them with -n.
+*/
+int grep_builtin(char** args, FILE* in, FILE* out)
+{
+	struct grep_state st;
+	int fixed = 0;
+	int i;
+	
+	memset(&st, 0, sizeof(st));
+	st.out = out;
+	if ((i = grep_options(args, &st, &fixed)) == 0)
+		return 0;
+	if (!grep_compile(args[i], fixed, &st.pat))
+		return 0;
+	i++;
+	
+	char** files = args + i;
+	int file_count = 0;
+	while (files[file_count] != NULL)
+		file_count++;
+	
+	int selected = 0;
+	int error = 0;
+	
+	// once stages run on threads stdio locks every call, take it just once
+	flockfile(out);
+	for (int f = 0; (f == 0 || f < file_count) && !st.write_error; f++)
+	{
+		const char* name = file_count > 0 ? files[f] : "-";
+		int is_stdin = strcmp(name, "-") == 0;
+		int fd = is_stdin ? fileno(in) : open(name, O_RDONLY | O_CLOEXEC);
+		struct stat sb;
+		
+		// stdin may be an in-memory stream from another builtin, with no fd
+		memset(&sb, 0, sizeof(sb));
+		if ((!is_stdin && fd < 0) || (fd >= 0 && fstat(fd, &sb) < 0))
+		{
+			fprintf(stderr, "grep: %s: %s\n", name, strerror(errno));
+			error = 1;
+			continue;
+		}
+		if (S_ISDIR(sb.st_mode))
+		{
+			fprintf(stderr, "grep: %s: Is a directory\n", name);
+			error = 1;
+			if (!is_stdin)
+				close(fd);
+			continue;
+		}
+		
+		st.name = file_count > 1 ? (is_stdin ? "(standard input)" : name) : NULL;
+		st.line = 0;
+		st.selected = 0;
+		
+		char* map = MAP_FAILED;
+		if (S_ISREG(sb.st_mode) && sb.st_size > 0)
+			map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		
+		if (map != MAP_FAILED)
+		{
+			madvise(map, sb.st_size, MADV_SEQUENTIAL);
+			grep_scan(&st, map, sb.st_size);
+			munmap(map, sb.st_size);
+		}
+		else
+		{
+			// read whole lines a block at a time, carrying a partial line over. 
+			// Files in /proc say they're empty, so this reads even those
+			size_t cap = GREP_BLOCK_SIZE;
+			size_t len = 0;
+			char* buf = malloc(cap);
+			ssize_t n;
+			
+			while (!st.write_error)
+			{
+				if (cap - len < GREP_BLOCK_SIZE / 2)
+				{
+					cap *= 2;
+					buf = realloc(buf, cap);
+				}
+				n = stream_read(fd, in, buf + len, cap - len);
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n <= 0)
+					break;
+				len += n;
+				
+				char* last_nl = memrchr(buf, '\n', len);
+				if (last_nl != NULL)
+				{
+					size_t whole = last_nl + 1 - buf;
+					grep_scan(&st, buf, whole);
+					memmove(buf, buf + whole, len - whole);
+					len -= whole;
+				}
+			}
+			if (n < 0 && !st.write_error)
+			{
+				fprintf(stderr, "grep: %s: %s\n", name, strerror(errno));
+				error = 1;
+			}
+			if (len > 0)
+				grep_scan(&st, buf, len);
+			free(buf);
+		}
+		
+		if (st.count)
+		{
+			if (st.name != NULL)
+				fprintf(out, "%s:", st.name);
+			fprintf(out, "%ld\n", st.selected);
+		}
+		selected += (st.selected > 0);
+		if (!is_stdin)
+			close(fd);
+	}
+	
+	funlockfile(out);
+	free(st.pat.nodes);
+	free(st.pat.lit);
+	if (fflush(out) != 0 && !st.write_error)
+		st.write_error = errno ? errno : EIO;
+	
+	// a reader that went away is the normal end of grep | head, not worth a message
+	if (st.write_error && st.write_error != EPIPE)
+		fprintf(stderr, "grep: write error: %s\n", strerror(st.write_error));
+	last_status = error || st.write_error ? 2 : (selected ? 0 : 1);
+	return 1;
+}
+
+int grep_options(char** args, struct grep_state* st, int* fixed)
+{
+	int i = 1;
+	
+	for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++)
+	{
+		if (strcmp(args[i], "--") == 0)
+		{
+			i++;
+			break;
+		}
+		for (char* opt = args[i] + 1; *opt != '\0'; opt++)
+		{
+			if (*opt == 'c')
+				st->count = 1;
+			else if (*opt == 'v')
+				st->invert = 1;
+			else if (*opt == 'n')
+				st->number = 1;
+			else if (*opt == 'F')
+				*fixed = 1;
+			else
+				return 0;	// left to the real grep
+		}
+	}
+	
+	if (args[i] == NULL || strchr(args[i], '\n') != NULL)
+		return 0;
+	return i;
+}
+
+int grep_declines(char** args)
+{
+	struct grep_state st;
+	int fixed = 0;
+	int i;
+	
+	memset(&st, 0, sizeof(st));
+	if ((i = grep_options(args, &st, &fixed)) == 0 || !grep_compile(args[i], fixed, &st.pat))
+		return 1;
+	free(st.pat.nodes);
+	free(st.pat.lit);
+	return 0;
+}
+
+/*
+	Turns pattern into the nodes grep_match_line() runs, and picks out the 
+	text grep_scan() searches for: the whole pattern with -F or when it has
+	no special characters, otherwise the longest run of plain characters 
+	that every match has to contain. Returns 0 if the pattern uses a part of
+	regular expressions that isn't supported here.
+*/
+int grep_compile(const char* pattern, int fixed, struct grep_pattern* gp)
+{
+	size_t len = strlen(pattern);
+	const char* p = pattern;
+	
+	memset(gp, 0, sizeof(*gp));
+	gp->nodes = calloc(len + 1, sizeof(struct grep_node));
+	
+	if (fixed)
+	{
+		gp->fixed = 1;
+		gp->lit = strdup(pattern);
+		gp->lit_len = len;
+		return 1;
+	}
+	
+	if (*p == '^')
+	{
+		gp->bol = 1;
+		p++;
+	}
+	
+	while (*p != '\0')
+	{
+		struct grep_node* node = &gp->nodes[gp->count];
+		
+		if (*p == '$' && p[1] == '\0')
+		{
+			gp->eol = 1;
+			break;
+		}
+		if (*p == '*' && gp->count > 0)
+		{
+			gp->nodes[gp->count - 1].star = 1;
+			p++;
+			continue;
+		}
+		
+		if (*p == '.')
+		{
+			node->type = GREP_ANY;
+			p++;
+		}
+		else if (*p == '[')
+		{
+			int negate = 0;
+			p++;
+			if (*p == '^')
+			{
+				negate = 1;
+				p++;
+			}
+			
+			// a ] right at the start is part of the set
+			const char* start = p;
+			while (*p != '\0' && (*p != ']' || p == start))
+			{
+				if (*p == '[' && (p[1] == ':' || p[1] == '=' || p[1] == '.'))
+					goto unsupported;
+				
+				unsigned char lo = *p;
+				unsigned char hi = lo;
+				if (p[1] == '-' && p[2] != '\0' && p[2] != ']')
+				{
+					hi = p[2];
+					p += 2;
+				}
+				for (int c = lo; c <= hi; c++)
+					node->set[c / 8] |= 1 << (c % 8);
+				p++;
+			}
+			if (*p != ']')
+				goto unsupported;
+			p++;
+			
+			if (negate)
+			{
+				for (int b = 0; b < 32; b++)
+					node->set[b] = ~node->set[b];
+			}
+			node->type = GREP_SET;
+		}
+		else
+		{
+			if (*p == '\\')
+			{
+				// \( \{ \| \+ \< \w and friends are for the real grep
+				p++;
+				if (*p == '\0' || isalnum((unsigned char)*p) || strchr("(){}|+?<>`'", *p) != NULL)
+					goto unsupported;
+			}
+			node->type = GREP_CHAR;
+			node->ch = *p;
+			p++;
+		}
+		gp->count++;
+	}
+	
+	// find the longest run of plain characters that can't repeat or be skipped
+	size_t best = 0, best_len = 0;
+	for (int n = 0; n < gp->count; )
+	{
+		int end = n;
+		while (end < gp->count && gp->nodes[end].type == GREP_CHAR && !gp->nodes[end].star)
+			end++;
+		if ((size_t)(end - n) > best_len)
+		{
+			best = n;
+			best_len = end - n;
+		}
+		n = (end > n) ? end : n + 1;
+	}
+	
+	gp->lit = malloc(best_len + 1);
+	for (size_t n = 0; n < best_len; n++)
+		gp->lit[n] = gp->nodes[best + n].ch;
+	gp->lit[best_len] = '\0';
+	gp->lit_len = best_len;
+	
+	// nothing but plain characters is a fixed string
+	if (!gp->bol && !gp->eol && best_len == (size_t)gp->count)
+		gp->fixed = 1;
+	return 1;
+	
+unsupported:
+	free(gp->nodes);
+	gp->nodes = NULL;
+	return 0;
+}
+
+// Returns 1 if the nodes match the text at s, which runs up to the end of the line at e
+void grep_add_state(const struct grep_node* nodes, int count, unsigned char* set, int i)
+{
+	set[i] = 1;
+	while (i < count && nodes[i].star)
+		set[++i] = 1;
+}
+
+int grep_node_matches(const struct grep_node* node, char c)
+{
+	unsigned char u = c;
+	
+	if (node->type == GREP_ANY)
+		return 1;
+	if (node->type == GREP_CHAR)
+		return node->ch == c;
+	return (node->set[u / 8] >> (u % 8)) & 1;
+}
+
+/*
+	Runs the pattern over the line as the set of positions in it that the 
+	text so far can have reached, so each character is checked against 
+	each node at most once. Trying the stars one way and then backing up 
+	instead would take exponential time on a pattern like x.*a*a*a*a*y.
+*/
+int grep_match_line(const struct grep_pattern* gp, const char* s, const char* e)
+{
+	if (gp->fixed)
+		return gp->lit_len == 0 || memmem(s, e - s, gp->lit, gp->lit_len) != NULL;
+	
+	int count = gp->count;
+	unsigned char cur[count + 1];
+	unsigned char next[count + 1];
+	
+	memset(cur, 0, count + 1);
+	grep_add_state(gp->nodes, count, cur, 0);
+	for (const char* t = s; ; t++)
+	{
+		if (cur[count] && (!gp->eol || t == e))
+			return 1;
+		if (t == e)
+			return 0;
+		
+		int alive = 0;
+		memset(next, 0, count + 1);
+		for (int i = 0; i < count; i++)
+		{
+			if (cur[i] && grep_node_matches(&gp->nodes[i], *t))
+			{
+				grep_add_state(gp->nodes, count, next, gp->nodes[i].star ? i : i + 1);
+				alive = 1;
+			}
+		}
+		if (!gp->bol)
+			grep_add_state(gp->nodes, count, next, 0);	// a match can start at any character
+		else if (!alive)
+			return 0;
+		memcpy(cur, next, count + 1);
+	}
+}
+
+/*
+	Searches a buffer of whole lines (the last one may be missing its 
+	newline). Each round finds the next place the literal text shows up, 
+	checks the line around it, and skips every line before it in one go.
+*/
+void grep_scan(struct grep_state* st, const char* buf, size_t len)
+{
+	const char* p = buf;
+	const char* end = buf + len;
+	
+	while (p < end && !st->write_error)
+	{
+		const char* line = p;
+		if (st->pat.lit_len > 0)
+		{
+			const char* hit = grep_find(p, end - p, st->pat.lit, st->pat.lit_len);
+			if (hit == NULL)
+			{
+				grep_skip(st, p, end);
+				return;
+			}
+			line = memrchr(p, '\n', hit - p);
+			line = line ? line + 1 : p;
+			grep_skip(st, p, line);
+		}
+		
+		const char* line_end = memchr(line, '\n', end - line);
+		if (line_end == NULL)
+			line_end = end;
+		
+		// a fixed string was already found on the line
+		int match = (st->pat.fixed && st->pat.lit_len > 0) || grep_match_line(&st->pat, line, line_end);
+		st->line++;
+		if (match != st->invert)
+			grep_emit(st, line, line_end);
+		p = line_end + 1;
+	}
+}
+
+void grep_skip(struct grep_state* st, const char* s, const char* e)
+{
+	if (!st->invert)
+	{
+		// nothing is printed from here, only the line numbers move on
+		if (st->number)
+			st->line += grep_count_newlines(s, e - s);
+		return;
+	}
+	
+	while (s < e && !st->write_error)
+	{
+		const char* line_end = memchr(s, '\n', e - s);
+		if (line_end == NULL)
+			line_end = e;
+		st->line++;
+		grep_emit(st, s, line_end);
+		s = line_end + 1;
+	}
+}
+
+void grep_emit(struct grep_state* st, const char* s, const char* e)
+{
+	st->selected++;
+	if (st->count)
+		return;
+	
+	if (st->name != NULL)
+		fprintf(st->out, "%s:", st->name);
+	if (st->number)
+		fprintf(st->out, "%ld:", st->line);
+	// grep_builtin() holds the lock on out
+	fwrite_unlocked(s, 1, e - s, st->out);
+	fputc_unlocked('\n', st->out);
+	if (ferror_unlocked(st->out))
+		st->write_error = errno ? errno : EIO;
+}
+
+/*
+	The vector kernels. The search compares 16 or 32 positions at once 
+	against the first and the last character of the text, and only the 
+	positions where both agree (usually very few) get a memcmp(). Counting 
+	newlines compares a block against '\n' and adds up the bits of the mask.
+	AVX2 is used when the CPU has it, SSE2 is always there on x86-64, and 
+	other machines use memmem() and memchr().
+*/
+#if defined(__x86_64__)
+
+__attribute__((target("avx2")))
+const char* grep_find_avx2(const char* s, size_t n, const char* lit, size_t m)
+{
+	const __m256i first = _mm256_set1_epi8(lit[0]);
+	const __m256i last = _mm256_set1_epi8(lit[m - 1]);
+	size_t i = 0;
+	
+	for (; i + m - 1 + 32 <= n; i += 32)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i*)(s + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(s + i + m - 1));
+		unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), 
+															  _mm256_cmpeq_epi8(b, last)));
+		while (mask != 0)
+		{
+			int bit = __builtin_ctz(mask);
+			if (memcmp(s + i + bit + 1, lit + 1, m - 2) == 0)
+				return s + i + bit;
+			mask &= mask - 1;
+		}
+	}
+	return memmem(s + i, n - i, lit, m);
+}
+
+const char* grep_find_sse2(const char* s, size_t n, const char* lit, size_t m)
+{
+	const __m128i first = _mm_set1_epi8(lit[0]);
+	const __m128i last = _mm_set1_epi8(lit[m - 1]);
+	size_t i = 0;
+	
+	for (; i + m - 1 + 16 <= n; i += 16)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i*)(s + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(s + i + m - 1));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), 
+														_mm_cmpeq_epi8(b, last)));
+		while (mask != 0)
+		{
+			int bit = __builtin_ctz(mask);
+			if (memcmp(s + i + bit + 1, lit + 1, m - 2) == 0)
+				return s + i + bit;
+			mask &= mask - 1;
+		}
+	}
+	return memmem(s + i, n - i, lit, m);
+}
+
+__attribute__((target("avx2,popcnt")))
+long grep_count_avx2(const char* s, size_t n)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	long count = 0;
+	size_t i = 0;
+	
+	for (; i + 32 <= n; i += 32)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i*)(s + i));
+		count += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, nl)));
+	}
+	for (; i < n; i++)
+		count += (s[i] == '\n');
+	return count;
+}
+
+long grep_count_sse2(const char* s, size_t n)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	long count = 0;
+	size_t i = 0;
+	
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i*)(s + i));
+		count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(a, nl)));
+	}
+	for (; i < n; i++)
+		count += (s[i] == '\n');
+	return count;
+}
+
+#endif
+
+const char* grep_find(const char* s, size_t n, const char* lit, size_t m)
+{
+	if (m == 1)
+		return memchr(s, lit[0], n);
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("avx2"))
+		return grep_find_avx2(s, n, lit, m);
+	return grep_find_sse2(s, n, lit, m);
+#else
+	return memmem(s, n, lit, m);
+#endif
+}
+
+long grep_count_newlines(const char* s, size_t n)
+{
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("avx2"))
+		return grep_count_avx2(s, n);
+	return grep_count_sse2(s, n);
+#else
+	long count = 0;
+	const char* end = s + n;
+	while ((s = memchr(s, '\n', end - s)) != NULL)
+	{
+		count++;
+		s++;
+	}
+	return count;
+#endif
+}
+
+void add_to_history(const char *cmd) 
+{
+	// the entry comes back into history through the log, in log order
+	if (shared_history != NULL && append_shared_history(cmd))
+	{
+		sync_shared_history();
+		return;
+	}
+	add_local_history(cmd);
+}
+
+void add_local_history(const char *cmd) 
+{
+    // Check if history is full, if so, remove the oldest command
+    if (history_count == HISTORY_SIZE) 
+	{
+		free(history[0]);
+        for (int i = 1; i < HISTORY_SIZE; i++) 
 		{
-            waitpid(pid, NULL, 0);
+            history[i - 1] = history[i];
         }
+        history_count--;
+    }
+    history[history_count] = strdup(cmd);
+    history_count++;
+	history_index = history_count;
+}
 
-        return; 
-    } 
-} 
+/*
+	Shared history, turned on by pointing $SHELL_HISTORY_FILE at a file. 
+	Every shell using the same file maps it MAP_SHARED, so they all see the 
+	same memory and never need to lock it or read it again.
+	
+	The file is a log that is only ever appended to. A shell claims room for
+	an entry by writing its length, marked pending, into the zero word at 
+	tail with a compare-and-swap, and then moves tail past it. Whoever 
+	loses the race for that word moves tail past the winner's entry before 
+	trying again, so tail gets there even if the winner dies in between. 
+	The winner writes the text and then stores the plain length, with 
+	release ordering. A reader that finds a pending entry stops there until
+	the next sync. Because the length is known from the moment the room is 
+	claimed, an entry left pending for SHARED_HISTORY_STALL_MS by a shell 
+	that died halfway is skipped instead of holding every reader up 
+	forever. Writing an entry costs its size and nothing more, and a sync 
+	only looks at what came after the last one. A fresh file is all zeros, 
+	which is already an empty log.
+*/
+int open_shared_history(const char* path)
+{
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	struct stat st;
+	
+	if (fd < 0 || fstat(fd, &st) < 0)
+	{
+		perror("shared history");
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	
+	// grow it to the full size, the unused part stays a hole in the file
+	if (st.st_size < SHARED_HISTORY_SIZE && ftruncate(fd, SHARED_HISTORY_SIZE) < 0)
+	{
+		perror("shared history");
+		close(fd);
+		return -1;
+	}
+	
+	void* map = mmap(NULL, SHARED_HISTORY_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		perror("shared history");
+		return -1;
+	}
+	
+	struct shared_history* log = map;
+	unsigned long long magic = 0;
+	if (!__atomic_compare_exchange_n(&log->magic, &magic, SHARED_HISTORY_MAGIC, 0, 
+									 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) && 
+		magic != SHARED_HISTORY_MAGIC)
+	{
+		fprintf(stderr, "shared history: %s is not a history file\n", path);
+		munmap(map, SHARED_HISTORY_SIZE);
+		return -1;
+	}
+	
+	shared_history = log;
+	shared_history_cap = SHARED_HISTORY_SIZE - sizeof(struct shared_history);
+	shared_history_pos = 0;
+	sync_shared_history();
+	return 0;
+}
+
+int append_shared_history(const char* cmd)
+{
+	size_t len = strlen(cmd);
+	unsigned long long size = (sizeof(unsigned int) + len + 7) & ~7ULL;
+	
+	if (len == 0 || len > MAX_SHARED_ENTRY)
+		return 0;
+	
+	char* entry;
+	while (1)
+	{
+		unsigned long long pos = __atomic_load_n(&shared_history->tail, __ATOMIC_ACQUIRE);
+		if (pos + size > shared_history_cap)
+			return 0;	// the log is full, the entry stays in this shell only
+		
+		entry = shared_history->entries + pos;
+		unsigned int claimed = 0;
+		if (__atomic_compare_exchange_n((unsigned int*)entry, &claimed, (unsigned int)len | SHARED_ENTRY_PENDING,
+										0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			__atomic_compare_exchange_n(&shared_history->tail, &pos, pos + size, 0, 
+										__ATOMIC_RELEASE, __ATOMIC_RELAXED);
+			break;
+		}
+		
+		// another shell has this spot, finish moving tail past it for them
+		unsigned long long other = (sizeof(unsigned int) + (claimed & ~SHARED_ENTRY_PENDING) + 7) & ~7ULL;
+		__atomic_compare_exchange_n(&shared_history->tail, &pos, pos + other, 0, 
+									__ATOMIC_RELEASE, __ATOMIC_RELAXED);
+	}
+	
+	memcpy(entry + sizeof(unsigned int), cmd, len);
+	__atomic_store_n((unsigned int*)entry, (unsigned int)len, __ATOMIC_RELEASE);
+	return 1;
+}
+
+void sync_shared_history()
+{
+	if (shared_history == NULL)
+		return;
+	
+	unsigned long long tail = __atomic_load_n(&shared_history->tail, __ATOMIC_ACQUIRE);
+	if (tail > shared_history_cap)
+		tail = shared_history_cap;
+	
+	while (shared_history_pos + sizeof(unsigned int) <= tail)
+	{
+		char* entry = shared_history->entries + shared_history_pos;
+		unsigned int len = __atomic_load_n((unsigned int*)entry, __ATOMIC_ACQUIRE);
+		if (len == 0)
+			break;
+		
+		if (len & SHARED_ENTRY_PENDING)
+		{
+			// still being written, unless its writer died and it never will be
+			len &= ~SHARED_ENTRY_PENDING;
+			if (shared_history_stall_pos != shared_history_pos || shared_history_stall_since == 0)
+			{
+				shared_history_stall_pos = shared_history_pos;
+				shared_history_stall_since = monotonic_ms();
+				break;
+			}
+			if (monotonic_ms() - shared_history_stall_since < SHARED_HISTORY_STALL_MS)
+				break;
+			shared_history_stall_since = 0;
+		}
+		else
+		{
+			char* cmd = strndup(entry + sizeof(unsigned int), len);
+			add_local_history(cmd);
+			free(cmd);
+		}
+		shared_history_pos += (sizeof(unsigned int) + len + 7) & ~7ULL;
+	}
+}
+
+/*
+	Turned on by setting $SHELL_WARM to a number N. Right after startup, a 
+	detached thread counts the first words of the commands in the history, 
+	finds the N most used ones on PATH, and asks the kernel to read them and
+	the shared libraries they load (their DT_NEEDED entries, followed down)
+	into the page cache, so their first run after a cold boot doesn't wait 
+	on the disk. The thread has an idle I/O priority and nice 19, and the 
+	prompt doesn't wait for it. Only the history from $SHELL_HISTORY_FILE 
+	is there at startup, so without it there is nothing to warm.
+*/
+void start_warming()
+{
+	const char* top = getenv("SHELL_WARM");
+	if (top == NULL || atoi(top) <= 0 || history_count == 0)
+		return;
+	
+	struct warm_job* job = malloc(sizeof(struct warm_job));
+	job->lines = malloc(history_count * sizeof(char*));
+	job->count = history_count;
+	job->top = atoi(top);
+	job->path = strdup(getenv("PATH") ? getenv("PATH") : "/usr/bin:/bin");
+	for (int i = 0; i < history_count; i++)
+		job->lines[i] = strdup(history[i]);
+	
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, warm_thread, job) != 0)
+	{
+		for (int i = 0; i < job->count; i++)
+			free(job->lines[i]);
+		free(job->lines);
+		free(job->path);
+		free(job);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+void* warm_thread(void* arg)
+{
+	struct warm_job* job = arg;
+	struct exec_attrs background = { ATTR_NICE | ATTR_IOPRIO, { { 0 } }, 19, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT };
+	char* names[job->count];
+	int uses[job->count];
+	int distinct = 0;
+	
+	apply_exec_attrs(&background);
+	
+	// count the commands by their first word
+	for (int i = 0; i < job->count; i++)
+	{
+		char* line = job->lines[i];
+		line += strspn(line, " \t");
+		line[strcspn(line, " \t|;&<>()")] = '\0';
+		if (*line == '\0' || *line == '@' || strchr(line, '=') != NULL)
+			continue;
+		
+		int builtin = 0;
+		for (size_t b = 0; b < sizeof(builtin_list) / sizeof(builtin_list[0]); b++)
+			builtin |= strcmp(line, builtin_list[b]) == 0;
+		if (builtin)
+			continue;
+		
+		int n = 0;
+		while (n < distinct && strcmp(names[n], line) != 0)
+			n++;
+		if (n == distinct)
+		{
+			names[distinct] = line;
+			uses[distinct++] = 0;
+		}
+		uses[n]++;
+	}
+	
+	// the top ones, most used first
+	char* files[MAX_WARM_FILES];
+	int count = 0;
+	for (int t = 0; t < job->top && t < distinct; t++)
+	{
+		int best = t;
+		for (int n = t + 1; n < distinct; n++)
+		{
+			if (uses[n] > uses[best])
+				best = n;
+		}
+		char* name = names[best];
+		int used = uses[best];
+		names[best] = names[t];
+		uses[best] = uses[t];
+		names[t] = name;
+		uses[t] = used;
+		
+		char* file = find_on_path(name, job->path, X_OK);
+		if (file != NULL)
+		{
+			warm_add(files, &count, file);
+			free(file);
+		}
+	}
+	
+	// files grows as the libraries are found, so this reaches all of them
+	for (int i = 0; i < count; i++)
+		warm_file(files[i], files, &count);
+	
+	for (int i = 0; i < count; i++)
+		free(files[i]);
+	for (int i = 0; i < job->count; i++)
+		free(job->lines[i]);
+	free(job->lines);
+	free(job->path);
+	free(job);
+	return NULL;
+}
+
+char* find_on_path(const char* name, const char* path, int mode)
+{
+	if (strchr(name, '/') != NULL)
+		return access(name, mode) == 0 ? strdup(name) : NULL;
+	
+	const char* dir = path;
+	while (1)
+	{
+		size_t len = strcspn(dir, ":");
+		char file[len + strlen(name) + 3];
+		snprintf(file, sizeof(file), "%.*s/%s", (int)(len ? len : 1), len ? dir : ".", name);
+		
+		struct stat st;
+		if (stat(file, &st) == 0 && S_ISREG(st.st_mode) && access(file, mode) == 0)
+			return strdup(file);
+		if (dir[len] == '\0')
+			return NULL;
+		dir += len + 1;
+	}
+}
+
+void warm_file(const char* file, char** files, int* count)
+{
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	
+	if (fd < 0)
+		return;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(Elf64_Ehdr))
+	{
+		close(fd);
+		return;
+	}
+	
+	if (readahead(fd, 0, st.st_size) < 0)
+		posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+	
+	// the headers are read in anyway, mapping them finds the libraries without copying
+	unsigned char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return;
+	
+	Elf64_Ehdr* eh = (Elf64_Ehdr*)map;
+	if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 || eh->e_ident[EI_CLASS] != ELFCLASS64 || 
+		eh->e_phoff + (size_t)eh->e_phnum * sizeof(Elf64_Phdr) > (size_t)st.st_size)
+	{
+		munmap(map, st.st_size);
+		return;
+	}
+	
+	Elf64_Phdr* ph = (Elf64_Phdr*)(map + eh->e_phoff);
+	Elf64_Dyn* dyn = NULL;
+	size_t dyn_count = 0;
+	for (int i = 0; i < eh->e_phnum; i++)
+	{
+		if (ph[i].p_type == PT_DYNAMIC && ph[i].p_offset + ph[i].p_filesz <= (size_t)st.st_size)
+		{
+			dyn = (Elf64_Dyn*)(map + ph[i].p_offset);
+			dyn_count = ph[i].p_filesz / sizeof(Elf64_Dyn);
+		}
+		else if (ph[i].p_type == PT_INTERP && ph[i].p_offset + ph[i].p_filesz <= (size_t)st.st_size)
+		{
+			char* interp = strndup((char*)map + ph[i].p_offset, ph[i].p_filesz);
+			warm_add(files, count, interp);
+			free(interp);
+		}
+	}
+	
+	// DT_STRTAB is an address, the PT_LOAD that holds it says where that is in the file
+	size_t strtab = 0;
+	for (size_t d = 0; d < dyn_count && dyn[d].d_tag != DT_NULL; d++)
+	{
+		if (dyn[d].d_tag != DT_STRTAB)
+			continue;
+		for (int i = 0; i < eh->e_phnum; i++)
+		{
+			if (ph[i].p_type == PT_LOAD && dyn[d].d_un.d_ptr >= ph[i].p_vaddr && 
+				dyn[d].d_un.d_ptr < ph[i].p_vaddr + ph[i].p_filesz)
+				strtab = dyn[d].d_un.d_ptr - ph[i].p_vaddr + ph[i].p_offset;
+		}
+	}
+	
+	const char* lib_dirs = getenv("LD_LIBRARY_PATH");
+	char search[4096];
+	snprintf(search, sizeof(search), "%s%s/lib64:/usr/lib64:/lib/x86_64-linux-gnu:/usr/lib/x86_64-linux-gnu:"
+			 "/lib/aarch64-linux-gnu:/usr/lib/aarch64-linux-gnu:/lib:/usr/lib", 
+			 lib_dirs ? lib_dirs : "", lib_dirs ? ":" : "");
+	
+	for (size_t d = 0; strtab != 0 && d < dyn_count && dyn[d].d_tag != DT_NULL; d++)
+	{
+		if (dyn[d].d_tag != DT_NEEDED || strtab + dyn[d].d_un.d_val >= (size_t)st.st_size)
+			continue;
+		
+		const char* needed = (char*)map + strtab + dyn[d].d_un.d_val;
+		if (strnlen(needed, st.st_size - strtab - dyn[d].d_un.d_val) == st.st_size - strtab - dyn[d].d_un.d_val)
+			continue;
+		
+		char* lib = find_on_path(needed, search, R_OK);
+		if (lib != NULL)
+		{
+			warm_add(files, count, lib);
+			free(lib);
+		}
+	}
+	munmap(map, st.st_size);
+}
+
+int warm_add(char** files, int* count, const char* file)
+{
+	char* real = realpath(file, NULL);
+	if (real == NULL)
+		return 0;
+	
+	for (int i = 0; i < *count; i++)
+	{
+		if (strcmp(files[i], real) == 0)
+		{
+			free(real);
+			return 0;
+		}
+	}
+	if (*count == MAX_WARM_FILES)
+	{
+		free(real);
+		return 0;
+	}
+	files[(*count)++] = real;
+	return 1;
+}
+
+/*
+	Splits the line into words on blanks. Quoted text, $(...) and `...` are 
+	kept whole even when they contain spaces, so the words still hold their 
+	quotes here and expand_word() deals with them afterwards.
+*/
+int tokenize_str(char* str, char** words) 
+{ 	
+	int count = 0;
+	char* p = str;
+	
+    while (count < MAX_TOKENS - 1)
+    { 
+		// skip the blanks between words
+		while (*p == ' ' || *p == '\t' || *p == '\n')
+			p++;
+		
+		if (*p == '\0')
+			break;
+		
+		words[count++] = p;
+		while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\n')
+			p = skip_word_part(p);
+		
+		if (*p != '\0')
+			*p++ = '\0';
+    } 
+	words[count] = NULL;
+	return count;
+} 
+
+char* skip_word_part(char* p)
+{
+	char* end = NULL;
+	
+	if (*p == '\\' && p[1] != '\0')
+		return p + 2;
+	
+	if (*p == '\'')
+	{
+		end = strchr(p + 1, '\'');
+	}
+	else if (*p == '`')
+	{
+		end = find_backtick_end(p);
+	}
+	else if (*p == '"')
+	{
+		// a substitution inside the quotes can have quotes of its own
+		end = p + 1;
+		while (end != NULL && *end != '\0' && *end != '"')
+		{
+			if (*end == '\\' && end[1] != '\0')
+				end += 2;
+			else if (*end == '$' && end[1] == '(')
+				end = (end = find_subst_end(end + 2)) ? end + 1 : NULL;
+			else if (*end == '`')
+				end = (end = find_backtick_end(end)) ? end + 1 : NULL;
+			else
+				end++;
+		}
+	}
+	else if (*p == '$' && p[1] == '(')
+	{
+		end = find_subst_end(p + 2);
+	}
+	else
+	{
+		return p + 1;
+	}
+	
+	// an unterminated quote or substitution runs to the end of the line
+	if (end == NULL || *end == '\0')
+		return p + strlen(p);
+	return end + 1;
+}
+
+char* find_backtick_end(char* p)
+{
+	for (p++; *p != '\0' && *p != '`'; p++)
+	{
+		if (*p == '\\' && p[1] != '\0')
+			p++;
+	}
+	return *p == '`' ? p : NULL;
+}
+
+char* find_subst_end(char* p)
+{
+	int depth = 1;
+	
+	while (*p != '\0')
+	{
+		if (*p == '(')
+		{
+			depth++;
+		}
+		else if (*p == ')')
+		{
+			if (--depth == 0)
+				return p;
+		}
+		else if (*p != '$' || p[1] != '(')
+		{
+			// quotes and escapes can hide a ')', so step over them whole
+			p = skip_word_part(p);
+			continue;
+		}
+		p++;
+	}
+	return NULL;
+}
+
+void sb_append(struct strbuf* sb, const char* str, size_t n)
+{
+	if (sb->len + n + 1 > sb->cap)
+	{
+		size_t cap = sb->cap ? sb->cap : 64;
+		while (sb->len + n + 1 > cap)
+			cap *= 2;
+		sb->data = realloc(sb->data, cap);
+		sb->cap = cap;
+	}
+	memcpy(sb->data + sb->len, str, n);
+	sb->len += n;
+	sb->data[sb->len] = '\0';
+}
+
+void sb_read_fd(struct strbuf* sb, int fd)
+{
+	ssize_t n;
+	while ((n = sb_read_once(sb, fd)) > 0 || (n < 0 && errno == EINTR))
+		;
+}
+
+ssize_t sb_read_once(struct strbuf* sb, int fd)
+{
+	// keep at least 4K of room so big outputs take few reads
+	if (sb->cap - sb->len < 4096)
+	{
+		size_t cap = sb->cap < 4096 ? 8192 : sb->cap * 2;
+		sb->data = realloc(sb->data, cap);
+		sb->cap = cap;
+	}
+	
+	ssize_t n = read(fd, sb->data + sb->len, sb->cap - sb->len - 1);
+	if (n > 0)
+	{
+		sb->len += n;
+		sb->data[sb->len] = '\0';
+	}
+	return n;
+}
+
+void sb_read_stream(struct strbuf* sb, FILE* in)
+{
+	char buf[8192];
+	ssize_t n;
+	
+	if (fileno(in) >= 0)
+	{
+		sb_read_fd(sb, fileno(in));
+		return;
+	}
+	while ((n = stream_read(-1, in, buf, sizeof(buf))) > 0)
+		sb_append(sb, buf, n);
+}
+
+ssize_t stream_read(int fd, FILE* in, char* buf, size_t n)
+{
+	if (fd >= 0)
+		return read(fd, buf, n);
+	
+	size_t got = fread(buf, 1, n, in);
+	if (got == 0 && ferror(in))
+		return -1;
+	return got;
+}
+
+void field_add(struct field_builder* fb, const char* str, size_t n, int quoted)
+{
+	for (size_t i = 0; i < n; i++)
+	{
+		// quoted glob characters are escaped so they only match themselves
+		if (quoted && strchr("*?[\\", str[i]) != NULL)
+			sb_append(&fb->pattern, "\\", 1);
+		else if (!quoted && strchr("*?[", str[i]) != NULL)
+			fb->has_glob = 1;
+		sb_append(&fb->pattern, str + i, 1);
+	}
+	sb_append(&fb->text, str, n);
+	fb->exists = 1;
+}
+
+void field_finish(struct field_builder* fb, char** fields, int* count, int max)
+{
+	if (fb->exists)
+	{
+		int matches = 0;
+		if (fb->has_glob)
+			matches = expand_glob(fb->pattern.data, fields + *count, max - *count);
+		
+		// the matches are malloc'd, they move into the arena with the other fields
+		for (int i = *count; fb->arena != NULL && i < *count + matches; i++)
+		{
+			char* match = fields[i];
+			fields[i] = arena_strdup(fb->arena, match);
+			free(match);
+		}
+		
+		// a pattern that matches nothing is left as it is
+		if (matches == 0 && *count < max)
+			fields[(*count)++] = fb->arena ? arena_strdup(fb->arena, fb->text.data) : strdup(fb->text.data);
+		*count += matches;
+	}
+	
+	fb->text.len = 0;
+	fb->text.data[0] = '\0';
+	fb->pattern.len = 0;
+	fb->pattern.data[0] = '\0';
+	fb->exists = 0;
+	fb->has_glob = 0;
+}
+
+/*
+	Expands a single word from tokenize_str() into fields. Quotes are removed, 
+	backslashes escape the next character and every $(...) or `...` is replaced
+	by the output of the command inside it, minus any trailing newlines. 
+	Outside of double quotes that output is split on blanks into separate 
+	fields, inside them it stays part of one field. Finally, a field with an 
+	unquoted * ? or [ is replaced by the matching file names. Parameters 
+	($NAME, ${NAME}, $1, $#, $@ and $*) are split the same way as command 
+	output. The fields go in the arena, or are malloc'd without one.
+*/
+int expand_word(struct arena* arena, const char* word, char** fields, int max, int whole)
+{
+	struct field_builder fb = { { NULL, 0, 0 }, { NULL, 0, 0 }, 0, 0, arena };
+	int count = 0;
+	int in_quotes = 0;		// inside "..."
+	int literal = whole;	// no splitting or globbing, inside "..." or in an assignment
+	const char* p = word;
+	const char* param;
+	
+	// "$@" with no arguments is no field at all, not an empty one
+	if (strcmp(word, "\"$@\"") == 0 && (call_stack ? call_stack->argc : shell_argc) <= 1)
+		return 0;
+	
+	sb_append(&fb.text, "", 0);
+	sb_append(&fb.pattern, "", 0);
+	while (*p != '\0')
+	{
+		if (*p == '\'' && !in_quotes)
+		{
+			const char* end = strchr(p + 1, '\'');
+			size_t n = end ? (size_t)(end - p - 1) : strlen(p + 1);
+			field_add(&fb, p + 1, n, 1);
+			fb.exists = 1;
+			p += n + (end ? 2 : 1);
+		}
+		else if (*p == '"')
+		{
+			in_quotes = !in_quotes;
+			literal = in_quotes || whole;
+			fb.exists = 1;
+			p++;
+		}
+		else if (*p == '\\' && p[1] != '\0')
+		{
+			// inside double quotes a backslash only escapes $ ` " and itself
+			if (in_quotes && strchr("$`\"\\", p[1]) == NULL)
+				field_add(&fb, p, 1, 1);
+			field_add(&fb, p + 1, 1, 1);
+			p += 2;
+		}
+		else if (*p == '$' && (param = param_end(p)) != NULL)
+		{
+			expand_param(p, param, &fb, fields, &count, max, literal);
+			p = param;
+		}
+		else if ((*p == '$' && p[1] == '(') || *p == '`')
+		{
+			// pull out the command inside the substitution
+			char* cmd;
+			if (*p == '`')
+			{
+				const char* end = p + 1;
+				struct strbuf inner = { NULL, 0, 0 };
+				sb_append(&inner, "", 0);
+				while (*end != '\0' && *end != '`')
+				{
+					if (*end == '\\' && strchr("$`\\", end[1]) != NULL)
+						end++;
+					sb_append(&inner, end, 1);
+					end++;
+				}
+				cmd = inner.data;
+				p = (*end == '`') ? end + 1 : end;
+			}
+			else
+			{
+				char* end = find_subst_end((char*)p + 2);
+				size_t n = end ? (size_t)(end - p - 2) : strlen(p + 2);
+				cmd = strndup(p + 2, n);
+				p += n + (end ? 3 : 2);
+			}
+			
+			struct strbuf output = { NULL, 0, 0 };
+			sb_append(&output, "", 0);
+			capture_output(cmd, &output);
+			free(cmd);
+			
+			while (output.len > 0 && output.data[output.len - 1] == '\n')
+				output.data[--output.len] = '\0';
+			
+			if (literal)
+			{
+				field_add(&fb, output.data, output.len, 1);
+			}
+			else
+			{
+				field_add_split(&fb, fields, &count, max, output.data, output.len);
+			}
+			free(output.data);
+		}
+		else
+		{
+			field_add(&fb, p, 1, literal);
+			p++;
+		}
+	}
+	
+	field_finish(&fb, fields, &count, max);
+	free(fb.text.data);
+	free(fb.pattern.data);
+	return count;
+}
+
+void field_add_split(struct field_builder* fb, char** fields, int* count, int max, 
+					 const char* str, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+	{
+		if (str[i] == ' ' || str[i] == '\t' || str[i] == '\n')
+			field_finish(fb, fields, count, max);
+		else
+			field_add(fb, str + i, 1, 0);
+	}
+}
+
+const char* param_end(const char* p)
+{
+	const char* q = p + 1;
+	
+	if (strchr("0123456789#@*?", *q) != NULL && *q != '\0')
+		return q + 1;
+	if (*q == '{')
+	{
+		const char* close = strchr(q, '}');
+		if (close == NULL || close == q + 1)
+			return NULL;
+		for (const char* c = q + 1; c < close; c++)
+		{
+			if (!isalnum((unsigned char)*c) && *c != '_')
+				return NULL;
+		}
+		return close + 1;
+	}
+	if (!isalpha((unsigned char)*q) && *q != '_')
+		return NULL;
+	while (isalnum((unsigned char)*q) || *q == '_')
+		q++;
+	return q;
+}
+
+/*
+	Expands one parameter. $@ in double quotes makes a field per argument,
+	$* joins them with spaces. Outside of quotes every value is split on 
+	blanks and can hold glob characters. An unset variable or a missing 
+	argument is just empty.
+*/
+void expand_param(const char* p, const char* end, struct field_builder* fb, 
+				  char** fields, int* count, int max, int quoted)
+{
+	// the name without the $ and braces
+	int braced = p[1] == '{';
+	size_t len = end - p - 1 - 2 * braced;
+	char name[len + 1];
+	memcpy(name, p + 1 + braced, len);
+	name[len] = '\0';
+	
+	char** argv = call_stack ? call_stack->argv : shell_args;
+	int argc = call_stack ? call_stack->argc : shell_argc;
+	char number[16];
+	const char* value = NULL;
+	
+	if (strcmp(name, "@") == 0 || strcmp(name, "*") == 0)
+	{
+		for (int i = 1; i < argc; i++)
+		{
+			if (quoted && name[0] == '@')
+			{
+				if (i > 1)
+					field_finish(fb, fields, count, max);
+				field_add(fb, argv[i], strlen(argv[i]), 1);
+				fb->exists = 1;
+			}
+			else if (quoted)
+			{
+				if (i > 1)
+					field_add(fb, " ", 1, 1);
+				field_add(fb, argv[i], strlen(argv[i]), 1);
+			}
+			else
+			{
+				// text before $@ joins the first argument, fields only break between them
+				if (i > 1)
+					field_finish(fb, fields, count, max);
+				field_add_split(fb, fields, count, max, argv[i], strlen(argv[i]));
+			}
+		}
+		return;
+	}
+	
+	if (strcmp(name, "#") == 0)
+	{
+		snprintf(number, sizeof(number), "%d", argc > 0 ? argc - 1 : 0);
+		value = number;
+	}
+	else if (strcmp(name, "?") == 0)
+	{
+		snprintf(number, sizeof(number), "%d", last_status);
+		value = number;
+	}
+	else if (isdigit((unsigned char)name[0]))
+	{
+		int n = atoi(name);
+		if (n == 0)
+			value = argv ? argv[0] : shell_name;
+		else if (n < argc)
+			value = argv[n];
+	}
+	else
+	{
+		value = get_var(name);
+	}
+	
+	if (value == NULL)
+		return;
+	if (quoted)
+		field_add(fb, value, strlen(value), 1);
+	else
+		field_add_split(fb, fields, count, max, value, strlen(value));
+}
+
+/*
+	Compiles one path component of a glob pattern. Backslash-escaped 
+	characters become plain literals and a '[' without a closing ']' is just
+	a '[' too. Returns the number of ops written.
+*/
+int glob_compile(const char* pat, struct glob_op* ops, int max)
+{
+	int n = 0;
+	
+	while (*pat != '\0' && n < max)
+	{
+		struct glob_op* op = &ops[n];
+		memset(op, 0, sizeof(*op));
+		
+		if (*pat == '\\' && pat[1] != '\0')
+		{
+			op->type = 'c';
+			op->c = pat[1];
+			pat += 2;
+		}
+		else if (*pat == '*')
+		{
+			// runs of stars act like a single one
+			while (*pat == '*')
+				pat++;
+			op->type = '*';
+		}
+		else if (*pat == '?')
+		{
+			op->type = '?';
+			pat++;
+		}
+		else if (*pat == '[' && pat[1] != '\0' && strchr(pat + 2, ']') != NULL)
+		{
+			const char* p = pat + 1;
+			int negate = (*p == '!' || *p == '^');
+			if (negate)
+				p++;
+			
+			// a ']' right after the '[' is part of the set
+			int first = 1;
+			while (*p != '\0' && (*p != ']' || first))
+			{
+				unsigned char lo = *p;
+				unsigned char hi = lo;
+				if (p[1] == '-' && p[2] != '\0' && p[2] != ']')
+				{
+					hi = p[2];
+					p += 2;
+				}
+				for (int c = lo; c <= hi; c++)
+					op->set[c / 8] |= 1 << (c % 8);
+				p++;
+				first = 0;
+			}
+			
+			if (negate)
+			{
+				for (int i = 0; i < 32; i++)
+					op->set[i] = ~op->set[i];
+			}
+			op->type = '[';
+			pat = (*p == ']') ? p + 1 : p;
+		}
+		else
+		{
+			op->type = 'c';
+			op->c = *pat;
+			pat++;
+		}
+		n++;
+	}
+	return n;
+}
+
+/*
+	Matches a name against compiled ops. On a mismatch it backs up to just 
+	after the last '*' and lets that star take one more character, so no 
+	recursion is needed and the usual one-star patterns are linear.
+*/
+int glob_match(const struct glob_op* ops, int n, const char* name)
+{
+	int p = 0;
+	int star = -1;
+	const char* star_name = NULL;
+	
+	while (*name != '\0')
+	{
+		unsigned char c = *name;
+		if (p < n && ops[p].type == '*')
+		{
+			star = p++;
+			star_name = name;
+		}
+		else if (p < n && (ops[p].type == '?' || 
+				 (ops[p].type == 'c' && ops[p].c == c) || 
+				 (ops[p].type == '[' && (ops[p].set[c / 8] & (1 << (c % 8))))))
+		{
+			p++;
+			name++;
+		}
+		else if (star >= 0)
+		{
+			p = star + 1;
+			name = ++star_name;
+		}
+		else
+		{
+			return 0;
+		}
+	}
+	
+	while (p < n && ops[p].type == '*')
+		p++;
+	return p == n;
+}
+
+int has_glob_chars(const char* pat)
+{
+	for (const char* p = pat; *p != '\0'; p++)
+	{
+		if (*p == '\\' && p[1] != '\0')
+			p++;
+		else if (*p == '*' || *p == '?' || *p == '[')
+			return 1;
+	}
+	return 0;
+}
+
+/*
+	Returns the entries of a directory, from the cache when they are still 
+	good. Directories are found by device and inode rather than by path, so 
+	cd can't mix them up, and a listing is only reused while the directory's 
+	mtime is unchanged, since any create, delete or rename updates it. A 
+	directory modified within a second of being read is marked racy and read
+	again by every glob, because a second change in the same clock tick could 
+	leave the mtime as it was. A listing already checked during the current 
+	glob is returned as it is, so the walk never frees one it is still using.
+*/
+struct dir_listing* get_dir_listing(const char* path)
+{
+	struct stat st;
+	if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode))
+		return NULL;
+	
+	unsigned int bucket = (unsigned int)(st.st_ino ^ st.st_dev) % DIR_CACHE_BUCKETS;
+	struct dir_listing* dir;
+	for (dir = dir_cache[bucket]; dir != NULL; dir = dir->next)
+	{
+		if (dir->dev == st.st_dev && dir->ino == st.st_ino)
+		{
+			if (dir->generation == glob_generation)
+				return dir;
+			if (!dir->racy && dir->mtime.tv_sec == st.st_mtim.tv_sec && 
+				dir->mtime.tv_nsec == st.st_mtim.tv_nsec)
+				return dir;
+			break;
+		}
+	}
+	
+	if (dir == NULL)
+	{
+		dir = calloc(1, sizeof(*dir));
+		dir->dev = st.st_dev;
+		dir->ino = st.st_ino;
+		dir->next = dir_cache[bucket];
+		dir_cache[bucket] = dir;
+		dir_cache_count++;
+	}
+	
+	dir->mtime = st.st_mtim;
+	dir->generation = glob_generation;
+	if (read_dir_listing(dir, path) < 0)
+	{
+		dir->racy = 1;
+		return NULL;
+	}
+	dir->racy = (st.st_mtim.tv_sec >= time(NULL) - 1);
+	return dir;
+}
+
+/*
+	Reads every entry of the directory with getdents64 and a large buffer, 
+	so even a directory with 100k files takes only a handful of system calls.
+	The names are packed back to back in one allocation.
+*/
+int read_dir_listing(struct dir_listing* dir, const char* path)
+{
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	
+	struct strbuf names = { NULL, 0, 0 };
+	int count = 0;
+	int cap = 0;
+	int* offsets = NULL;
+	unsigned char* types = NULL;
+	char* buf = malloc(GETDENTS_BUF_SIZE);
+	
+	while (1)
+	{
+		long n = syscall(SYS_getdents64, fd, buf, GETDENTS_BUF_SIZE);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		
+		for (long pos = 0; pos < n; )
+		{
+			struct linux_dirent64* entry = (struct linux_dirent64*)(buf + pos);
+			pos += entry->d_reclen;
+			
+			if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+				continue;
+			
+			if (count == cap)
+			{
+				cap = cap ? cap * 2 : 64;
+				offsets = realloc(offsets, cap * sizeof(int));
+				types = realloc(types, cap);
+			}
+			offsets[count] = names.len;
+			types[count] = entry->d_type;
+			sb_append(&names, entry->d_name, strlen(entry->d_name) + 1);
+			count++;
+		}
+	}
+	free(buf);
+	close(fd);
+	
+	free(dir->names);
+	free(dir->offsets);
+	free(dir->types);
+	dir->names = names.data;
+	dir->offsets = offsets;
+	dir->types = types;
+	dir->count = count;
+	return 0;
+}
+
+void clear_dir_cache()
+{
+	for (int i = 0; i < DIR_CACHE_BUCKETS; i++)
+	{
+		while (dir_cache[i] != NULL)
+		{
+			struct dir_listing* next = dir_cache[i]->next;
+			free(dir_cache[i]->names);
+			free(dir_cache[i]->offsets);
+			free(dir_cache[i]->types);
+			free(dir_cache[i]);
+			dir_cache[i] = next;
+		}
+	}
+	dir_cache_count = 0;
+}
+
+/*
+	Matches the path components one at a time. A component without glob 
+	characters is just appended, only the others need the directory's 
+	entries. Names starting with '.' have to be matched by a literal '.'.
+*/
+void glob_walk(const char* base, char** comps, int ncomps, char*** matches, int* count, int* cap)
+{
+	int is_last = (ncomps == 1);
+	size_t base_len = strlen(base);
+	
+	if (!has_glob_chars(comps[0]))
+	{
+		// remove the escapes and carry on with the next component
+		char path[base_len + strlen(comps[0]) + 2];
+		char* out = path + base_len;
+		memcpy(path, base, base_len);
+		for (const char* p = comps[0]; *p != '\0'; p++)
+		{
+			if (*p == '\\' && p[1] != '\0')
+				p++;
+			*out++ = *p;
+		}
+		*out = '\0';
+		
+		struct stat st;
+		if (is_last)
+		{
+			if (lstat(path, &st) == 0)
+				add_glob_match(path, matches, count, cap);
+		}
+		else
+		{
+			strcat(path, "/");
+			glob_walk(path, comps + 1, ncomps - 1, matches, count, cap);
+		}
+		return;
+	}
+	
+	struct glob_op ops[MAX_GLOB_OPS];
+	int nops = glob_compile(comps[0], ops, MAX_GLOB_OPS);
+	struct dir_listing* dir = get_dir_listing(base_len ? base : ".");
+	if (dir == NULL)
+		return;
+	
+	int want_hidden = (nops > 0 && ops[0].type == 'c' && ops[0].c == '.');
+	for (int i = 0; i < dir->count; i++)
+	{
+		const char* name = dir->names + dir->offsets[i];
+		if ((name[0] == '.' && !want_hidden) || !glob_match(ops, nops, name))
+			continue;
+		
+		char path[base_len + strlen(name) + 2];
+		memcpy(path, base, base_len);
+		strcpy(path + base_len, name);
+		
+		if (is_last)
+		{
+			add_glob_match(path, matches, count, cap);
+			continue;
+		}
+		
+		// only directories can hold the rest of the pattern
+		struct stat st;
+		unsigned char type = dir->types[i];
+		if (type == DT_DIR || ((type == DT_LNK || type == DT_UNKNOWN) && 
+			stat(path, &st) == 0 && S_ISDIR(st.st_mode)))
+		{
+			strcat(path, "/");
+			glob_walk(path, comps + 1, ncomps - 1, matches, count, cap);
+		}
+	}
+}
+
+void add_glob_match(const char* path, char*** matches, int* count, int* cap)
+{
+	if (*count == *cap)
+	{
+		*cap = *cap ? *cap * 2 : 16;
+		*matches = realloc(*matches, *cap * sizeof(char*));
+	}
+	(*matches)[(*count)++] = strdup(path);
+}
+
+int compare_strings(const void* a, const void* b)
+{
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+int expand_glob(const char* pattern, char** fields, int max)
+{
+	char* copy = strdup(pattern);
+	char* comps[MAX_TOKENS];
+	int ncomps = 0;
+	char* rest = copy;
+	
+	// an absolute pattern starts from / instead of the current directory
+	const char* base = "";
+	if (*rest == '/')
+	{
+		base = "/";
+		while (*rest == '/')
+			rest++;
+	}
+	
+	char* comp;
+	while ((comp = strsep(&rest, "/")) != NULL && ncomps < MAX_TOKENS)
+		comps[ncomps++] = comp;
+	
+	// the cache is only emptied between globs, when no listing is in use
+	if (dir_cache_count >= DIR_CACHE_MAX)
+		clear_dir_cache();
+	glob_generation++;
+	
+	char** matches = NULL;
+	int count = 0;
+	int cap = 0;
+	if (ncomps > 0)
+		glob_walk(base, comps, ncomps, &matches, &count, &cap);
+	
+	if (count > 0)
+		qsort(matches, count, sizeof(char*), compare_strings);
+	if (count > max)
+		fprintf(stderr, "glob: too many matches for '%s', only using %d\n", pattern, max);
+	
+	int used = 0;
+	for (int i = 0; i < count; i++)
+	{
+		if (used < max)
+			fields[used++] = matches[i];
+		else
+			free(matches[i]);
+	}
+	free(matches);
+	free(copy);
+	return used;
+}
+
+int expand_tokens(struct arena* arena, char* str, char** args, int* assigns)
+{
+	char* words[MAX_TOKENS];
+	int count = 0;
+	int leading = 1;	// every word so far has been an assignment
+	
+	if (assigns != NULL)
+		*assigns = 0;
+	tokenize_str(str, words);
+	for (int i = 0; words[i] != NULL; i++)
+	{
+		// NAME=value (also after local) is one field, never split or globbed
+		if ((leading || strcmp(words[0], "local") == 0) && assignment_name_len(words[i]) > 0)
+		{
+			count += expand_word(arena, words[i], args + count, MAX_TOKENS - 1 - count, 1);
+			if (leading && assigns != NULL)
+				(*assigns)++;
+			continue;
+		}
+		leading = 0;
+		
+		// checked on the raw word so that a quoted "<<" stays an argument
+		if (strncmp(words[i], "<<", 2) == 0)
+		{
+			i += expand_heredoc_word(arena, words + i, args, &count) - 1;
+			continue;
+		}
+		count += expand_word(arena, words[i], args + count, MAX_TOKENS - 1 - count, 0);
+	}
+	args[count] = NULL;
+	return count;
+}
+
+void free_tokens(char** args, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		free(args[i]);
+		args[i] = NULL;
+	}
+}
+
+/*
+	A command's words are all freed together when it ends, so they come 
+	from an arena: taking memory is moving an offset, and freeing it all is
+	dropping the blocks. The first block isn't even dropped, each thread 
+	keeps one for its next command, so once the shell is running a command 
+	normally allocates nothing for its words.
+*/
+__thread struct arena_block* spare_block = NULL;
+
+void* arena_alloc(struct arena* arena, size_t n)
+{
+	struct arena_block* b = arena->block;
+	
+	n = (n + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+	if (b == NULL || b->size - b->used < n)
+	{
+		if (n <= ARENA_BLOCK_SIZE && spare_block != NULL)
+		{
+			b = spare_block;
+			spare_block = NULL;
+		}
+		else
+		{
+			size_t size = n > ARENA_BLOCK_SIZE ? n : ARENA_BLOCK_SIZE;
+			b = malloc(sizeof(struct arena_block) + size);
+			b->size = size;
+		}
+		b->used = 0;
+		b->prev = arena->block;
+		arena->block = b;
+	}
+	
+	void* p = (char*)b->data + b->used;
+	b->used += n;
+	return p;
+}
+
+char* arena_strdup(struct arena* arena, const char* str)
+{
+	size_t n = strlen(str) + 1;
+	return memcpy(arena_alloc(arena, n), str, n);
+}
+
+void arena_free(struct arena* arena)
+{
+	struct arena_block* b = arena->block;
+	
+	while (b != NULL)
+	{
+		struct arena_block* prev = b->prev;
+		if (spare_block == NULL && b->size == ARENA_BLOCK_SIZE)
+			spare_block = b;
+		else
+			free(b);
+		b = prev;
+	}
+	arena->block = NULL;
+}
+
+int has_operators(char** args)
+{
+	for (int i = 0; args[i] != NULL; i++)
+	{
+		if (strcmp(args[i], "|") == 0 || strcmp(args[i], "<") == 0 ||
+			strcmp(args[i], ">") == 0 || strcmp(args[i], ">>") == 0 ||
+			strcmp(args[i], "<&") == 0 || strcmp(args[i], "&") == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+	Handles <<WORD, <<-WORD and <<<WORD, where WORD may also be the next word.
+	The here-document body is read right away from the batch file or the 
+	terminal, and the text is put behind a descriptor by make_input_fd(). 
+	The words are replaced by "<&" and the descriptor number, which 
+	execute_tokens() moves onto stdin like any other input redirection. A 
+	quoted delimiter turns off substitution in the body, as in other shells.
+	Returns how many of the words were used.
+*/
+int expand_heredoc_word(struct arena* arena, char** words, char** args, int* count)
+{
+	int is_string = words[0][2] == '<';
+	int strip_tabs = !is_string && words[0][2] == '-';
+	char* target = words[0] + 2 + (is_string || strip_tabs);
+	int used = 1;
+	
+	if (*target == '\0')
+	{
+		target = words[1];
+		used = 2;
+	}
+	if (target == NULL)
+	{
+		fprintf(stderr, "syntax error: missing word after '%s'\n", words[0]);
+		return used - 1;
+	}
+	
+	struct strbuf text = { NULL, 0, 0 };
+	sb_append(&text, "", 0);
+	if (is_string)
+	{
+		// a here-string is the expanded word plus a newline
+		char* fields[MAX_TOKENS];
+		int n = expand_word(NULL, target, fields, MAX_TOKENS, 0);
+		for (int i = 0; i < n; i++)
+		{
+			if (i > 0)
+				sb_append(&text, " ", 1);
+			sb_append(&text, fields[i], strlen(fields[i]));
+		}
+		free_tokens(fields, n);
+		sb_append(&text, "\n", 1);
+	}
+	else
+	{
+		// the delimiter is compared with its quotes removed
+		char delim[strlen(target) + 1];
+		int quoted = 0;
+		int n = 0;
+		for (char* p = target; *p != '\0'; p++)
+		{
+			if (*p == '\'' || *p == '"' || *p == '\\')
+				quoted = 1;
+			else
+				delim[n++] = *p;
+		}
+		delim[n] = '\0';
+		
+		struct strbuf body = { NULL, 0, 0 };
+		sb_append(&body, "", 0);
+		read_heredoc(delim, strip_tabs, &body);
+		if (quoted)
+			sb_append(&text, body.data, body.len);
+		else
+			expand_heredoc(body.data, &text);
+		free(body.data);
+	}
+	
+	int fd = make_input_fd(text.data, text.len);
+	free(text.data);
+	if (fd >= 0 && *count < MAX_TOKENS - 3)
+	{
+		char num[16];
+		snprintf(num, sizeof(num), "%d", fd);
+		args[(*count)++] = arena_strdup(arena, "<&");
+		args[(*count)++] = arena_strdup(arena, num);
+	}
+	else if (fd >= 0)
+	{
+		close(fd);
+	}
+	return used;
+}
+
+void read_heredoc(const char* delim, int strip_tabs, struct strbuf* body)
+{
+	char* line = NULL;
+	size_t size = 0;
+	
+	// a list of several lines already had the body cut out of it
+	if (heredoc_next != NULL && heredoc_next < heredoc_end)
+	{
+		size_t len = strlen(heredoc_next);
+		sb_append(body, heredoc_next, len);
+		heredoc_next += len + 1;
+		return;
+	}
+	
+	while (1)
+	{
+		ssize_t len;
+		if (command_string)
+		{
+			len = -1;	// the body had to be in the string
+		}
+		else if (script_file != NULL)
+		{
+			len = getline(&line, &size, script_file);
+		}
+		else
+		{
+			printf("> ");
+			fflush(stdout);
+			len = getline(&line, &size, stdin);
+		}
+		
+		if (len < 0)
+		{
+			fprintf(stderr, "warning: here-document ended by end of file (wanted '%s')\n", delim);
+			break;
+		}
+		
+		line[strcspn(line, "\r\n")] = '\0';
+		char* text = line;
+		while (strip_tabs && *text == '\t')
+			text++;
+		
+		if (strcmp(text, delim) == 0)
+			break;
+		
+		sb_append(body, text, strlen(text));
+		sb_append(body, "\n", 1);
+	}
+	free(line);
+}
+
+void expand_heredoc(const char* text, struct strbuf* out)
+{
+	const char* p = text;
+	
+	while (*p != '\0')
+	{
+		if (*p == '\\' && p[1] != '\0' && strchr("$`\\", p[1]) != NULL)
+		{
+			sb_append(out, p + 1, 1);
+			p += 2;
+		}
+		else if ((*p == '$' && p[1] == '(') || *p == '`' || (*p == '$' && param_end(p) != NULL))
+		{
+			// expand the substitution or parameter on its own, as one double-quoted field
+			const char* end = (*p == '`') ? strchr(p + 1, '`') : 
+							  (p[1] == '(') ? find_subst_end((char*)p + 2) : param_end(p) - 1;
+			size_t n = end ? (size_t)(end - p + 1) : strlen(p);
+			char word[n + 3];
+			
+			word[0] = '"';
+			memcpy(word + 1, p, n);
+			word[n + 1] = '"';
+			word[n + 2] = '\0';
+			
+			char* field;
+			if (expand_word(NULL, word, &field, 1, 0) == 1)
+			{
+				sb_append(out, field, strlen(field));
+				free(field);
+			}
+			p += n;
+		}
+		else
+		{
+			sb_append(out, p, 1);
+			p++;
+		}
+	}
+}
+
+/*
+	Puts the text behind a descriptor that can become a command's stdin, 
+	without touching the disk. When it fits in the pipe buffer it is written 
+	into a pipe, since that can be done without blocking. Anything bigger goes 
+	into a sealed memfd instead, which is read from the start like a file and
+	disappears once the last descriptor to it is closed.
+*/
+int make_input_fd(const char* data, size_t len)
+{
+	int fd[2];
+	if (pipe2(fd, O_CLOEXEC) == 0)
+	{
+		if (len <= (size_t)fcntl(fd[1], F_GETPIPE_SZ))
+		{
+			size_t done = 0;
+			while (done < len)
+			{
+				ssize_t n = write(fd[1], data + done, len - done);
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n <= 0)
+					break;
+				done += n;
+			}
+			close(fd[1]);
+			return fd[0];
+		}
+		close(fd[0]);
+		close(fd[1]);
+	}
+	
+	int mfd = memfd_create("heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (mfd < 0)
+	{
+		perror("memfd_create");
+		return -1;
+	}
+	
+	size_t done = 0;
+	while (done < len)
+	{
+		ssize_t n = write(mfd, data + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			perror("here-document");
+			close(mfd);
+			return -1;
+		}
+		done += n;
+	}
+	
+	fcntl(mfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+	lseek(mfd, 0, SEEK_SET);
+	return mfd;
+}
+
+/*
+	Runs the command for a $(...) or `...` substitution, collecting everything 
+	it writes to stdout in out. The command is expanded right here first, so a
+	nested substitution is just a recursive call in this process, with no 
+	temporary files and no extra shell. Builtins write into an in-memory 
+	stream without forking at all. A plain external command goes through 
+	spawn_cmd() with its stdout on a pipe, and anything with pipes or 
+	redirection runs in a forked copy of the shell the same way. The pipe is 
+	read into the growable buffer until the child closes it.
+*/
+void capture_output(const char* cmd, struct strbuf* out)
+{
+	char* line = strdup(cmd);
+	struct exec_context ctx;	// tokens is filled in by expand_tokens(), not cleared
+	ctx.arena.block = NULL;
+	char** args = ctx.tokens;
+	int op;
+	
+	// a list is expanded command by command as it runs, in the forked shell
+	int is_list = find_list_op(line, &op) != NULL || line[strspn(line, " \t")] == '(' || 
+				  line[strspn(line, " \t")] == '{';
+	int count = is_list ? 0 : expand_tokens(&ctx.arena, line, args, NULL);
+	
+	if (count == 0 && !is_list)
+	{
+		arena_free(&ctx.arena);
+		free(line);
+		return;
+	}
+	
+	// a function runs in the forked shell as well
+	int is_simple = !is_list && !has_operators(args) && find_function(args[0]) == NULL;
+	int handled = 0;
+	if (is_simple && find_builtin(args[0]))
+	{
+		// cd and exit would only change the throwaway subshell anyway
+		handled = builtin_changes_state(args[0]);
+		if (builtin_needs_fds(args[0]))
+			is_simple = 0;
+		else if (!handled)
+		{
+			char* data = NULL;
+			size_t size = 0;
+			FILE* mem = open_memstream(&data, &size);
+			handled = builtin_cmd_handler(args, stdin, mem);
+			fclose(mem);
+			sb_append(out, data, size);
+			free(data);
+		}
+	}
+	
+	// a builtin can also pass, like grep with options it doesn't know
+	if (!handled)
+	{
+		int fd[2];
+		if (pipe2(fd, O_CLOEXEC) < 0)
+		{
+			perror("pipe");
+			arena_free(&ctx.arena);
+			free(line);
+			return;
+		}
+		
+		pid_t pid;
+		int group = deadline_applies();
+		if (is_simple)
+		{
+			pid = spawn_cmd(args, -1, fd[1], group);
+		}
+		else
+		{
+			fflush(stdout);
+			pid = fork();
+			if (pid > 0 && group)
+				setpgid(pid, pid);
+			if (pid == 0)
+			{
+				if (group)
+					setpgid(0, 0);
+				dup2(fd[1], STDOUT_FILENO);
+				if (is_list)
+				{
+					parse_string(line);
+				}
+				else
+				{
+					execute_tokens(&ctx);
+				}
+				
+				// _exit so the batch file's stdio buffer isn't flushed a second time
+				fflush(stdout);
+				_exit(last_status);
+			}
+		}
+		close(fd[1]);
+		
+		// under a deadline, reading stops when it passes and wait_child() stops the child
+		if (group && pid > 0)
+		{
+			ssize_t n;
+			while (wait_readable(fd[0]) && ((n = sb_read_once(out, fd[0])) > 0 || 
+											(n < 0 && errno == EINTR)))
+				;
+		}
+		else
+			sb_read_fd(out, fd[0]);
+		close(fd[0]);
+		
+		if (pid > 0)
+			last_status = wait_child(pid, "$(...)");
+	}
+	
+	arena_free(&ctx.arena);
+	free(line);
+}
+
+/*
+	Runs a line that can hold a list of commands joined by ;, && and ||. The 
+	line is cut at each operator before anything is expanded, so a command 
+	that && or || skips is never expanded either, and none of its $(...) 
+	substitutions run. && runs the next command only if the last one that 
+	ran succeeded, || only if it failed, and ; always does. With set -e, a 
+	failing command stops the line and 1 is returned, unless it was the left
+	side of && or ||, since there the failure is being tested for. A function
+	definition whose body goes on past the end of the line reads more lines 
+	first, from the batch file or the terminal.
+*/
+int parse_string(char* str) 
+{ 
+	//add_to_history(str);
+	return run_line(str, 0);
+}
+
+int run_line(char* str, int tail)
+{
+	struct strbuf src = { NULL, 0, 0 };
+	struct command_list list = { NULL, 0, 0 };
+	char* line;
+	
+	sb_append(&src, str, strlen(str));
+	while (1)
+	{
+		// cutting the list up writes into it, so work on a copy in case more is needed
+		line = strdup(src.data);
+		if (parse_list(line, &list))
+			break;
+		
+		free_list(&list);
+		free(line);
+		line = NULL;
+		if (!read_continuation(&src))
+		{
+			fprintf(stderr, "syntax error: function body ended by end of file\n");
+			last_status = 2;
+			break;
+		}
+	}
+	
+	int stop = line != NULL && run_list(&list, tail);
+	free_list(&list);
+	free(line);
+	free(src.data);
+	return stop;
+}
+
+int parse_list(char* str, struct command_list* list)
+{
+	char* cmd = str;
+	int op = LIST_SEQ;	// how cmd is joined to the command before it
+	int line_first = list->count;	// first command on the current line
+	
+	while (cmd != NULL)
+	{
+		int next_op = LIST_SEQ;
+		int line_end = 0;	// cmd is the last one on its line
+		char* next;
+		struct shell_function* def = NULL;
+		struct command_list* group = NULL;
+		
+		cmd += strspn(cmd, " \t\n");
+		int subshell = *cmd == '(';
+		int is_def = parse_function(cmd, &def, &next);
+		if (is_def < 0)
+			return 0;
+		
+		if (!is_def && (*cmd == '(' || (*cmd == '{' && (cmd[1] == '\0' || strchr(" \t\n", cmd[1]) != NULL))))
+		{
+			// the body becomes a list of its own, what follows the close is redirection
+			char* close = find_group_end(cmd + 1);
+			if (close == NULL)
+				return 0;
+			
+			group = calloc(1, sizeof(*group));
+			*close = '\0';
+			parse_list(cmd + 1, group);
+			cmd = close + 1;
+		}
+		
+		if (is_def)
+		{
+			// only an operator may follow the closing brace
+			next += strspn(next, " \t");
+			line_end = *next == '\n';
+			if (*next == '\0')
+				next = NULL;
+			else if (find_list_op(next, &next_op) == next)
+				next += (next_op == LIST_SEQ) ? 1 : 2;
+			else
+			{
+				fprintf(stderr, "syntax error after the body of %s\n", def->name);
+				next = NULL;
+			}
+		}
+		else if ((next = find_list_op(cmd, &next_op)) != NULL)
+		{
+			line_end = *next == '\n';
+			*next = '\0';
+			next += (next_op == LIST_SEQ) ? 1 : 2;
+		}
+		
+		list_add(list, cmd, op, def);
+		list->cmds[list->count - 1].group = group;
+		list->cmds[list->count - 1].subshell = group != NULL && subshell;
+		
+		// the bodies of here-documents opened on the line come right after it. 
+		// On the last line they're still to be read, when the command runs
+		if (line_end && *next != '\0')
+		{
+			next = take_heredocs(list, line_first, next);
+			line_first = list->count;
+		}
+		op = next_op;
+		cmd = next;
+	}
+	return 1;
+}
+
+void list_add(struct command_list* list, char* text, int op, struct shell_function* def)
+{
+	if (list->count == list->cap)
+	{
+		list->cap = list->cap ? list->cap * 2 : 8;
+		list->cmds = realloc(list->cmds, list->cap * sizeof(struct list_cmd));
+	}
+	list->cmds[list->count].text = text;
+	list->cmds[list->count].op = op;
+	list->cmds[list->count].def = def;
+	list->cmds[list->count].group = NULL;
+	list->cmds[list->count].subshell = 0;
+	list->cmds[list->count].heredocs = (struct strbuf){ NULL, 0, 0 };
+	list->count++;
+}
+
+void free_list(struct command_list* list)
+{
+	for (int i = 0; i < list->count; i++)
+	{
+		if (list->cmds[i].def != NULL)
+			release_function(list->cmds[i].def);
+		if (list->cmds[i].group != NULL)
+		{
+			free_list(list->cmds[i].group);
+			free(list->cmds[i].group);
+		}
+		free(list->cmds[i].heredocs.data);
+	}
+	free(list->cmds);
+	list->cmds = NULL;
+	list->count = list->cap = 0;
+}
+
+int run_list(struct command_list* list, int tail)
+{
+	for (int i = 0; i < list->count && !func_returning && !cmd_timed_out; i++)
+	{
+		struct list_cmd* c = &list->cmds[i];
+		
+		if (c->op == LIST_SEQ || (c->op == LIST_AND && last_status == 0) || 
+			(c->op == LIST_OR && last_status != 0))
+		{
+			// the deadline covers a whole command, with the groups and functions it runs
+			int armed = cmd_timeout_ms > 0 && cmd_deadline == 0;
+			if (armed)
+				cmd_deadline = monotonic_ms() + cmd_timeout_ms;
+			
+			// its here-documents read the bodies parse_list() cut out
+			const char* outer_next = heredoc_next;
+			const char* outer_end = heredoc_end;
+			heredoc_next = c->heredocs.data;
+			heredoc_end = c->heredocs.data + c->heredocs.len;
+			
+			if (c->def != NULL)
+			{
+				define_function(c->def);
+				last_status = 0;
+			}
+			else if (c->group != NULL)
+			{
+				run_group(c);
+			}
+			else
+			{
+				// a function body runs many times, and running a command writes into it
+				char* cmd = strdup(c->text);
+				run_command(cmd, tail && i + 1 == list->count);
+				free(cmd);
+			}
+			heredoc_next = outer_next;
+			heredoc_end = outer_end;
+			if (armed)
+			{
+				cmd_deadline = 0;
+				cmd_timed_out = 0;
+			}
+			
+			if (errexit && last_status != 0 && 
+				(i + 1 == list->count || list->cmds[i + 1].op == LIST_SEQ))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+	A definition is NAME() or NAME () followed by a body in braces, see 
+	find_group_end() for where it ends. The body is split into its list 
+	right away, a call only has to expand and run the commands.
+*/
+int parse_function(char* p, struct shell_function** def, char** after)
+{
+	char* name_end = p;
+	
+	if (!isalpha((unsigned char)*p) && *p != '_')
+		return 0;
+	while (isalnum((unsigned char)*name_end) || *name_end == '_' || *name_end == '-')
+		name_end++;
+	
+	char* q = name_end + strspn(name_end, " \t");
+	if (q[0] != '(' || q[1] != ')')
+		return 0;
+	q += 2;
+	q += strspn(q, " \t\n");
+	if (q[0] != '{' || (q[1] != '\0' && strchr(" \t\n", q[1]) == NULL))
+		return 0;
+	
+	char* body = ++q;
+	if ((q = find_group_end(body)) == NULL)
+		return -1;
+	
+	struct shell_function* fn = calloc(1, sizeof(*fn));
+	fn->name = strndup(p, name_end - p);
+	fn->source = strndup(body, q - body);
+	fn->refs = 1;
+	if (!parse_list(fn->source, &fn->body))
+	{
+		// a definition nested in the body that isn't closed, can't happen once this one is
+		release_function(fn);
+		return -1;
+	}
+	*def = fn;
+	*after = q + 1;
+	return 1;
+}
+
+/*
+	Braces and parentheses nest, so this counts them. A { or } only counts 
+	where a command would start, as in other shells, while a ( or ) counts 
+	anywhere outside of a word. Braces and parentheses inside words, quotes
+	and $(...) don't count at all.
+*/
+char* find_group_end(char* p)
+{
+	char* q = p;
+	char* line = p;		// start of the current line
+	int depth = 1;
+	int cmd_start = 1;	// at the place a command starts, where { and } count
+	
+	while (*q != '\0')
+	{
+		if (*q == ' ' || *q == '\t')
+		{
+			q++;
+		}
+		else if (*q == '\n')
+		{
+			// the bodies of here-documents opened on the line aren't commands
+			if ((q = skip_heredocs(line, q, q + 1, NULL)) == NULL)
+				return NULL;
+			line = q;
+			cmd_start = 1;
+		}
+		else if (strchr(";|&", *q) != NULL)
+		{
+			cmd_start = 1;
+			q++;
+		}
+		else if (*q == '(' || (cmd_start && *q == '{' && strchr(" \t\n", q[1]) != NULL))
+		{
+			depth++;
+			cmd_start = 1;
+			q++;
+		}
+		else if (*q == ')' || (cmd_start && *q == '}' && (q[1] == '\0' || strchr(" \t\n;&|)<>", q[1]) != NULL)))
+		{
+			if (--depth == 0)
+				return q;
+			cmd_start = 1;	// another group can end right after this one
+			q++;
+		}
+		else
+		{
+			// a word, quotes and substitutions in it are skipped whole
+			cmd_start = 0;
+			while (*q != '\0' && strchr(" \t\n;|&()", *q) == NULL)
+				q = skip_word_part(q);
+		}
+	}
+	return NULL;
+}
+
+/*
+	In a list of several lines, such as a function body or a -c string, the
+	body of a here-document is in the lines after the one that opens it, as 
+	in other shells. parse_list() cuts those lines out and keeps them with 
+	the command, so they aren't run as commands, and a function called many 
+	times reads the same body every time instead of reading from the batch 
+	file or the terminal while it runs.
+*/
+char* take_heredocs(struct command_list* list, int first, char* body)
+{
+	for (int i = first; i < list->count; i++)
+	{
+		// a definition's here-documents are in its own body
+		if (list->cmds[i].def == NULL)
+			body = skip_heredocs(list->cmds[i].text, NULL, body, &list->cmds[i].heredocs);
+	}
+	return body;
+}
+
+char* skip_heredocs(char* start, char* end, char* body, struct strbuf* out)
+{
+	char* p = start;
+	
+	while (*p != '\0' && (end == NULL || p < end))
+	{
+		if (p[0] != '<' || p[1] != '<')
+		{
+			p = skip_word_part(p);
+			continue;
+		}
+		if (p[2] == '<')
+		{
+			p += 3;	// a here-string, it has no body
+			continue;
+		}
+		
+		char delim[strlen(p) + 1];
+		int strip_tabs;
+		p = heredoc_delim(p, delim, &strip_tabs);
+		
+		char* after = cut_heredoc(body, delim, strip_tabs, out);
+		if (after == NULL)
+		{
+			if (out == NULL)
+				return NULL;
+			fprintf(stderr, "warning: here-document ended by end of file (wanted '%s')\n", delim);
+			after = body + strlen(body);
+		}
+		if (out != NULL)
+			sb_append(out, "", 1);
+		body = after;
+	}
+	return body;
+}
+
+char* heredoc_delim(char* p, char* delim, int* strip_tabs)
+{
+	int n = 0;
+	
+	p += 2;
+	*strip_tabs = *p == '-';
+	p += *strip_tabs;
+	p += strspn(p, " \t");
+	
+	// compared with its quotes removed, like expand_heredoc_word() does
+	while (*p != '\0' && strchr(" \t\n;|&<>()", *p) == NULL)
+	{
+		for (char* next = skip_word_part(p); p < next; p++)
+		{
+			if (*p != '\'' && *p != '"' && *p != '\\')
+				delim[n++] = *p;
+		}
+	}
+	delim[n] = '\0';
+	return p;
+}
+
+char* cut_heredoc(char* body, const char* delim, int strip_tabs, struct strbuf* out)
+{
+	char* line = body;
+	size_t delim_len = strlen(delim);
+	
+	while (*line != '\0')
+	{
+		char* eol = line + strcspn(line, "\n");
+		char* text = line;
+		while (strip_tabs && *text == '\t')
+			text++;
+		
+		size_t len = eol - text;
+		if (len > 0 && text[len - 1] == '\r')
+			len--;
+		char* next = *eol == '\n' ? eol + 1 : eol;
+		if (len == delim_len && strncmp(text, delim, len) == 0)
+			return next;
+		
+		if (out != NULL)
+		{
+			sb_append(out, text, len);
+			sb_append(out, "\n", 1);
+		}
+		line = next;
+	}
+	return NULL;
+}
+
+/*
+	Runs a group. Its redirection is applied to the shell's own stdin and 
+	stdout for as long as the body runs, so every command in it shares one 
+	open file. A pipe after the group gets the group's output from a 
+	forked copy of the shell, while the rest of the pipeline runs here with
+	the pipe as its stdin.
+*/
+void run_group(struct list_cmd* c)
+{
+	char* rest = strdup(c->text);
+	char* pipe_rest = NULL;
+	
+	for (char* p = rest; *p != '\0'; p = skip_word_part(p))
+	{
+		if (*p == '|')
+		{
+			*p = '\0';
+			pipe_rest = p + 1;
+			break;
+		}
+	}
+	
+	struct exec_context ctx;	// tokens is filled in by expand_tokens(), not cleared
+	ctx.arena.block = NULL;
+	char** args = ctx.tokens;
+	int count = expand_tokens(&ctx.arena, rest, args, NULL);
+	int std_in = dup(0);
+	int std_out = dup(1);
+	int ok = 1;
+	
+	fflush(stdout);
+	for (int i = 0; i < count && ok; i += 2)
+	{
+		if (args[i + 1] == NULL || strchr("<>", args[i][0]) == NULL)
+		{
+			fprintf(stderr, "syntax error near '%s' after a group\n", args[i]);
+			ok = 0;
+		}
+		else
+			ok = redirect_fd(args[i], args[i + 1]);
+	}
+	
+	if (!ok)
+	{
+		last_status = 1;
+	}
+	else if (pipe_rest != NULL)
+	{
+		int fd[2];
+		if (pipe2(fd, O_CLOEXEC) < 0)
+		{
+			perror("pipe");
+			last_status = 1;
+		}
+		else
+		{
+			int group = deadline_applies();
+			pid_t pid = fork();
+			if (pid > 0 && group)
+				setpgid(pid, pid);
+			if (pid == 0)
+			{
+				if (group)
+					setpgid(0, 0);
+				dup2(fd[1], STDOUT_FILENO);
+				close(fd[0]);
+				close(fd[1]);
+				run_group_body(c, 1);
+				fflush(stdout);
+				_exit(last_status);
+			}
+			close(fd[1]);
+			dup2(fd[0], STDIN_FILENO);
+			close(fd[0]);
+			
+			run_command(pipe_rest, 0);
+			
+			if (pid > 0)
+				wait_child(pid, "{...}");
+		}
+	}
+	else
+	{
+		run_group_body(c, 0);
+	}
+	
+	fflush(stdout);
+	dup2(std_in, 0);
+	dup2(std_out, 1);
+	close(std_in);
+	close(std_out);
+	arena_free(&ctx.arena);
+	free(rest);
+}
+
+/*
+	A subshell must not change the shell that runs it, but most bodies 
+	can't do that anyway, so those run right here like a brace group. 
+	Only a body that could (cd, set, variables, functions...) gets a fork,
+	and the child runs the list that was already parsed. A plain external 
+	command at the end of it then replaces the child instead of being 
+	forked again.
+*/
+void run_group_body(struct list_cmd* c, int in_child)
+{
+	if (!c->subshell || in_child || !list_changes_state(c->group))
+	{
+		run_list(c->group, in_child);
+		return;
+	}
+	
+	fflush(stdout);
+	int group = deadline_applies();
+	pid_t pid = fork();
+	if (pid > 0 && group)
+		setpgid(pid, pid);
+	if (pid == 0)
+	{
+		if (group)
+			setpgid(0, 0);
+		run_list(c->group, 1);
+		fflush(stdout);
+		_exit(last_status);
+	}
+	
+	last_status = 1;
+	if (pid > 0)
+		last_status = wait_child(pid, "(...)");
+}
+
+int list_changes_state(struct command_list* list)
+{
+	for (int i = 0; i < list->count; i++)
+	{
+		struct list_cmd* c = &list->cmds[i];
+		
+		if (c->def != NULL)
+			return 1;
+		if (c->group != NULL)
+		{
+			if (list_changes_state(c->group))
+				return 1;
+			continue;
+		}
+		
+		// the first word as written, before any expansion
+		const char* word = c->text + strspn(c->text, " \t\n");
+		size_t len = strcspn(word, " \t\n");
+		char first[len + 1];
+		memcpy(first, word, len);
+		first[len] = '\0';
+		
+		if (assignment_name_len(first) > 0 || builtin_changes_state(first) || 
+			find_function(first) != NULL)
+			return 1;
+	}
+	return 0;
+}
+
+int redirect_fd(const char* op, const char* target)
+{
+	int fd;
+	int to = STDOUT_FILENO;
+	
+	if (strcmp(op, "<&") == 0)
+	{
+		fd = atoi(target);
+		to = STDIN_FILENO;
+	}
+	else if (strcmp(op, "<") == 0)
+	{
+		fd = open(target, O_RDONLY);
+		to = STDIN_FILENO;
+	}
+	else if (strcmp(op, ">") == 0)
+		fd = open(target, O_WRONLY | O_TRUNC | O_CREAT, 0666);
+	else if (strcmp(op, ">>") == 0)
+		fd = open(target, O_WRONLY | O_APPEND | O_CREAT, 0666);
+	else
+	{
+		fprintf(stderr, "unknown redirection '%s'\n", op);
+		return 0;
+	}
+	
+	if (fd < 0 || dup2(fd, to) < 0)
+	{
+		fprintf(stderr, "redirection '%s' %s: %s\n", op, target, strerror(errno));
+		return 0;
+	}
+	if (fd > 2)
+		close(fd);
+	return 1;
+}
+
+int read_continuation(struct strbuf* sb)
+{
+	char* line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	
+	if (command_string)
+	{
+		len = -1;
+	}
+	else if (script_file != NULL)
+	{
+		len = getline(&line, &size, script_file);
+	}
+	else
+	{
+		printf("> ");
+		fflush(stdout);
+		len = getline(&line, &size, stdin);
+	}
+	
+	if (len >= 0)
+	{
+		line[strcspn(line, "\r\n")] = '\0';
+		sb_append(sb, "\n", 1);
+		sb_append(sb, line, strlen(line));
+	}
+	free(line);
+	return len >= 0;
+}
+
+unsigned int name_hash(const char* name)
+{
+	unsigned int h = 2166136261u;	// FNV-1a
+	
+	while (*name != '\0')
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+	return h;
+}
+
+struct shell_function* find_function(const char* name)
+{
+	if (name == NULL)
+		return NULL;
+	
+	for (struct shell_function* fn = func_table[name_hash(name) % FUNC_BUCKETS]; fn != NULL; fn = fn->next)
+	{
+		if (strcmp(fn->name, name) == 0)
+			return fn;
+	}
+	return NULL;
+}
+
+void define_function(struct shell_function* fn)
+{
+	struct shell_function** slot = &func_table[name_hash(fn->name) % FUNC_BUCKETS];
+	
+	// drop the old one, a call still running it keeps its own reference
+	for (struct shell_function** p = slot; *p != NULL; p = &(*p)->next)
+	{
+		if (strcmp((*p)->name, fn->name) == 0)
+		{
+			struct shell_function* old = *p;
+			*p = old->next;
+			release_function(old);
+			break;
+		}
+	}
+	fn->refs++;
+	fn->next = *slot;
+	*slot = fn;
+}
+
+void release_function(struct shell_function* fn)
+{
+	if (--fn->refs > 0)
+		return;
+	free_list(&fn->body);
+	free(fn->name);
+	free(fn->source);
+	free(fn);
+}
+
+/*
+	Runs a function without forking. Its arguments become $1, $2... for the 
+	length of the call, and variables made local go away when it returns. 
+	The call ends at the end of the body or at return, and its status is 
+	that of the last command it ran or the one given to return.
+*/
+void call_function(struct shell_function* fn, char** args)
+{
+	struct call_frame frame = { NULL, 0, NULL, call_stack };
+	
+	if (call_depth >= MAX_CALL_DEPTH)
+	{
+		fprintf(stderr, "%s: too many nested function calls\n", fn->name);
+		last_status = 1;
+		return;
+	}
+	
+	// the words live in the caller's context, the array is copied so the frame owns its argv
+	while (args[frame.argc] != NULL)
+		frame.argc++;
+	frame.argv = malloc((frame.argc + 1) * sizeof(char*));
+	memcpy(frame.argv, args, (frame.argc + 1) * sizeof(char*));
+	
+	fn->refs++;
+	call_stack = &frame;
+	call_depth++;
+	last_status = 0;
+	run_list(&fn->body, 0);
+	func_returning = 0;
+	call_depth--;
+	call_stack = frame.prev;
+	release_function(fn);
+	
+	while (frame.locals != NULL)
+	{
+		struct shell_var* v = frame.locals;
+		frame.locals = v->next;
+		free(v->name);
+		free(v->value);
+		free(v);
+	}
+	free(frame.argv);
+}
+
+struct shell_var* find_var_in(struct shell_var* list, const char* name)
+{
+	for (; list != NULL; list = list->next)
+	{
+		if (strcmp(list->name, name) == 0)
+			return list;
+	}
+	return NULL;
+}
+
+const char* get_var(const char* name)
+{
+	struct shell_var* v;
+	
+	// locals are seen by the functions their function calls, like in other shells
+	for (struct call_frame* f = call_stack; f != NULL; f = f->prev)
+	{
+		if ((v = find_var_in(f->locals, name)) != NULL)
+			return v->value;
+	}
+	if ((v = find_var_in(var_table[name_hash(name) % VAR_BUCKETS], name)) != NULL)
+		return v->value;
+	return getenv(name);
+}
+
+void set_var_in(struct shell_var** list, const char* name, const char* value)
+{
+	struct shell_var* v = find_var_in(*list, name);
+	
+	if (v == NULL)
+	{
+		v = malloc(sizeof(*v));
+		v->name = strdup(name);
+		v->value = NULL;
+		v->next = *list;
+		*list = v;
+	}
+	free(v->value);
+	v->value = strdup(value);
+}
+
+void set_var(const char* name, const char* value)
+{
+	for (struct call_frame* f = call_stack; f != NULL; f = f->prev)
+	{
+		if (find_var_in(f->locals, name) != NULL)
+		{
+			set_var_in(&f->locals, name, value);
+			return;
+		}
+	}
+	set_var_in(&var_table[name_hash(name) % VAR_BUCKETS], name, value);
+}
+
+int assignment_name_len(const char* word)
+{
+	const char* p = word;
+	
+	if (!isalpha((unsigned char)*p) && *p != '_')
+		return 0;
+	while (isalnum((unsigned char)*p) || *p == '_')
+		p++;
+	return *p == '=' ? p - word : 0;
+}
+
+void local_builtin(char** args)
+{
+	if (call_stack == NULL)
+	{
+		fprintf(stderr, "local: can only be used in a function\n");
+		last_status = 1;
+		return;
+	}
+	
+	for (int i = 1; args[i] != NULL; i++)
+	{
+		int len = assignment_name_len(args[i]);
+		if (len > 0)
+		{
+			args[i][len] = '\0';
+			set_var_in(&call_stack->locals, args[i], args[i] + len + 1);
+			args[i][len] = '=';
+		}
+		else if (isalpha((unsigned char)args[i][0]) || args[i][0] == '_')
+		{
+			// a new local starts out empty, an existing one keeps its value
+			if (find_var_in(call_stack->locals, args[i]) == NULL)
+				set_var_in(&call_stack->locals, args[i], "");
+		}
+		else
+		{
+			fprintf(stderr, "local: '%s' is not a valid name\n", args[i]);
+			last_status = 1;
+		}
+	}
+}
+
+char* find_list_op(char* str, int* op)
+{
+	char* p = str;
+	
+	while (*p != '\0')
+	{
+		if (*p == ';' || *p == '\n')
+		{
+			*op = LIST_SEQ;
+			return p;
+		}
+		if ((*p == '&' || *p == '|') && p[1] == *p)
+		{
+			*op = (*p == '&') ? LIST_AND : LIST_OR;
+			return p;
+		}
+		p = skip_word_part(p);
+	}
+	return NULL;
+}
+
+int exit_status(int status)
+{
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	return WEXITSTATUS(status);
+}
+
+/*
+	Tokenizes and expands one command into a context of its own, then runs 
+	it. The substitutions in its words run through here again while it is 
+	being expanded, each with another context, so nothing they do touches 
+	this one. All the words are freed with the context's arena at the end.
+*/
+void run_command(char* str, int tail) 
+{ 
+	struct exec_context ctx;	// tokens is filled in by expand_tokens(), not cleared
+	ctx.arena.block = NULL;
+	char** args = ctx.tokens;
+	int assigns;
+	int count = expand_tokens(&ctx.arena, str, args, &assigns);
+	
+	if (count == 0)
+	{
+		arena_free(&ctx.arena);
+		return;
+	}
+	
+	// prefixes hold for every process started until the command is done
+	struct exec_attrs saved_attrs = cmd_attrs;
+	int prefixes = 0;
+	while (prefixes < count && args[prefixes][0] == '@' && strchr(args[prefixes], '=') != NULL)
+	{
+		if (!parse_exec_attr(args[prefixes], &cmd_attrs))
+		{
+			cmd_attrs = saved_attrs;
+			last_status = 2;
+			arena_free(&ctx.arena);
+			return;
+		}
+		prefixes++;
+	}
+	char** cmd = args + prefixes;
+	
+	if (prefixes == count)
+	{
+		cmd_attrs = saved_attrs;
+		arena_free(&ctx.arena);
+		return;
+	}
+	
+	// a command made only of NAME=value words sets shell variables
+	if (assigns == count)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			int len = assignment_name_len(args[i]);
+			args[i][len] = '\0';
+			set_var(args[i], args[i] + len + 1);
+		}
+		last_status = 0;
+		arena_free(&ctx.arena);
+		return;
+	}
+	
+	// nothing runs after this in the child, so the command can take its place
+	// (unless this shell has to enforce a deadline on it)
+	if (tail && !has_operators(cmd) && find_function(cmd[0]) == NULL && !find_builtin(cmd[0]) &&
+		!deadline_applies())
+	{
+		fflush(stdout);
+		apply_exec_attrs(&cmd_attrs);
+		execvp(cmd[0], cmd);
+		fprintf(stderr, "Could not execute command\n");
+		_exit(127);
+	}
+	
+	// the prefixes are dropped, the command's words move to the front
+	if (prefixes > 0)
+		memmove(args, cmd, (count - prefixes + 1) * sizeof(char*));
+	
+	execute_tokens(&ctx);
+	cmd_attrs = saved_attrs;
+	arena_free(&ctx.arena);
+}
+
+/*
+	@cpu=LIST		CPUs the command may run on, like 0-3,6
+	@nice=N			its nice value
+	@ioprio=CLASS	its I/O priority, idle, be[:LEVEL] or rt[:LEVEL] with 
+					LEVEL 0 (highest) to 7
+*/
+int parse_exec_attr(const char* word, struct exec_attrs* attrs)
+{
+	const char* value = strchr(word, '=') + 1;
+	char* end;
+	
+	if (strncmp(word, "@cpu=", 5) == 0)
+	{
+		CPU_ZERO(&attrs->cpus);
+		for (const char* p = value; *p != '\0'; p++)
+		{
+			long lo = strtol(p, &end, 10);
+			long hi = lo;
+			if (end == p || lo < 0)
+				break;
+			if (*end == '-')
+			{
+				p = end + 1;
+				hi = strtol(p, &end, 10);
+				if (end == p || hi < lo)
+					break;
+			}
+			for (long c = lo; c <= hi && c < CPU_SETSIZE; c++)
+				CPU_SET(c, &attrs->cpus);
+			p = end;
+			if (*p == '\0')
+			{
+				attrs->set |= ATTR_CPUS;
+				return 1;
+			}
+			if (*p != ',')
+				break;
+		}
+	}
+	else if (strncmp(word, "@nice=", 6) == 0)
+	{
+		attrs->nice = strtol(value, &end, 10);
+		if (end != value && *end == '\0')
+		{
+			attrs->set |= ATTR_NICE;
+			return 1;
+		}
+	}
+	else if (strncmp(word, "@ioprio=", 8) == 0)
+	{
+		int class = -1;
+		int level = 4;
+		const char* colon = strchr(value, ':');
+		size_t len = colon ? (size_t)(colon - value) : strlen(value);
+		
+		if (len == 4 && strncmp(value, "idle", 4) == 0)
+			class = IOPRIO_CLASS_IDLE;
+		else if (len == 2 && strncmp(value, "be", 2) == 0)
+			class = IOPRIO_CLASS_BE;
+		else if (len == 2 && strncmp(value, "rt", 2) == 0)
+			class = IOPRIO_CLASS_RT;
+		if (colon != NULL)
+		{
+			level = strtol(colon + 1, &end, 10);
+			if (end == colon + 1 || *end != '\0' || level < 0 || level > 7)
+				class = -1;
+		}
+		if (class >= 0)
+		{
+			attrs->ioprio = class << IOPRIO_CLASS_SHIFT | (class == IOPRIO_CLASS_IDLE ? 0 : level);
+			attrs->set |= ATTR_IOPRIO;
+			return 1;
+		}
+	}
+	
+	fprintf(stderr, "%s: not a valid prefix, see @cpu=LIST, @nice=N and @ioprio=CLASS[:LEVEL]\n", word);
+	return 0;
+}
+
+/*
+	Affinity, nice value and I/O priority all belong to a thread on Linux, 
+	so this works the same in a forked child before it execs (where it 
+	replaces the taskset, nice and ionice programs) and on the thread of a 
+	built-in pipeline stage.
+*/
+void apply_exec_attrs(const struct exec_attrs* attrs)
+{
+	pid_t tid = syscall(SYS_gettid);
+	
+	if ((attrs->set & ATTR_CPUS) && sched_setaffinity(0, sizeof(cpu_set_t), &attrs->cpus) < 0)
+		perror("@cpu");
+	if ((attrs->set & ATTR_NICE) && setpriority(PRIO_PROCESS, tid, attrs->nice) < 0)
+		perror("@nice");
+	if ((attrs->set & ATTR_IOPRIO) && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, attrs->ioprio) < 0)
+		perror("@ioprio");
+}
+
+/*
+	Sets up the redirection files if found, and replaces any input or output
+	files and redirection symbols with NULL. Then, it executes all the commands.
+	If there is piping and redirection in the same line, it opens the output 
+	file for writing, and then executes the rest of the command, including the
+	piping.
+*/
+void execute_tokens(struct exec_context* ctx) 
+{ 
+	// copy the stdin, stdout, and stderr descriptors so they can 
+	// be restored later
+	int std_in = fcntl(0, F_DUPFD_CLOEXEC, 0);
+	int std_out = fcntl(1, F_DUPFD_CLOEXEC, 0);
+	int std_err = fcntl(2, F_DUPFD_CLOEXEC, 0);
+	
+	int i = 1;
+	int is_piped = 0;
+	
+	// a pipeline is split into its stages, each of which has its own redirection
+	for (int k = 0; ctx->tokens[k] != NULL && !is_piped; k++)
+		is_piped = strcmp(ctx->tokens[k], "|") == 0;
+	if (is_piped)
+	{
+		char** stages[MAX_PIPE_STAGES];
+		int count = 1;
+		
+		stages[0] = ctx->tokens;
+		for (int k = 0; ctx->tokens[k] != NULL && count > 0; k++)
+		{
+			if (strcmp(ctx->tokens[k], "|") != 0)
+				continue;
+			if (count == MAX_PIPE_STAGES)
+			{
+				fprintf(stderr, "too many commands in the pipeline\n");
+				last_status = 1;
+				count = 0;
+				break;
+			}
+			ctx->tokens[k] = NULL;
+			stages[count++] = ctx->tokens + k + 1;
+		}
+		if (count > 0)
+			run_pipeline(stages, count);
+	}
+	
+	while (!is_piped && ctx->tokens[i] != NULL)
+	{
+		if (strcmp(ctx->tokens[i], "<&") == 0)
+		{	// Input from an open descriptor, used by here-documents
+			int in = atoi(ctx->tokens[i + 1]);
+			if (dup2(in, 0) < 0)
+			{
+				perror("redirection '<&' ");
+			}
+			
+			if (in > 2)
+				close(in);
+			ctx->tokens[i] = NULL;
+			ctx->tokens[i + 1] = NULL;
+			i += 2;
+		}
+		else if (strcmp(ctx->tokens[i], "<" ) == 0)
+		{	// Input redirection
+			int in = open(ctx->tokens[i + 1], O_RDONLY, 0666);
+			if (in < 0 || dup2(in, 0) < 0)
+			{
+				perror("redirection '<' ");
+			}
+
+			close(in);
+			ctx->tokens[i] = NULL;
+			ctx->tokens[i + 1] = NULL;
+			i += 2;
+		}
+		else if(strcmp(ctx->tokens[i], ">") == 0)
+		{
+			int out = open(ctx->tokens[i + 1], O_WRONLY | O_TRUNC | O_CREAT, 0666);
+			if (out < 0 || dup2(out, 1) < 0)
+			{
+				perror("redirection '>' ");
+			}
+
+			close(out);
+			ctx->tokens[i] = NULL;
+			ctx->tokens[i + 1] = NULL;
+			i += 2;
+		}
+		else if(strcmp(ctx->tokens[i], ">>") == 0)
+		{
+			int out = open(ctx->tokens[i + 1], O_WRONLY | O_APPEND | O_CREAT, 0666);
+			if (out < 0 || dup2(out, 1) < 0)
+			{
+				perror("redirection '>>' ");
+			}
+
+			close(out);
+			ctx->tokens[i] = NULL;
+			ctx->tokens[i + 1] = NULL;
+			i += 2;
+		}
+		else
+		{
+			i++;
+		}
+	}
+  
+	// if the cmd is a function or a built-in one, execute it. If it's a normal 
+	// UNIX command without piping, execute it.
+	struct shell_function* fn = is_piped ? NULL : find_function(ctx->tokens[0]);
+	if (fn != NULL)
+	{
+		call_function(fn, ctx->tokens);
+		fflush(stdout);
+	}
+    else if (!is_piped && builtin_cmd_handler(ctx->tokens, stdin, stdout)) 
+	{
+		fflush(stdout);
+		dup2(std_in, 0);
+		dup2(std_out, 1);
+		dup2(std_err, 2);
+	}
+	else if (is_piped == 0)
+	{
+		process(ctx);
+	}
+	
+	dup2(std_in, 0);
+	dup2(std_out, 1);
+	dup2(std_err, 2);
+	close(std_in);
+	close(std_out);
+	close(std_err);
+} 
+
+void process(struct exec_context* ctx) 
+{ 
+	int is_background = 0;
+	for (int i = 0; ctx->tokens[i] != NULL; i++) 
+	{
+		// if we're trying to run the process in the background
+		if (strcmp(ctx->tokens[i], "&") == 0) 
+		{
+			// update flag and remove the & from the command args
+			is_background = 1;
+			ctx->tokens[i] = NULL;
+			break;
+		}
+	}
+
+    // forking a child 
+	// with a deadline the command gets its own group, so it can be stopped with its children
+    pid_t pid = spawn_cmd(ctx->tokens, -1, -1, deadline_applies() && !is_background);  
+  
+    if (pid == -1) 
+	{ 
+        printf("\nFailed forking child.."); 
+		last_status = 1;
+        return; 
+    } 
+	
+	// if process shouldn't run in background, wait for the 
+	// child process to finish
+	last_status = 0;
+	if (is_background < 1) 
+		last_status = wait_child(pid, ctx->tokens[0]);
+}
+
+/*
+	Runs a pipeline. External commands and the built-ins that change the 
+	shell (which only change a child in a pipeline) each get a child, 
+	started first while the shell is still one thread. The other built-ins 
+	run on threads in the shell, which saves a fork for each and lets them 
+	read the shell's history and other state directly. Two built-ins next 
+	to each other are joined by a pipe_ring, so what one writes is copied 
+	once into memory the other reads from, with no system calls unless one
+	side has to sleep. Everything else is joined by a pipe.
+*/
+void run_pipeline(char** stages[], int count)
+{
+	struct pipe_stage st[MAX_PIPE_STAGES];
+	int ok = 1;
+	int redirected = 1;
+	
+	memset(st, 0, sizeof(st[0]) * count);
+	for (int s = 0; s < count; s++)
+	{
+		st[s].args = stages[s];
+		st[s].in_fd = -1;
+		st[s].out_fd = -1;
+		st[s].redir_in = -1;
+		st[s].redir_out = -1;
+		st[s].pid = -1;
+		st[s].in = stdin;
+		st[s].out = stdout;
+		// every stage is looked at, so a here-document's descriptor is never left open
+		if (!stage_redirects(&st[s]))
+			redirected = 0;
+		if (stages[s][0] == NULL)
+			ok = 0;
+	}
+	if (!ok || !redirected)
+	{
+		for (int s = 0; s < count; s++)
+		{
+			if (st[s].redir_in >= 0)
+				close(st[s].redir_in);
+			if (st[s].redir_out >= 0)
+				close(st[s].redir_out);
+		}
+		if (!ok)
+			fprintf(stderr, "syntax error near '|'\n");
+		last_status = ok ? 1 : 2;
+		return;
+	}
+	for (int s = 0; s < count; s++)
+		st[s].threaded = stage_runs_threaded(stages[s]);
+	
+	// connect each stage to the next
+	for (int s = 0; s + 1 < count && ok; s++)
+	{
+		int fd[2];
+		
+		if (st[s].threaded && st[s + 1].threaded)
+			ok = open_pipe_ring(&st[s].out, &st[s + 1].in);
+		else if (pipe2(fd, O_CLOEXEC) == 0)
+		{
+			st[s].out_fd = fd[1];
+			st[s + 1].in_fd = fd[0];
+		}
+		else
+			ok = 0;
+	}
+	if (!ok)
+		perror("pipe");
+	
+	// a stage's own < or > takes the place of its pipe, whose other end sees EOF or EPIPE
+	for (int s = 0; s < count; s++)
+	{
+		if (st[s].redir_in >= 0)
+		{
+			if (st[s].in != stdin)
+				fclose(st[s].in);
+			else if (st[s].in_fd >= 0)
+				close(st[s].in_fd);
+			st[s].in = stdin;
+			st[s].in_fd = st[s].redir_in;
+		}
+		if (st[s].redir_out >= 0)
+		{
+			if (st[s].out != stdout)
+				fclose(st[s].out);
+			else if (st[s].out_fd >= 0)
+				close(st[s].out_fd);
+			st[s].out = stdout;
+			st[s].out_fd = st[s].redir_out;
+		}
+	}
+	
+	// children first, so none is forked while a stage thread holds a lock
+	// under a deadline they share a process group, the first child's, so it can stop them all
+	int group = deadline_applies();
+	pid_t pgid = 0;
+	fflush(stdout);
+	for (int s = 0; s < count && ok; s++)
+	{
+		if (st[s].threaded)
+			continue;
+		
+		st[s].pid = fork();
+		if (st[s].pid > 0 && group)
+		{
+			setpgid(st[s].pid, pgid);
+			if (pgid == 0)
+				pgid = st[s].pid;
+		}
+		if (st[s].pid == 0)
+		{
+			if (group)
+				setpgid(0, pgid);
+			if (st[s].in_fd >= 0)
+				dup2(st[s].in_fd, STDIN_FILENO);
+			if (st[s].out_fd >= 0)
+				dup2(st[s].out_fd, STDOUT_FILENO);
+			for (int t = 0; t < count; t++)
+			{
+				if (st[t].in_fd >= 0)
+					close(st[t].in_fd);
+				if (st[t].out_fd >= 0)
+					close(st[t].out_fd);
+			}
+			
+			apply_exec_attrs(&cmd_attrs);
+			
+			// functions run in the child, and cd, exit and set only affect it
+			struct shell_function* fn = find_function(st[s].args[0]);
+			if (fn != NULL)
+			{
+				call_function(fn, st[s].args);
+				fflush(stdout);
+				_exit(last_status);
+			}
+			if (builtin_cmd_handler(st[s].args, stdin, stdout))
+			{
+				fflush(stdout);
+				_exit(last_status);
+			}
+			execvp(st[s].args[0], st[s].args);
+			fprintf(stderr, "Could not execute command\n");
+			_exit(127);
+		}
+		st[s].status = 127;
+	}
+	
+	// a child's ends of its pipes are only needed in the child
+	for (int s = 0; s < count; s++)
+	{
+		if (st[s].threaded)
+			continue;
+		if (st[s].in_fd >= 0)
+			close(st[s].in_fd);
+		if (st[s].out_fd >= 0)
+			close(st[s].out_fd);
+		st[s].in_fd = st[s].out_fd = -1;
+	}
+	
+	for (int s = 0; s < count; s++)
+	{
+		if (!st[s].threaded)
+			continue;
+		
+		if (st[s].in_fd >= 0)
+			st[s].in = fdopen(st[s].in_fd, "r");
+		if (st[s].out_fd >= 0)
+			st[s].out = fdopen(st[s].out_fd, "w");
+		st[s].status = 1;
+		if (!ok || pthread_create(&st[s].thread, NULL, run_stage_thread, &st[s]) != 0)
+		{
+			// nothing runs it, but its ends still have to be closed
+			st[s].threaded = 0;
+			if (st[s].in != stdin)
+				fclose(st[s].in);
+			if (st[s].out != stdout)
+				fclose(st[s].out);
+		}
+	}
+	
+	// the children first, so once a deadline stops them the threads reading their pipes end too
+	for (int s = 0; s < count; s++)
+	{
+		if (!st[s].threaded && st[s].pid > 0)
+			st[s].status = wait_child(st[s].pid, st[s].args[0]);
+	}
+	for (int s = 0; s < count; s++)
+	{
+		if (st[s].threaded)
+			pthread_join(st[s].thread, NULL);
+	}
+	last_status = st[count - 1].status;
+}
+
+int stage_runs_threaded(char** args)
+{
+	if (args[0] == NULL || !find_builtin(args[0]) || builtin_changes_state(args[0]) || 
+		builtin_needs_fds(args[0]) || find_function(args[0]) != NULL)
+		return 0;
+	
+	// pmap forks its jobs, which mustn't happen while another stage thread holds a lock
+	if (strcmp(args[0], "pmap") == 0)
+		return 0;
+	return strcmp(args[0], "grep") != 0 || !grep_declines(args);
+}
+
+int stage_redirects(struct pipe_stage* st)
+{
+	char** args = st->args;
+	int n = 0;
+	int ok = 1;
+	
+	for (int i = 0; args[i] != NULL; i++)
+	{
+		int* fd;
+		int flags;
+		
+		if (strcmp(args[i], "<&") == 0)
+		{
+			fd = &st->redir_in;	// a here-document or here-string, already open
+			flags = -1;
+		}
+		else if (strcmp(args[i], "<") == 0)
+		{
+			fd = &st->redir_in;
+			flags = O_RDONLY;
+		}
+		else if (strcmp(args[i], ">") == 0 || strcmp(args[i], ">>") == 0)
+		{
+			fd = &st->redir_out;
+			flags = O_WRONLY | O_CREAT | (args[i][1] == '>' ? O_APPEND : O_TRUNC);
+		}
+		else
+		{
+			args[n++] = args[i];
+			continue;
+		}
+		
+		if (args[i + 1] == NULL)
+		{
+			fprintf(stderr, "syntax error: missing file after '%s'\n", args[i]);
+			ok = 0;
+			break;
+		}
+		if (*fd >= 0)
+			close(*fd);
+		if (flags < 0)
+			*fd = atoi(args[i + 1]);
+		else if ((*fd = open(args[i + 1], flags | O_CLOEXEC, 0666)) < 0)
+		{
+			fprintf(stderr, "redirection '%s' %s: %s\n", args[i], args[i + 1], strerror(errno));
+			ok = 0;
+		}
+		i++;
+	}
+	args[n] = NULL;
+	return ok;
+}
+
+void* run_stage_thread(void* arg)
+{
+	struct pipe_stage* st = arg;
+	sigset_t set;
+	
+	// a stage whose reader has gone gets EPIPE instead of killing the shell
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	apply_exec_attrs(&cmd_attrs);
+	
+	builtin_cmd_handler(st->args, st->in, st->out);
+	st->status = last_status;
+	
+	if (st->in != stdin)
+		fclose(st->in);
+	if (st->out != stdout)
+		fclose(st->out);
+	else
+		fflush(stdout);
+	return NULL;
+}
+
+int open_pipe_ring(FILE** wr, FILE** rd)
+{
+	struct pipe_ring* ring = malloc(sizeof(*ring));
+	cookie_io_functions_t wr_io = { NULL, pipe_ring_write, NULL, pipe_ring_close_write };
+	cookie_io_functions_t rd_io = { pipe_ring_read, NULL, NULL, pipe_ring_close_read };
+	
+	if (ring == NULL)
+		return 0;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->write_closed, 0);
+	atomic_init(&ring->read_closed, 0);
+	atomic_init(&ring->waiters, 0);
+	atomic_init(&ring->wake, 0);
+	atomic_init(&ring->refs, 2);
+	
+	*wr = fopencookie(ring, "w", wr_io);
+	*rd = fopencookie(ring, "r", rd_io);
+	if (*wr == NULL || *rd == NULL)
+	{
+		if (*wr != NULL)
+			fclose(*wr);
+		if (*rd != NULL)
+			fclose(*rd);
+		*wr = stdout;
+		*rd = stdin;
+		return 0;
+	}
+	
+	// fewer, bigger writes into the ring wake the reader less often
+	setvbuf(*wr, NULL, _IOFBF, 64 * 1024);
+	return 1;
+}
+
+int pipe_ring_full(struct pipe_ring* ring)
+{
+	return atomic_load(&ring->head) - atomic_load(&ring->tail) == PIPE_RING_SIZE && 
+		   !atomic_load(&ring->read_closed);
+}
+
+int pipe_ring_empty(struct pipe_ring* ring)
+{
+	return atomic_load(&ring->head) == atomic_load(&ring->tail) && 
+		   !atomic_load(&ring->write_closed);
+}
+
+ssize_t pipe_ring_write(void* cookie, const char* buf, size_t size)
+{
+	struct pipe_ring* ring = cookie;
+	size_t done = 0;
+	
+	while (done < size)
+	{
+		if (atomic_load(&ring->read_closed))
+		{
+			// nobody is reading, like a pipe without SIGPIPE
+			errno = EPIPE;
+			return -1;
+		}
+		
+		size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+		size_t room = PIPE_RING_SIZE - (head - atomic_load_explicit(&ring->tail, memory_order_acquire));
+		if (room == 0)
+		{
+			pipe_ring_wait(ring, pipe_ring_full);
+			continue;
+		}
+		
+		// copy up to the end of the buffer, the rest wraps around next time
+		size_t at = head % PIPE_RING_SIZE;
+		size_t n = size - done;
+		if (n > room)
+			n = room;
+		if (n > PIPE_RING_SIZE - at)
+			n = PIPE_RING_SIZE - at;
+		memcpy(ring->buf + at, buf + done, n);
+		atomic_store(&ring->head, head + n);
+		pipe_ring_wake(ring);
+		done += n;
+	}
+	return size;
+}
+
+ssize_t pipe_ring_read(void* cookie, char* buf, size_t size)
+{
+	struct pipe_ring* ring = cookie;
+	
+	while (1)
+	{
+		size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		size_t avail = atomic_load_explicit(&ring->head, memory_order_acquire) - tail;
+		if (avail == 0)
+		{
+			if (atomic_load(&ring->write_closed))
+			{
+				// the writer may have added more just before closing
+				if (atomic_load(&ring->head) != tail)
+					continue;
+				return 0;
+			}
+			pipe_ring_wait(ring, pipe_ring_empty);
+			continue;
+		}
+		
+		size_t at = tail % PIPE_RING_SIZE;
+		size_t n = avail < size ? avail : size;
+		if (n > PIPE_RING_SIZE - at)
+			n = PIPE_RING_SIZE - at;
+		memcpy(buf, ring->buf + at, n);
+		atomic_store(&ring->tail, tail + n);
+		pipe_ring_wake(ring);
+		return n;
+	}
+}
+
+int pipe_ring_close_write(void* cookie)
+{
+	struct pipe_ring* ring = cookie;
+	
+	atomic_store(&ring->write_closed, 1);
+	pipe_ring_wake(ring);
+	pipe_ring_release(ring);
+	return 0;
+}
+
+int pipe_ring_close_read(void* cookie)
+{
+	struct pipe_ring* ring = cookie;
+	
+	atomic_store(&ring->read_closed, 1);
+	pipe_ring_wake(ring);
+	pipe_ring_release(ring);
+	return 0;
+}
+
+/*
+	Announces the wait before looking at the ring once more, so that the 
+	other side either sees a waiter and bumps wake, or moved before that 
+	last look and there's nothing to wait for. FUTEX_WAIT only sleeps if wake
+	still has the value read before that look.
+*/
+void pipe_ring_wait(struct pipe_ring* ring, int (*check)(struct pipe_ring*))
+{
+	unsigned int seen = atomic_load(&ring->wake);
+	
+	atomic_fetch_add(&ring->waiters, 1);
+	if (check(ring))
+		syscall(SYS_futex, &ring->wake, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+	atomic_fetch_sub(&ring->waiters, 1);
+}
+
+void pipe_ring_wake(struct pipe_ring* ring)
+{
+	if (atomic_load(&ring->waiters) == 0)
+		return;
+	atomic_fetch_add(&ring->wake, 1);
+	syscall(SYS_futex, &ring->wake, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+}
+
+void pipe_ring_release(struct pipe_ring* ring)
+{
+	if (atomic_fetch_sub(&ring->refs, 1) == 1)
+		free(ring);
+}
+
+pid_t spawn_cmd(char** args, int in_fd, int out_fd, int new_group)
+{
+	// anything still buffered would otherwise be written twice
+	fflush(stdout);
+	
+	pid_t pid = fork();
+	if (pid > 0 && new_group)
+		setpgid(pid, pid);	// in both, so it's done before either one goes on
+	if (pid == 0) 
+	{ 
+		if (new_group)
+			setpgid(0, 0);
+		apply_exec_attrs(&cmd_attrs);
+		if (in_fd >= 0)
+		{
+			dup2(in_fd, STDIN_FILENO);
+			close(in_fd);
+		}
+		if (out_fd >= 0)
+		{
+			dup2(out_fd, STDOUT_FILENO);
+			close(out_fd);
+		}
+		
+        execvp(args[0], args);
+		fprintf(stderr, "Could not execute command\n"); 
+		_exit(127);
+    } 
+	return pid;
+} 
+
+/*
+	Waits for pid with poll() on a pidfd, which becomes readable when the 
+	process exits, so a deadline needs no SIGALRM and no helper process. 
+	Without a pidfd (kernels before 5.3, or a seccomp filter that blocks 
+	it) it looks with waitpid(WNOHANG) every DEADLINE_POLL_MS instead, so 
+	the deadline still holds. At the deadline pid's process group gets 
+	SIGTERM, and SIGKILL if it is still there kill_after_ms later. The 
+	shell's own group is never signalled, only pid then. The status is 
+	TIMEOUT_STATUS, or 128+9 if it had to be killed, like coreutils timeout.
+*/
+int wait_deadline(pid_t pid, long timeout_ms, long kill_after_ms, int* timed_out)
+{
+	int pidfd = syscall(SYS_pidfd_open, pid, 0);
+	pid_t pgid = getpgid(pid);
+	int status;
+	int reaped = 0;
+	int stage = 0;		// 0 running, 1 sent SIGTERM, 2 sent SIGKILL
+	long deadline = monotonic_ms() + timeout_ms;
+	
+	*timed_out = 0;
+	while (stage < 2)
+	{
+		long left = deadline - monotonic_ms();
+		int n;
+		
+		if (left < 0)
+			left = 0;
+		if (pidfd >= 0)
+		{
+			// even once the deadline is gone, a process that has exited isn't counted as timed out
+			struct pollfd p = { pidfd, POLLIN, 0 };
+			n = poll(&p, 1, left > INT32_MAX ? INT32_MAX : left);
+			if (n > 0)
+				break;	// it exited
+		}
+		else
+		{
+			pid_t r = waitpid(pid, &status, WNOHANG);
+			if (r == pid)
+			{
+				reaped = 1;
+				break;
+			}
+			if (r < 0 && errno != EINTR)
+				break;
+			n = left > 0 ? poll(NULL, 0, left < DEADLINE_POLL_MS ? left : DEADLINE_POLL_MS) : 0;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			break;
+		if (left > 0)
+			continue;
+		
+		// the deadline passed, escalate one step and start the next wait
+		*timed_out = 1;
+		stage++;
+		if (pgid > 0 && pgid != getpgrp())
+			kill(-pgid, stage == 1 ? SIGTERM : SIGKILL);
+		kill(pid, stage == 1 ? SIGTERM : SIGKILL);	// in case it left its group
+		if (stage == 1)
+			deadline = monotonic_ms() + kill_after_ms;
+	}
+	if (pidfd >= 0)
+		close(pidfd);
+	
+	// the process has exited or been killed, so this doesn't block for long
+	while (!reaped && waitpid(pid, &status, 0) < 0)
+	{
+		if (errno != EINTR)
+			return 127;
+	}
+	if (*timed_out)
+		return stage == 2 ? 128 + SIGKILL : TIMEOUT_STATUS;
+	return exit_status(status);
+}
+
+int deadline_applies()
+{
+	// a child in a group under a deadline is stopped by the shell that forked it
+	return cmd_deadline > 0 && getpgrp() == shell_pgid;
+}
+
+/*
+	Every child of a command waits through here. Under --timeout it only 
+	waits until the command's deadline, which is shared by all the 
+	children of its pipelines, groups and functions. The first one to run
+	out says so, the rest see a deadline that is already gone, and stop at
+	once. cmd_timed_out then keeps run_list() from starting anything more
+	before the command ends.
+*/
+int wait_child(pid_t pid, const char* name)
+{
+	int status;
+	
+	if (deadline_applies())
+	{
+		int timed_out;
+		long left = cmd_deadline - monotonic_ms();
+		int result = wait_deadline(pid, left > 0 ? left : 0, TIMEOUT_KILL_AFTER_MS, &timed_out);
+		if (cmd_timed_out && result == 128 + SIGTERM)
+			result = TIMEOUT_STATUS;	// it ended on the SIGTERM its group got
+		if (timed_out && !cmd_timed_out)
+		{
+			cmd_timed_out = 1;
+			fprintf(stderr, "%s: timed out after %ldms, status %d\n", name, cmd_timeout_ms, result);
+		}
+		return result;
+	}
+	
+	while (waitpid(pid, &status, 0) < 0)
+	{
+		if (errno != EINTR)
+			return 127;
+	}
+	return exit_status(status);
+}
+
+int wait_readable(int fd)
+{
+	struct pollfd p = { fd, POLLIN, 0 };
+	
+	while (1)
+	{
+		long left = cmd_deadline - monotonic_ms();
+		if (left <= 0)
+			return 0;
+		
+		int n = poll(&p, 1, left > INT32_MAX ? INT32_MAX : left);
+		if (n > 0 || (n < 0 && errno != EINTR))
+			return 1;	// data, end of file or an error, which the read will report
+	}
+}
+
+long parse_duration(const char* str)
+{
+	char* end;
+	double value = strtod(str, &end);
+	double scale;
+	
+	if (end == str || value < 0)
+		return -1;
+	if (*end == '\0' || strcmp(end, "s") == 0)
+		scale = 1000;
+	else if (strcmp(end, "ms") == 0)
+		scale = 1;
+	else if (strcmp(end, "m") == 0)
+		scale = 60 * 1000;
+	else if (strcmp(end, "h") == 0)
+		scale = 60 * 60 * 1000;
+	else if (strcmp(end, "d") == 0)
+		scale = 24 * 60 * 60 * 1000;
+	else
+		return -1;
+	return (long)(value * scale);
+}
+
+/*
+	timeout [-k DURATION] DURATION cmd [args...]
+	
+	Runs cmd (a program, builtin or function) in a child with a process 
+	group of its own, and stops the whole group if it is still running 
+	after DURATION, with SIGTERM and then, -k later (5 seconds by default),
+	SIGKILL. The status is cmd's own, or 124 if it timed out. A DURATION of
+	0 means no timeout at all.
+*/
+void timeout_builtin(char** args)
+{
+	long kill_after = TIMEOUT_KILL_AFTER_MS;
+	int i = 1;
+	
+	if (args[i] != NULL && strcmp(args[i], "-k") == 0)
+	{
+		if (args[i + 1] == NULL || (kill_after = parse_duration(args[i + 1])) < 0)
+		{
+			fprintf(stderr, "timeout: -k needs a duration\n");
+			last_status = 125;
+			return;
+		}
+		i += 2;
+	}
+	
+	long limit = args[i] != NULL ? parse_duration(args[i]) : -1;
+	if (limit < 0 || args[i + 1] == NULL)
+	{
+		fprintf(stderr, "usage: timeout [-k duration] duration command [args...]\n");
+		last_status = 125;
+		return;
+	}
+	char** cmd = args + i + 1;
+	
+	// in a child under --timeout, the group it is in already gets stopped
+	int group = cmd_deadline == 0 || deadline_applies();
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid > 0 && group)
+		setpgid(pid, pid);
+	if (pid == 0)
+	{
+		if (group)
+			setpgid(0, 0);
+		run_in_child(cmd);
+	}
+	if (pid < 0)
+	{
+		perror("timeout");
+		last_status = 125;
+		return;
+	}
+	
+	// a duration of 0 means no timeout, as in coreutils, and --timeout can still end it sooner
+	int timed_out;
+	if (limit == 0 || (deadline_applies() && cmd_deadline - monotonic_ms() < limit))
+		last_status = wait_child(pid, cmd[0]);
+	else
+		last_status = wait_deadline(pid, limit, kill_after, &timed_out);
+}
+
+void run_in_child(char** cmd)
+{
+	struct shell_function* fn = find_function(cmd[0]);
+	
+	apply_exec_attrs(&cmd_attrs);
+	if (fn != NULL)
+		call_function(fn, cmd);
+	if (fn != NULL || builtin_cmd_handler(cmd, stdin, stdout))
+	{
+		fflush(stdout);
+		_exit(last_status);
+	}
+	execvp(cmd[0], cmd);
+	fprintf(stderr, "%s: could not execute command\n", cmd[0]);
+	_exit(127);
+}
+
+/*
+	memo [-c] cmd [args...]
+	
+	The key of a command is a hash of its words, the current directory, the 
+	variables named in $SHELL_MEMO_ENV, and every argument that names a 
+	file, by its size, mtime and inode (or its contents with -c). A regular 
+	file on stdin (a < redirection) counts the same way, and piped stdin is
+	read and hashed whole, then handed to the command from memory. When the 
+	cache in $SHELL_MEMO_DIR (~/.cache/shell-memo by default) has an entry 
+	for the key, its stdout, stderr and status are replayed and the command
+	doesn't run. Otherwise it runs with both outputs passing through the 
+	shell, which keeps a copy for the cache. Entries are touched when used, 
+	and the least recently used ones go once the cache is bigger than 
+	$SHELL_MEMO_MAX bytes.
+*/
+void memo_builtin(char** args)
+{
+	int content = 0;
+	int i = 1;
+	
+	if (args[i] != NULL && strcmp(args[i], "-c") == 0)
+	{
+		content = 1;
+		i++;
+	}
+	if (args[i] == NULL)
+	{
+		fprintf(stderr, "usage: memo [-c] command [args...]\n");
+		last_status = 2;
+		return;
+	}
+	char** cmd = args + i;
+	
+	// the key
+	unsigned __int128 h = ((unsigned __int128)0x6c62272e07bb0142ULL << 64) | 0x62b821756295c58dULL;
+	char cwd[4096];
+	
+	memo_hash(&h, &content, sizeof(content));
+	for (int a = 0; cmd[a] != NULL; a++)
+		memo_hash(&h, cmd[a], strlen(cmd[a]) + 1);
+	if (getcwd(cwd, sizeof(cwd)) != NULL)
+		memo_hash(&h, cwd, strlen(cwd) + 1);
+	
+	char* names = strdup(getenv("SHELL_MEMO_ENV") ? getenv("SHELL_MEMO_ENV") : MEMO_DEFAULT_ENV);
+	for (char* name = strtok(names, " :,"); name != NULL; name = strtok(NULL, " :,"))
+	{
+		const char* value = getenv(name);
+		memo_hash(&h, name, strlen(name) + 1);
+		memo_hash(&h, value ? value : "", value ? strlen(value) + 1 : 0);
+	}
+	free(names);
+	
+	for (int a = 1; cmd[a] != NULL; a++)
+		memo_hash_file(&h, cmd[a], -1, content);
+	
+	struct stat in_st;
+	struct strbuf input = { NULL, 0, 0 };
+	int piped_in = fstat(STDIN_FILENO, &in_st) == 0 && S_ISFIFO(in_st.st_mode);
+	if (piped_in)
+	{
+		sb_read_fd(&input, STDIN_FILENO);
+		memo_hash(&h, "stdin", 6);
+		memo_hash(&h, input.data, input.len);
+	}
+	else
+		memo_hash_file(&h, "<stdin>", STDIN_FILENO, content);
+	
+	// the cache entry for the key
+	const char* dir_env = getenv("SHELL_MEMO_DIR");
+	struct strbuf dir = { NULL, 0, 0 };
+	if (dir_env != NULL)
+		sb_append(&dir, dir_env, strlen(dir_env));
+	else
+	{
+		const char* base = getenv("XDG_CACHE_HOME");
+		if (base == NULL)
+		{
+			base = getenv("HOME") ? getenv("HOME") : "/tmp";
+			sb_append(&dir, base, strlen(base));
+			sb_append(&dir, "/.cache", 7);
+		}
+		else
+			sb_append(&dir, base, strlen(base));
+		mkdir(dir.data, 0700);
+		sb_append(&dir, "/shell-memo", 11);
+	}
+	mkdir(dir.data, 0700);
+	
+	char path[dir.len + 40];
+	snprintf(path, sizeof(path), "%s/%016llx%016llx", dir.data, 
+			 (unsigned long long)(h >> 64), (unsigned long long)h);
+	
+	if (memo_replay(path))
+	{
+		free(input.data);
+		free(dir.data);
+		return;
+	}
+	
+	// a miss, run it and keep what it writes
+	int out_pipe[2], err_pipe[2];
+	int in_fd = piped_in ? make_input_fd(input.data ? input.data : "", input.len) : -1;
+	free(input.data);
+	if (pipe2(out_pipe, O_CLOEXEC) < 0 || pipe2(err_pipe, O_CLOEXEC) < 0)
+	{
+		perror("memo");
+		last_status = 1;
+		free(dir.data);
+		return;
+	}
+	
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		if (in_fd >= 0)
+			dup2(in_fd, STDIN_FILENO);
+		dup2(out_pipe[1], STDOUT_FILENO);
+		dup2(err_pipe[1], STDERR_FILENO);
+		run_in_child(cmd);
+	}
+	close(out_pipe[1]);
+	close(err_pipe[1]);
+	if (in_fd >= 0)
+		close(in_fd);
+	
+	struct strbuf out = { NULL, 0, 0 };
+	struct strbuf err = { NULL, 0, 0 };
+	struct pollfd fds[2] = { { out_pipe[0], POLLIN, 0 }, { err_pipe[0], POLLIN, 0 } };
+	char buf[65536];
+	
+	sb_append(&out, "", 0);
+	sb_append(&err, "", 0);
+	while (fds[0].fd >= 0 || fds[1].fd >= 0)
+	{
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (int k = 0; k < 2; k++)
+		{
+			if (fds[k].fd < 0 || fds[k].revents == 0)
+				continue;
+			
+			ssize_t n = read(fds[k].fd, buf, sizeof(buf));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+			{
+				close(fds[k].fd);
+				fds[k].fd = -1;
+				continue;
+			}
+			sb_append(k == 0 ? &out : &err, buf, n);
+			write_all(k == 0 ? STDOUT_FILENO : STDERR_FILENO, buf, n);
+		}
+	}
+	
+	int status;
+	last_status = 127;
+	if (pid > 0 && waitpid(pid, &status, 0) == pid)
+	{
+		last_status = exit_status(status);
+		
+		// a command that was killed didn't finish, so there's nothing to replay
+		if (!WIFSIGNALED(status))
+			memo_store(dir.data, path, last_status, &out, &err);
+	}
+	free(out.data);
+	free(err.data);
+	free(dir.data);
+}
+
+int write_all(int fd, const char* buf, size_t n)
+{
+	while (n > 0)
+	{
+		ssize_t m = write(fd, buf, n);
+		if (m < 0 && errno == EINTR)
+			continue;
+		if (m < 0)
+			return 0;
+		buf += m;
+		n -= m;
+	}
+	return 1;
+}
+
+void memo_hash(unsigned __int128* h, const void* data, size_t n)
+{
+	const unsigned __int128 prime = ((unsigned __int128)1 << 88) | 0x13b;
+	const unsigned char* p = data;
+	
+	for (size_t i = 0; i < n; i++)
+		*h = (*h ^ p[i]) * prime;
+}
+
+int memo_hash_file(unsigned __int128* h, const char* path, int fd, int content)
+{
+	struct stat st;
+	
+	if ((fd >= 0 ? fstat(fd, &st) : stat(path, &st)) < 0 || !S_ISREG(st.st_mode))
+		return 0;
+	
+	memo_hash(h, path, strlen(path) + 1);
+	if (!content)
+	{
+		memo_hash(h, &st.st_size, sizeof(st.st_size));
+		memo_hash(h, &st.st_mtim, sizeof(st.st_mtim));
+		memo_hash(h, &st.st_ino, sizeof(st.st_ino));
+		memo_hash(h, &st.st_dev, sizeof(st.st_dev));
+		return 1;
+	}
+	
+	int own = fd < 0;
+	if (own && (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return 0;
+	if (st.st_size > 0)
+	{
+		// mapped rather than read, so a redirected stdin stays at the start for the command
+		char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED)
+		{
+			memo_hash(h, map, st.st_size);
+			munmap(map, st.st_size);
+		}
+	}
+	if (own)
+		close(fd);
+	return 1;
+}
+
+int memo_replay(const char* path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct memo_header hdr;
+	struct stat st;
+	
+	if (fd < 0)
+		return 0;
+	if (fstat(fd, &st) < 0 || read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || hdr.magic != MEMO_MAGIC || 
+		(unsigned long long)st.st_size != sizeof(hdr) + hdr.out_len + hdr.err_len)
+	{
+		close(fd);
+		return 0;
+	}
+	
+	char* map = st.st_size > (off_t)sizeof(hdr) ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+	if (map == MAP_FAILED)
+	{
+		close(fd);
+		return 0;
+	}
+	if (map != NULL)
+	{
+		fflush(stdout);
+		write_all(STDOUT_FILENO, map + sizeof(hdr), hdr.out_len);
+		write_all(STDERR_FILENO, map + sizeof(hdr) + hdr.out_len, hdr.err_len);
+		munmap(map, st.st_size);
+	}
+	
+	// the mtime is when the entry was last used, for memo_evict()
+	futimens(fd, NULL);
+	close(fd);
+	last_status = hdr.status;
+	return 1;
+}
+
+void memo_store(const char* dir, const char* path, int status, struct strbuf* out, struct strbuf* err)
+{
+	struct memo_header hdr = { MEMO_MAGIC, status, out->len, err->len };
+	char tmp[strlen(path) + 32];
+	
+	// written under another name and renamed, so a reader never sees half an entry
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, getpid());
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return;
+	
+	int ok = write_all(fd, (char*)&hdr, sizeof(hdr)) && write_all(fd, out->data, out->len) && 
+			 write_all(fd, err->data, err->len);
+	close(fd);
+	if (!ok || rename(tmp, path) < 0)
+	{
+		unlink(tmp);
+		return;
+	}
+	
+	const char* max = getenv("SHELL_MEMO_MAX");
+	memo_evict(dir, max ? atoll(max) : MEMO_DEFAULT_MAX);
+}
+
+void memo_evict(const char* dir, long long max)
+{
+	DIR* d = opendir(dir);
+	struct dirent* e;
+	struct memo_file* files = NULL;
+	int count = 0, cap = 0;
+	long long total = 0;
+	
+	if (d == NULL)
+		return;
+	while ((e = readdir(d)) != NULL)
+	{
+		struct stat st;
+		if (e->d_name[0] == '.' || fstatat(dirfd(d), e->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode))
+			continue;
+		
+		if (count == cap)
+		{
+			cap = cap ? cap * 2 : 64;
+			files = realloc(files, cap * sizeof(struct memo_file));
+		}
+		files[count].name = strdup(e->d_name);
+		files[count].size = st.st_size;
+		files[count].used = st.st_mtim;
+		total += st.st_size;
+		count++;
+	}
+	
+	if (total > max)
+	{
+		qsort(files, count, sizeof(struct memo_file), compare_memo_files);
+		for (int i = 0; i < count && total > max; i++)
+		{
+			if (unlinkat(dirfd(d), files[i].name, 0) == 0)
+				total -= files[i].size;
+		}
+	}
+	closedir(d);
+	for (int i = 0; i < count; i++)
+		free(files[i].name);
+	free(files);
+}
+
+int compare_memo_files(const void* a, const void* b)
+{
+	const struct memo_file* x = a;
+	const struct memo_file* y = b;
+	
+	if (x->used.tv_sec != y->used.tv_sec)
+		return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+	if (x->used.tv_nsec != y->used.tv_nsec)
+		return x->used.tv_nsec < y->used.tv_nsec ? -1 : 1;
+	return 0;
+}
+
+/*
+	watch [-d DURATION] [-k] PATH... -- cmd [args...]
+	
+	Runs cmd once, then again each time one of the paths changes, until 
+	ctrl-c. A file is watched through its directory, so editors that save by
+	writing a new file and renaming it over the old one are still seen, and 
+	a directory counts any change to its entries. A burst of events (a save,
+	a checkout, a build writing many files) starts one run, DURATION after
+	the last event (100ms by default). When a change comes while cmd is 
+	still running, it runs once more after it finishes, or with -k the 
+	running one is stopped with SIGTERM and started again. Everything is 
+	one poll() on the inotify descriptor, the run's pidfd and a signalfd, 
+	so nothing is done between changes.
+*/
+void watch_builtin(char** args)
+{
+	long debounce = WATCH_DEBOUNCE_MS;
+	int cancel = 0;
+	int i = 1;
+	
+	for (; args[i] != NULL && args[i][0] == '-' && strcmp(args[i], "--") != 0; i++)
+	{
+		if (strcmp(args[i], "-k") == 0)
+			cancel = 1;
+		else if (strcmp(args[i], "-q") == 0)
+			cancel = 0;
+		else if (strcmp(args[i], "-d") == 0 && args[i + 1] != NULL && (debounce = parse_duration(args[i + 1])) >= 0)
+			i++;
+		else
+			break;
+	}
+	
+	int first = i;
+	while (args[i] != NULL && strcmp(args[i], "--") != 0)
+		i++;
+	if (i == first || args[i] == NULL || args[i + 1] == NULL)
+	{
+		fprintf(stderr, "usage: watch [-d duration] [-k|-q] path... -- command [args...]\n");
+		last_status = 2;
+		return;
+	}
+	char** cmd = args + i + 1;
+	
+	int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	int count = i - first;
+	struct watch_target targets[count];
+	
+	for (int t = 0; t < count; t++)
+	{
+		targets[t].name = NULL;
+		if (ifd < 0 || !watch_add(ifd, args[first + t], &targets[t]))
+		{
+			fprintf(stderr, "watch: cannot watch %s\n", args[first + t]);
+			for (int u = 0; u < t; u++)
+				free(targets[u].name);
+			if (ifd >= 0)
+				close(ifd);
+			last_status = 1;
+			return;
+		}
+	}
+	
+	// ctrl-c and SIGTERM end the watch, they come through a signalfd instead of a handler
+	sigset_t mask, old_mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, &old_mask);
+	int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+	
+	int pidfd = -1;
+	pid_t pid = watch_run(cmd, &old_mask, &pidfd);
+	int pending = 0;			// a change is waiting for the current run to end
+	long due = -1;				// when the debounce window ends, -1 if no change is waiting
+	long kill_at = -1;			// when a cancelled run gets SIGKILL
+	int done = 0;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	
+	while (!done)
+	{
+		long now = monotonic_ms();
+		long wait = -1;
+		if (due >= 0)
+			wait = due > now ? due - now : 0;
+		if (kill_at >= 0 && (wait < 0 || kill_at - now < wait))
+			wait = kill_at > now ? kill_at - now : 0;
+		
+		struct pollfd fds[3] = { { ifd, POLLIN, 0 }, { sfd, POLLIN, 0 }, { pidfd, POLLIN, 0 } };
+		int n = poll(fds, pid > 0 ? 3 : 2, wait);
+		if (n < 0 && errno != EINTR)
+			break;
+		now = monotonic_ms();
+		
+		if (n > 0 && (fds[1].revents & POLLIN))
+			done = 1;
+		
+		if (n > 0 && (fds[0].revents & POLLIN))
+		{
+			ssize_t len;
+			while ((len = read(ifd, buf, sizeof(buf))) > 0)
+			{
+				for (char* p = buf; p < buf + len; )
+				{
+					struct inotify_event* event = (struct inotify_event*)p;
+					p += sizeof(struct inotify_event) + event->len;
+					
+					for (int t = 0; t < count; t++)
+					{
+						if (targets[t].wd == event->wd && (event->mask & IN_Q_OVERFLOW || targets[t].name == NULL || 
+							(event->len > 0 && strcmp(targets[t].name, event->name) == 0)))
+						{
+							due = now + debounce;
+							break;
+						}
+					}
+					if (event->mask & IN_Q_OVERFLOW)
+						due = now + debounce;
+				}
+			}
+		}
+		
+		if (pid > 0 && n > 0 && (fds[2].revents & POLLIN))
+		{
+			int status;
+			if (waitpid(pid, &status, 0) == pid)
+				last_status = exit_status(status);
+			close(pidfd);
+			pid = -1;
+			pidfd = -1;
+			kill_at = -1;
+		}
+		
+		if (due >= 0 && now >= due)
+		{
+			due = -1;
+			pending = 1;
+			if (pid > 0 && cancel && kill_at < 0)
+			{
+				kill(-pid, SIGTERM);
+				kill_at = now + TIMEOUT_KILL_AFTER_MS;
+			}
+		}
+		if (pid > 0 && kill_at >= 0 && now >= kill_at)
+		{
+			kill(-pid, SIGKILL);
+			kill_at = -1;
+		}
+		
+		if (pid < 0 && pending && !done)
+		{
+			pending = 0;
+			pid = watch_run(cmd, &old_mask, &pidfd);
+		}
+	}
+	
+	// ctrl-c ends the run in progress as well
+	if (pid > 0)
+	{
+		kill(-pid, SIGTERM);
+		int timed_out;
+		last_status = wait_deadline(pid, TIMEOUT_KILL_AFTER_MS, 0, &timed_out);
+		close(pidfd);
+	}
+	if (sfd >= 0)
+		close(sfd);
+	close(ifd);
+	for (int t = 0; t < count; t++)
+		free(targets[t].name);
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+int watch_add(int ifd, const char* path, struct watch_target* target)
+{
+	const uint32_t events = IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | 
+							IN_MOVED_FROM | IN_MOVED_TO;
+	struct stat st;
+	
+	if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+	{
+		target->wd = inotify_add_watch(ifd, path, events);
+		return target->wd >= 0;
+	}
+	
+	// a file, or one that doesn't exist yet, is seen from its directory
+	char* copy = strdup(path);
+	char* slash = strrchr(copy, '/');
+	const char* dir = ".";
+	
+	if (slash == copy)
+		dir = "/";
+	else if (slash != NULL)
+	{
+		*slash = '\0';
+		dir = copy;
+	}
+	target->name = strdup(slash != NULL ? slash + 1 : copy);
+	target->wd = inotify_add_watch(ifd, dir, events | IN_MASK_ADD);
+	free(copy);
+	return target->wd >= 0;
+}
+
+pid_t watch_run(char** cmd, const sigset_t* mask, int* pidfd)
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid > 0)
+		setpgid(pid, pid);
+	if (pid == 0)
+	{
+		setpgid(0, 0);
+		sigprocmask(SIG_SETMASK, mask, NULL);
+		run_in_child(cmd);
+	}
+	if (pid < 0)
+	{
+		perror("watch");
+		*pidfd = -1;
+		return -1;
+	}
+	
+	*pidfd = syscall(SYS_pidfd_open, pid, 0);
+	if (*pidfd < 0)
+	{
+		// without a pidfd there is nothing to poll, so this run is waited for here
+		int status;
+		waitpid(pid, &status, 0);
+		last_status = exit_status(status);
+		return -1;
+	}
+	return pid;
+}
+
+long monotonic_ms()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+/*
+	coproc NAME cmd [args...]
+	
+	Starts cmd with its stdin and stdout on pipes to the shell, and leaves
+	it running, so a tool that is slow to start can answer many requests 
+	for the price of one start. cowrite NAME sends it a line, coread NAME 
+	reads a line back, and coclose NAME closes its input and waits for it
+	to finish. $NAME_PID is its pid, and $NAME_IN and $NAME_OUT are the 
+	descriptors that go to its stdin and come from its stdout, which the 
+	commands run later inherit. The command should write a reply as soon 
+	as it has one, most programs only do that when their output is a pipe
+	if told to (stdbuf -oL, or an option of their own).
+*/
+void coproc_builtin(char** args)
+{
+	if (args[1] == NULL || args[2] == NULL || 
+		(!isalpha((unsigned char)args[1][0]) && args[1][0] != '_'))
+	{
+		fprintf(stderr, "usage: coproc name command [args...]\n");
+		last_status = 2;
+		return;
+	}
+	for (struct coproc* c = coprocs; c != NULL; c = c->next)
+	{
+		if (strcmp(c->name, args[1]) == 0)
+		{
+			fprintf(stderr, "coproc: %s is already running\n", args[1]);
+			last_status = 1;
+			return;
+		}
+	}
+	
+	int to_child[2], from_child[2];
+	if (pipe(to_child) < 0)
+	{
+		perror("coproc");
+		last_status = 1;
+		return;
+	}
+	if (pipe(from_child) < 0)
+	{
+		perror("coproc");
+		close(to_child[0]);
+		close(to_child[1]);
+		last_status = 1;
+		return;
+	}
+	
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		// the older coprocesses' pipes would keep them from ever seeing end of file
+		for (struct coproc* c = coprocs; c != NULL; c = c->next)
+		{
+			close(c->in_fd);
+			close(c->out_fd);
+		}
+		dup2(to_child[0], STDIN_FILENO);
+		dup2(from_child[1], STDOUT_FILENO);
+		close(to_child[0]);
+		close(to_child[1]);
+		close(from_child[0]);
+		close(from_child[1]);
+		run_in_child(args + 2);
+	}
+	close(to_child[0]);
+	close(from_child[1]);
+	if (pid < 0)
+	{
+		perror("coproc");
+		close(to_child[1]);
+		close(from_child[0]);
+		last_status = 1;
+		return;
+	}
+	
+	struct coproc* c = malloc(sizeof(struct coproc));
+	c->name = strdup(args[1]);
+	c->pid = pid;
+	c->in_fd = to_child[1];
+	c->out_fd = from_child[0];
+	c->buf = (struct strbuf){ NULL, 0, 0 };
+	c->pos = 0;
+	sb_append(&c->buf, "", 0);
+	c->next = coprocs;
+	coprocs = c;
+	
+	size_t len = strlen(c->name);
+	char name[len + 8];
+	char value[24];
+	const char* suffixes[] = { "_PID", "_IN", "_OUT" };
+	int values[] = { pid, c->in_fd, c->out_fd };
+	for (int i = 0; i < 3; i++)
+	{
+		snprintf(name, sizeof(name), "%s%s", c->name, suffixes[i]);
+		snprintf(value, sizeof(value), "%d", values[i]);
+		set_var(name, value);
+	}
+}
+
+/*
+	cowrite NAME [words...] writes the words and a newline to the coprocess,
+	or with no words, copies its own input (cowrite NAME < requests). 
+	SIGPIPE is blocked while writing, so a coprocess that has quit gives 
+	an error here instead of killing the shell.
+*/
+void cowrite_builtin(char** args, FILE* in)
+{
+	struct coproc* c = args[1] != NULL ? find_coproc(args[1], "cowrite") : NULL;
+	if (c == NULL)
+	{
+		if (args[1] == NULL)
+			fprintf(stderr, "usage: cowrite name [words...]\n");
+		last_status = args[1] == NULL ? 2 : 1;
+		return;
+	}
+	
+	struct strbuf line = { NULL, 0, 0 };
+	sb_append(&line, "", 0);
+	if (args[2] == NULL)
+		sb_read_stream(&line, in);
+	for (int i = 2; args[i] != NULL; i++)
+	{
+		if (i > 2)
+			sb_append(&line, " ", 1);
+		sb_append(&line, args[i], strlen(args[i]));
+	}
+	if (args[2] != NULL)
+		sb_append(&line, "\n", 1);
+	
+	sigset_t pipe_set, old_set;
+	sigemptyset(&pipe_set);
+	sigaddset(&pipe_set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+	if (!write_all(c->in_fd, line.data, line.len))
+	{
+		fprintf(stderr, "cowrite: %s: %s\n", c->name, strerror(errno));
+		last_status = 1;
+		
+		// take the SIGPIPE back out, or it would arrive when unblocked
+		struct timespec now = { 0, 0 };
+		if (errno == EPIPE && !sigismember(&old_set, SIGPIPE))
+			sigtimedwait(&pipe_set, NULL, &now);
+	}
+	pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	free(line.data);
+}
+
+/*
+	coread NAME [VAR] reads the next line from the coprocess and prints it,
+	or puts it in VAR without the newline. The status is 1 once the 
+	coprocess has closed its output and everything has been read. Reads
+	are as big as the pipe has to give, and the extra is kept for the next
+	coread, so a burst of replies costs one read().
+*/
+void coread_builtin(char** args, FILE* out)
+{
+	struct coproc* c = args[1] != NULL ? find_coproc(args[1], "coread") : NULL;
+	if (c == NULL)
+	{
+		if (args[1] == NULL)
+			fprintf(stderr, "usage: coread name [var]\n");
+		last_status = args[1] == NULL ? 2 : 1;
+		return;
+	}
+	
+	char* newline;
+	while ((newline = memchr(c->buf.data + c->pos, '\n', c->buf.len - c->pos)) == NULL)
+	{
+		// what's been used up goes, the unread part moves to the front
+		if (c->pos > 0)
+		{
+			memmove(c->buf.data, c->buf.data + c->pos, c->buf.len - c->pos);
+			c->buf.len -= c->pos;
+			c->pos = 0;
+		}
+		
+		char chunk[65536];
+		ssize_t n = read(c->out_fd, chunk, sizeof(chunk));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		sb_append(&c->buf, chunk, n);
+	}
+	
+	size_t len = newline != NULL ? (size_t)(newline - (c->buf.data + c->pos)) : c->buf.len - c->pos;
+	if (newline == NULL && len == 0)
+	{
+		last_status = 1;
+		return;
+	}
+	
+	char* text = strndup(c->buf.data + c->pos, len);
+	c->pos += len + (newline != NULL);
+	if (args[2] != NULL)
+		set_var(args[2], text);
+	else
+		fprintf(out, "%s\n", text);
+	free(text);
+}
+
+void coclose_builtin(char** args)
+{
+	struct coproc* c = args[1] != NULL ? find_coproc(args[1], "coclose") : NULL;
+	if (c == NULL)
+	{
+		if (args[1] == NULL)
+			fprintf(stderr, "usage: coclose name\n");
+		last_status = args[1] == NULL ? 2 : 1;
+		return;
+	}
+	
+	struct coproc** link = &coprocs;
+	while (*link != c)
+		link = &(*link)->next;
+	*link = c->next;
+	
+	// end of file on its input tells it to finish, replies it still sends are dropped
+	char chunk[65536];
+	ssize_t n;
+	close(c->in_fd);
+	while ((n = read(c->out_fd, chunk, sizeof(chunk))) > 0 || (n < 0 && errno == EINTR))
+		;
+	close(c->out_fd);
+	
+	int status;
+	pid_t done;
+	while ((done = waitpid(c->pid, &status, 0)) < 0 && errno == EINTR)
+		;
+	last_status = done == c->pid ? exit_status(status) : 127;
+	free(c->buf.data);
+	free(c->name);
+	free(c);
+}
+
+struct coproc* find_coproc(const char* name, const char* cmd)
+{
+	for (struct coproc* c = coprocs; c != NULL; c = c->next)
+	{
+		if (strcmp(c->name, name) == 0)
+			return c;
+	}
+	fprintf(stderr, "%s: no coprocess named %s\n", cmd, name);
+	return NULL;
+}
+
+/*
+	--serve SOCKET
+	
+	Runs the shell as a server on a UNIX domain socket, so a program that 
+	needs to run many commands pays for starting a shell once instead of 
+	once per command. There is no banner, prompt or history. A client sends
+	one request per line:
+	
+		run CMD			runs CMD, its output goes to the server's stdout
+		capture CMD		runs CMD and sends back its stdout and stderr
+	
+	and gets back one reply per request, in order, made of the line
+	
+		status=N usec=T stdout=A stderr=B
+	
+	followed by A bytes of stdout and B bytes of stderr (both 0 for run). N 
+	is the exit status and T the time the command took in microseconds.
+	
+	Every request runs in its own fork of the server, through parse_string()
+	like a typed line, so lists, pipes and redirection all work, but cd and 
+	set only last for that request. A single epoll loop watches the listening 
+	socket, every client, and every running request's output pipes and pidfd. 
+	Requests from different clients therefore run at the same time, and the 
+	server never blocks on any one of them.
+*/
+int serve(const char* path)
+{
+	struct sockaddr_un addr;
+	struct epoll_event ev;
+	struct epoll_event events[SERVE_MAX_EVENTS];
+	
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "serve: socket path too long\n");
+		return 1;
+	}
+	
+	// a client that goes away mid-reply shouldn't kill the server
+	signal(SIGPIPE, SIG_IGN);
+	
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	
+	// a socket left behind by an earlier server is replaced
+	struct stat st;
+	if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+	
+	if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+		listen(listen_fd, SOMAXCONN) < 0)
+	{
+		perror("serve");
+		return 1;
+	}
+	
+	serve_epoll = epoll_create1(EPOLL_CLOEXEC);
+	ev.events = EPOLLIN;
+	ev.data.fd = listen_fd;
+	epoll_ctl(serve_epoll, EPOLL_CTL_ADD, listen_fd, &ev);
+	serve_listen = listen_fd;
+	
+	while (1)
+	{
+		int n = epoll_wait(serve_epoll, events, SERVE_MAX_EVENTS, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+		{
+			perror("epoll_wait");
+			return 1;
+		}
+		
+		for (int i = 0; i < n; i++)
+		{
+			int fd = events[i].data.fd;
+			
+			if (fd == listen_fd)
+			{
+				int client_fd;
+				while ((client_fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+				{
+					struct serve_client* c = calloc(1, sizeof(struct serve_client));
+					c->sock = client_fd;
+					c->pidfd = -1;
+					c->out_fd = -1;
+					c->err_fd = -1;
+					serve_watch(c, client_fd, EPOLLIN);
+				}
+				continue;
+			}
+			
+			// the fd may belong to a client closed earlier in this batch
+			struct serve_client* c = fd < serve_owner_size ? serve_owner[fd] : NULL;
+			if (c == NULL)
+				continue;
+			
+			if (fd == c->sock)
+			{
+				if (events[i].events & EPOLLOUT)
+					serve_flush(c);
+				if (c->closing && (events[i].events & (EPOLLHUP | EPOLLERR)))
+				{
+					// hung up completely, only the running request is left
+					serve_unwatch(c, fd, 0);
+				}
+				else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				{
+					// read what came, a request line may arrive in pieces
+					char buf[4096];
+					ssize_t len;
+					while ((len = read(fd, buf, sizeof(buf))) > 0)
+						sb_append(&c->in, buf, len);
+					if (len == 0 || (len < 0 && errno != EAGAIN && errno != EINTR))
+					{
+						// the requests already sent still run and get replies
+						c->closing = 1;
+						ev.events = c->want_out ? EPOLLOUT : 0;
+						ev.data.fd = fd;
+						epoll_ctl(serve_epoll, EPOLL_CTL_MOD, fd, &ev);
+					}
+				}
+			}
+			else if (fd == c->out_fd || fd == c->err_fd)
+			{
+				struct strbuf* sb = (fd == c->out_fd) ? &c->out : &c->err;
+				if (serve_read(sb, fd) == 0)
+				{
+					serve_unwatch(c, fd, 1);
+					if (fd == c->out_fd)
+						c->out_fd = -1;
+					else
+						c->err_fd = -1;
+				}
+			}
+			else if (fd == c->pidfd)
+			{
+				int status;
+				if (waitpid(c->pid, &status, 0) == c->pid)
+					c->status = exit_status(status);
+				else
+					c->status = 1;
+				clock_gettime(CLOCK_MONOTONIC, &c->end);
+				serve_unwatch(c, c->pidfd, 1);
+				c->pidfd = -1;
+			}
+			
+			serve_step(c);
+		}
+	}
+}
+
+/*
+	Moves a client along once something happened to it: a finished request
+	gets its reply, the next request line starts running, and a client that
+	hung up is freed once its last reply is out.
+*/
+void serve_step(struct serve_client* c)
+{
+	if (c->busy && c->pidfd < 0 && c->out_fd < 0 && c->err_fd < 0)
+	{
+		// the command exited and its output pipes are drained
+		long usec = (c->end.tv_sec - c->start.tv_sec) * 1000000L + 
+					(c->end.tv_nsec - c->start.tv_nsec) / 1000;
+		char header[128];
+		int n = snprintf(header, sizeof(header), "status=%d usec=%ld stdout=%zu stderr=%zu\n", 
+						 c->status, usec, c->out.len, c->err.len);
+		sb_append(&c->reply, header, n);
+		sb_append(&c->reply, c->out.data, c->out.len);
+		sb_append(&c->reply, c->err.data, c->err.len);
+		c->out.len = 0;
+		c->err.len = 0;
+		c->busy = 0;
+		serve_flush(c);
+	}
+	
+	while (!c->busy && c->reply_sent == c->reply.len && c->sock >= 0)
+	{
+		char* nl = c->in.len ? memchr(c->in.data, '\n', c->in.len) : NULL;
+		if (nl == NULL)
+			break;
+		
+		*nl = '\0';
+		char* line = strdup(c->in.data);
+		size_t used = nl + 1 - c->in.data;
+		memmove(c->in.data, nl + 1, c->in.len - used);
+		c->in.len -= used;
+		line[strcspn(line, "\r")] = '\0';
+		
+		serve_start(c, line);
+		free(line);
+	}
+	
+	if (c->closing && !c->busy && c->reply_sent == c->reply.len)
+	{
+		if (c->sock >= 0)
+		{
+			serve_unwatch(c, c->sock, 1);
+			c->sock = -1;
+		}
+		free(c->in.data);
+		free(c->out.data);
+		free(c->err.data);
+		free(c->reply.data);
+		free(c);
+	}
+}
+
+/*
+	Forks a copy of the server to run one request line. The copy closes 
+	every descriptor that belongs to the server, so a client only sees its 
+	connection close when the server closes it.
+*/
+void serve_start(struct serve_client* c, char* line)
+{
+	int capture;
+	char* cmd;
+	int out_pipe[2] = { -1, -1 };
+	int err_pipe[2] = { -1, -1 };
+	
+	if (strncmp(line, "run ", 4) == 0)
+		capture = 0;
+	else if (strncmp(line, "capture ", 8) == 0)
+		capture = 1;
+	else
+	{
+		serve_error(c, "error unknown request\n");
+		return;
+	}
+	cmd = line + (capture ? 8 : 4);
+	
+	if (capture && (pipe2(out_pipe, O_CLOEXEC) < 0 || pipe2(err_pipe, O_CLOEXEC) < 0))
+	{
+		perror("pipe");
+		serve_error(c, "error pipe failed\n");
+		return;
+	}
+	
+	fflush(stdout);
+	clock_gettime(CLOCK_MONOTONIC, &c->start);
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		close(serve_epoll);
+		close(serve_listen);
+		for (int fd = 0; fd < serve_owner_size; fd++)
+		{
+			if (serve_owner[fd] != NULL)
+				close(fd);
+		}
+		signal(SIGPIPE, SIG_DFL);
+		
+		int devnull = open("/dev/null", O_RDONLY);
+		dup2(devnull, STDIN_FILENO);
+		close(devnull);
+		if (capture)
+		{
+			dup2(out_pipe[1], STDOUT_FILENO);
+			dup2(err_pipe[1], STDERR_FILENO);
+			close(out_pipe[0]);
+			close(out_pipe[1]);
+			close(err_pipe[0]);
+			close(err_pipe[1]);
+		}
+		
+		parse_string(cmd);
+		fflush(stdout);
+		fflush(stderr);
+		_exit(last_status);
+	}
+	
+	if (capture)
+	{
+		close(out_pipe[1]);
+		close(err_pipe[1]);
+	}
+	if (pid < 0)
+	{
+		perror("fork");
+		if (capture)
+		{
+			close(out_pipe[0]);
+			close(err_pipe[0]);
+		}
+		serve_error(c, "error fork failed\n");
+		return;
+	}
+	
+	c->pid = pid;
+	c->busy = 1;
+	c->pidfd = syscall(SYS_pidfd_open, pid, 0);
+	if (c->pidfd < 0)
+	{
+		// without a pidfd there's nothing to wake the loop, so wait here
+		int status;
+		waitpid(pid, &status, 0);
+		c->status = exit_status(status);
+		clock_gettime(CLOCK_MONOTONIC, &c->end);
+	}
+	else
+	{
+		serve_watch(c, c->pidfd, EPOLLIN);
+	}
+	
+	if (capture)
+	{
+		c->out_fd = out_pipe[0];
+		c->err_fd = err_pipe[0];
+		fcntl(c->out_fd, F_SETFL, O_NONBLOCK);
+		fcntl(c->err_fd, F_SETFL, O_NONBLOCK);
+		serve_watch(c, c->out_fd, EPOLLIN);
+		serve_watch(c, c->err_fd, EPOLLIN);
+	}
+}
+
+void serve_watch(struct serve_client* c, int fd, int events)
+{
+	struct epoll_event ev;
+	
+	if (fd >= serve_owner_size)
+	{
+		int size = serve_owner_size ? serve_owner_size : 64;
+		while (size <= fd)
+			size *= 2;
+		serve_owner = realloc(serve_owner, size * sizeof(struct serve_client*));
+		memset(serve_owner + serve_owner_size, 0, (size - serve_owner_size) * sizeof(struct serve_client*));
+		serve_owner_size = size;
+	}
+	serve_owner[fd] = c;
+	
+	ev.events = events;
+	ev.data.fd = fd;
+	epoll_ctl(serve_epoll, EPOLL_CTL_ADD, fd, &ev);
+}
+
+void serve_unwatch(struct serve_client* c, int fd, int do_close)
+{
+	(void)c;
+	epoll_ctl(serve_epoll, EPOLL_CTL_DEL, fd, NULL);
+	if (do_close)
+	{
+		serve_owner[fd] = NULL;
+		close(fd);
+	}
+}
+
+void serve_error(struct serve_client* c, const char* msg)
+{
+	sb_append(&c->reply, msg, strlen(msg));
+	serve_flush(c);
+}
+
+void serve_flush(struct serve_client* c)
+{
+	struct epoll_event ev;
+	
+	if (c->sock < 0)
+	{
+		// nobody left to send it to
+		c->reply_sent = c->reply.len;
+	}
+	while (c->reply_sent < c->reply.len)
+	{
+		ssize_t n = write(c->sock, c->reply.data + c->reply_sent, c->reply.len - c->reply_sent);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+		{
+			// the rest goes out when the socket has room again
+			if (!c->want_out)
+			{
+				ev.events = EPOLLIN | EPOLLOUT;
+				ev.data.fd = c->sock;
+				epoll_ctl(serve_epoll, EPOLL_CTL_MOD, c->sock, &ev);
+				c->want_out = 1;
+			}
+			return;
+		}
+		if (n < 0)
+		{
+			// the client is gone, drop the reply
+			c->closing = 1;
+			c->reply_sent = c->reply.len;
+			break;
+		}
+		c->reply_sent += n;
+	}
+	
+	c->reply.len = 0;
+	c->reply_sent = 0;
+	if (c->want_out && c->sock >= 0)
+	{
+		ev.events = c->closing ? 0 : EPOLLIN;
+		ev.data.fd = c->sock;
+		epoll_ctl(serve_epoll, EPOLL_CTL_MOD, c->sock, &ev);
+		c->want_out = 0;
+	}
+}
+
+int serve_read(struct strbuf* sb, int fd)
+{
+	while (1)
+	{
+		if (sb->cap - sb->len < 4096)
+		{
+			size_t cap = sb->cap < 4096 ? 8192 : sb->cap * 2;
+			sb->data = realloc(sb->data, cap);
+			sb->cap = cap;
+		}
+		
+		ssize_t n = read(fd, sb->data + sb->len, sb->cap - sb->len - 1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return 1;
+		if (n <= 0)
+			return 0;
+		
+		sb->len += n;
+		sb->data[sb->len] = '\0';
+	}
+}
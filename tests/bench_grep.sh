@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# Times the grep builtin against the real grep on the searches the builtin
+# handles. Each search runs REPEAT times from one batch file with output to
+# a file (GNU grep stops early when stdout is /dev/null), over a file of
+# about 25MB made from copies of shell.c, so it is in the page cache.
+# Usage: tests/bench_grep.sh [repeat]
+
+cd "$(dirname "$0")" || exit 1
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+gcc -O2 -Wall -pthread -o "$tmp/shell" ../shell.c ../line_edit.c || exit 1
+real=$(command -v grep)
+repeat=${1:-10}
+
+i=0
+while [ $i -lt 100 ]; do
+	cat ../shell.c
+	i=$((i + 1))
+done > "$tmp/big.txt"
+# long lines full of what the stars in the last search can take
+awk 'BEGIN { s = "x"; for (i = 0; i < 200; i++) s = s "a"; for (i = 0; i < 10000; i++) print s "z" }' > "$tmp/stars.txt"
+cp ../octopus.txt "$tmp"
+cd "$tmp" || exit 1
+cat big.txt > /dev/null
+
+# time_batch GREP ARGS... prints the average milliseconds one run takes
+time_batch()
+{
+	cmd=$1
+	shift
+	: > batch
+	i=0
+	while [ $i -lt "$repeat" ]; do
+		echo "$cmd $* > out" >> batch
+		i=$((i + 1))
+	done
+	start=$(date +%s%N)
+	./shell batch < /dev/null
+	end=$(date +%s%N)
+	awk -v ns=$((end - start)) -v n="$repeat" 'BEGIN { printf "%.3f", ns / n / 1e6 }'
+}
+
+bench()
+{
+	printf '%-36s %10s ms %10s ms\n' "grep $*" "$(time_batch grep "$@")" "$(time_batch "$real" "$@")"
+}
+
+printf '%-36s %13s %13s\n' "" builtin "$real"
+bench -c octopus_never_there big.txt
+bench -c strcmp big.txt
+bench -n "'str.*len'" big.txt
+bench -vc e big.txt
+bench -F -c "'#include'" big.txt
+bench -c the octopus.txt
+bench -c "'x.*a*a*a*a*a*y'" stars.txt
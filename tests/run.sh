@@ -0,0 +1,29 @@
+#!/bin/sh
+#
+# Builds the shell and runs every tests/*.test batch file with it, comparing
+# what it prints (stdout and stderr) with the .out file of the same name.
+# Usage: tests/run.sh [name...]    e.g. tests/run.sh substitution
+
+cd "$(dirname "$0")" || exit 1
+bin=$(mktemp -d) || exit 1
+trap 'rm -rf "$bin"' EXIT
+
+gcc -Wall -pthread -o "$bin/shell" ../shell.c ../line_edit.c || exit 1
+
+if [ $# -eq 0 ]; then
+	set -- $(ls *.test | sed 's/\.test$//')
+fi
+
+failed=0
+for name in "$@"; do
+	if timeout 30 "$bin/shell" "$name.test" > "$bin/$name.got" 2>&1 < /dev/null &&
+	   diff -u "$name.out" "$bin/$name.got" > "$bin/$name.diff"; then
+		echo "ok    $name"
+	else
+		echo "FAIL  $name"
+		cat "$bin/$name.diff"
+		failed=$((failed + 1))
+	fi
+done
+
+[ $failed -eq 0 ]